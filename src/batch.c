@@ -0,0 +1,653 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+#define _GNU_SOURCE // for sendmmsg and recvmmsg
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+#include "batch.h"
+#include "ipop_log.h"
+#include "headers.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// the most a UDP_SEGMENT datagram may carry in total
+#define UDP_PAYLOAD_MAX 65507
+
+/**
+ * Prepares an empty transmit batch for `sock`, holding up to `size` datagrams
+ * of up to `segs` frames each. Both are clamped to IPOP_BATCH_MAX and
+ * IPOP_GSO_MAX_SEGS. With `aggregate` above 0, frames to the same address
+ * share container datagrams of up to that many bytes, as long as they fit.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+tx_batch_init(struct tx_batch *batch, int sock, int size, int segs,
+              int aggregate)
+{
+    if (size < 1) {
+        fprintf(stderr, "Bad batch size: %d\n", size);
+        return -1;
+    }
+    memset(batch, 0, sizeof(struct tx_batch));
+    batch->sock = sock;
+    batch->size = (size > IPOP_BATCH_MAX) ? IPOP_BATCH_MAX : size;
+    batch->segs = (segs < 1) ? 1 : segs;
+    if (batch->segs > IPOP_GSO_MAX_SEGS) batch->segs = IPOP_GSO_MAX_SEGS;
+    batch->aggregate = (aggregate < 0) ? 0 : aggregate;
+    if (batch->aggregate > UDP_PAYLOAD_MAX) batch->aggregate = UDP_PAYLOAD_MAX;
+    return 0;
+}
+
+/**
+ * Prepares an empty transmit batch of up to `size` datagrams that is flushed
+ * to `send_batch_func`. Since that takes every datagram in one piece, the
+ * header is copied into the headroom in front of the frame when the datagram
+ * is queued. Returns 0 on success, -1 on failure.
+ */
+int
+tx_batch_init_func(struct tx_batch *batch,
+                   int (*send_batch_func)(const char **bufs,
+                                          const size_t *lens, int count),
+                   int size)
+{
+    if (tx_batch_init(batch, -1, size, 1, 0) < 0) return -1;
+    batch->send_batch_func = send_batch_func;
+    return 0;
+}
+
+/**
+ * Prepares a batch that passes every datagram on to `handoff` (along with
+ * `ctx`) as soon as it is added, instead of queueing it. The address is NULL
+ * for datagrams that go to an upper layer. Returns 0 on success, -1 on
+ * failure.
+ */
+int
+tx_batch_init_handoff(struct tx_batch *batch,
+                      int (*handoff)(void *ctx, const void *hdr,
+                                     size_t hdr_len, const unsigned char *buf,
+                                     size_t len,
+                                     const struct sockaddr_in *addr),
+                      void *ctx)
+{
+    if (tx_batch_init(batch, -1, 1, 1, 0) < 0) return -1;
+    batch->handoff = handoff;
+    batch->handoff_ctx = ctx;
+    return 0;
+}
+
+/**
+ * Queues a datagram on a batch set up with tx_batch_init_func.
+ */
+static int
+func_batch_add(struct tx_batch *batch, const void *hdr, size_t hdr_len,
+               const unsigned char *buf, size_t len)
+{
+    unsigned char *start = (unsigned char *) buf - hdr_len;
+
+    // the same frame going to another peer needs another header in front of
+    // it, so the datagram queued with the old one has to leave first
+    if (tx_batch_holds(batch, buf) || batch->count >= batch->size) {
+        tx_batch_flush(batch);
+    }
+    if ((const unsigned char *) hdr != start) {
+        memcpy(start, hdr, hdr_len);
+    }
+    int i = batch->count++;
+    batch->func_bufs[i] = (const char *) start;
+    batch->func_lens[i] = hdr_len + len;
+    batch->iovs[batch->iov_count].iov_base = start;
+    batch->iovs[batch->iov_count].iov_len = hdr_len;
+    batch->iovs[batch->iov_count + 1].iov_base = (void *) buf;
+    batch->iovs[batch->iov_count + 1].iov_len = len;
+    batch->iov_count += 2;
+    return batch->count >= batch->size;
+}
+
+/**
+ * Tells whether a frame of `len` bytes (header included) for `addr` can be
+ * chained to the last queued datagram. The kernel cuts a UDP_SEGMENT datagram
+ * into pieces of the size of the first one, so only the last may be smaller.
+ */
+static int
+can_chain(const struct tx_batch *batch, size_t len,
+          const struct sockaddr_in *addr)
+{
+    if (batch->count == 0 || batch->segs < 2) return 0;
+    int i = batch->count - 1;
+    return batch->agg_counts[i] == 0 &&
+           batch->seg_counts[i] < batch->segs &&
+           len <= batch->seg_sizes[i] &&
+           batch->lens[i] == batch->seg_counts[i] * batch->seg_sizes[i] &&
+           batch->lens[i] + len <= UDP_PAYLOAD_MAX &&
+           batch->addrs[i].sin_port == addr->sin_port &&
+           batch->addrs[i].sin_addr.s_addr == addr->sin_addr.s_addr;
+}
+
+/**
+ * Tells whether a frame of `len` bytes for `addr`, behind the `hdr_len` byte
+ * header at `hdr`, can be packed into the last queued datagram. It must go to
+ * the same peer (with the same header), and the container must stay within
+ * the aggregate size. A datagram with a lone frame becomes a container then.
+ */
+static int
+can_aggregate(const struct tx_batch *batch, const void *hdr, size_t hdr_len,
+              size_t len, const struct sockaddr_in *addr)
+{
+    if (batch->count == 0 || batch->aggregate == 0) return 0;
+    int i = batch->count - 1;
+    size_t total = batch->lens[i] + AGG_PREFIX_LEN + len;
+    if (batch->agg_counts[i] == 0) {
+        if (batch->seg_counts[i] > 1) return 0;
+        total += AGG_MAGIC_LEN + AGG_PREFIX_LEN;
+    } else if (batch->agg_counts[i] >= IPOP_GSO_MAX_SEGS) {
+        return 0;
+    }
+    const struct iovec *first = batch->msgs[i].msg_hdr.msg_iov;
+    return total <= (size_t) batch->aggregate &&
+           batch->addrs[i].sin_port == addr->sin_port &&
+           batch->addrs[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+           first[0].iov_len == hdr_len &&
+           memcmp(first[0].iov_base, hdr, hdr_len) == 0;
+}
+
+/**
+ * Points iovs[index] at the length prefix of a `len` byte frame.
+ */
+static void
+set_prefix(struct tx_batch *batch, int index, size_t len)
+{
+    batch->prefixes[index] = htons((uint16_t) len);
+    batch->iovs[index].iov_base = &batch->prefixes[index];
+    batch->iovs[index].iov_len = AGG_PREFIX_LEN;
+}
+
+/**
+ * Turns the last queued datagram, which carries a lone frame, into a container
+ * by putting the magic and the length of the frame in front of it.
+ */
+static void
+start_container(struct tx_batch *batch)
+{
+    int i = batch->count - 1;
+    int frame = batch->iov_count - 1;
+    batch->iovs[frame + 2] = batch->iovs[frame];
+    batch->iovs[frame].iov_base = (void *) aggregate_magic;
+    batch->iovs[frame].iov_len = AGG_MAGIC_LEN;
+    set_prefix(batch, frame + 1, batch->iovs[frame + 2].iov_len);
+    batch->iov_count += 2;
+    batch->msgs[i].msg_hdr.msg_iovlen += 2;
+    batch->lens[i] += AGG_MAGIC_LEN + AGG_PREFIX_LEN;
+    batch->agg_counts[i] = 1;
+}
+
+/**
+ * Queues a datagram made of `hdr_len` bytes at `hdr` followed by `len` bytes
+ * at `buf`, to be sent to `addr` on the next flush. It is packed into the last
+ * queued datagram when aggregation allows it, or chained to it when UDP
+ * segmentation does. Nothing is copied. Returns
+ * 1 if the batch is full after adding the datagram (so it should be flushed),
+ * 0 otherwise.
+ */
+int
+tx_batch_add(struct tx_batch *batch, const void *hdr, size_t hdr_len,
+             const unsigned char *buf, size_t len,
+             const struct sockaddr_in *addr)
+{
+    int i;
+    if (batch->handoff != NULL) {
+        batch->handoff(batch->handoff_ctx, hdr, hdr_len, buf, len, addr);
+        return 0;
+    }
+    if (batch->send_batch_func != NULL) {
+        return func_batch_add(batch, hdr, hdr_len, buf, len);
+    }
+    if (can_aggregate(batch, hdr, hdr_len, len, addr)) {
+        i = batch->count - 1;
+        if (batch->agg_counts[i] == 0) start_container(batch);
+        set_prefix(batch, batch->iov_count, len);
+        batch->iovs[batch->iov_count + 1].iov_base = (void *) buf;
+        batch->iovs[batch->iov_count + 1].iov_len = len;
+        batch->iov_count += 2;
+        batch->msgs[i].msg_hdr.msg_iovlen += 2;
+        batch->lens[i] += AGG_PREFIX_LEN + len;
+        batch->agg_counts[i]++;
+        return batch->count >= batch->size &&
+               batch->agg_counts[i] >= IPOP_GSO_MAX_SEGS;
+    }
+    if (can_chain(batch, hdr_len + len, addr)) {
+        i = batch->count - 1;
+        batch->seg_counts[i]++;
+    } else {
+        if (batch->count >= batch->size) {
+            tx_batch_flush(batch);
+        }
+        i = batch->count++;
+        batch->addrs[i] = *addr;
+        batch->seg_counts[i] = 1;
+        batch->agg_counts[i] = 0;
+        batch->seg_sizes[i] = hdr_len + len;
+        batch->lens[i] = 0;
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[batch->iov_count];
+    }
+    struct iovec *iov = &batch->iovs[batch->iov_count];
+    iov[0].iov_base = (void *) hdr;
+    iov[0].iov_len = hdr_len;
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len = len;
+    batch->iov_count += 2;
+    batch->msgs[i].msg_hdr.msg_iovlen += 2;
+    batch->lens[i] += hdr_len + len;
+    return batch->count >= batch->size &&
+           batch->seg_counts[i] >= batch->segs;
+}
+
+/**
+ * The most frames a batch can hold at once, when every datagram is as full as
+ * segmentation or aggregation allows.
+ */
+int
+tx_batch_frames(const struct tx_batch *batch)
+{
+    int frames = batch->segs;
+    if (batch->aggregate > 0) frames = IPOP_GSO_MAX_SEGS;
+    return batch->size * frames;
+}
+
+/**
+ * Tells whether the most recently queued datagram carries the frame at `buf`,
+ * in which case the buffer must not be reused before the next flush.
+ */
+int
+tx_batch_holds(const struct tx_batch *batch, const unsigned char *buf)
+{
+    return batch->iov_count > 0 &&
+           batch->iovs[batch->iov_count - 1].iov_base == (void *) buf;
+}
+
+/**
+ * Attaches the UDP_SEGMENT control message to every datagram that chains
+ * more than one frame.
+ */
+static void
+set_segment_sizes(struct tx_batch *batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        if (batch->seg_counts[i] < 2) continue;
+        msg->msg_control = batch->ctrls[i].buf;
+        msg->msg_controllen = sizeof(batch->ctrls[i].buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t seg_size = (uint16_t) batch->seg_sizes[i];
+        memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(uint16_t));
+    }
+}
+
+/**
+ * Sends the frames of a UDP_SEGMENT datagram the kernel refused one by one. If
+ * that works, the socket or the route can not segment, so frames are no
+ * longer chained.
+ */
+static int
+send_segments(struct tx_batch *batch, int i)
+{
+    struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    int sent = 0;
+    for (size_t j = 0; j < msg->msg_iovlen; j += 2) {
+        struct msghdr seg = {
+            .msg_name = msg->msg_name,
+            .msg_namelen = msg->msg_namelen,
+            .msg_iov = msg->msg_iov + j,
+            .msg_iovlen = 2
+        };
+        if (sendmsg(batch->sock, &seg, 0) < 0) {
+            IPOP_LOG("sendto failed\n");
+        } else {
+            sent++;
+        }
+    }
+    if (sent > 0 && batch->segs > 1) {
+        fprintf(stderr, "UDP segmentation failed, sending frames one by "
+                        "one\n");
+        batch->segs = 1;
+    }
+    return sent;
+}
+
+/**
+ * Hands every datagram queued on a batch set up with tx_batch_init_func to the
+ * upper layer, offering whatever it did not take again.
+ */
+static int
+func_batch_flush(struct tx_batch *batch)
+{
+    int offset = 0;
+    while (offset < batch->count) {
+        int r = batch->send_batch_func(batch->func_bufs + offset,
+                                       batch->func_lens + offset,
+                                       batch->count - offset);
+        if (r <= 0) {
+            fprintf(stderr, "send_batch_func failed\n");
+            break;
+        }
+        offset += r;
+    }
+    batch->count = 0;
+    batch->iov_count = 0;
+    return offset;
+}
+
+/**
+ * Finds the run of queued datagrams from `offset` on that are all large
+ * enough for MSG_ZEROCOPY, or all too small for it, and stores where it ends
+ * in `end`. Returns the flags to send the run with. A run that would overflow
+ * the window of sends in flight waits for completions first, or is copied if
+ * that fails.
+ */
+static int
+zerocopy_run(struct tx_batch *batch, int offset, int *end)
+{
+    struct tx_zerocopy *zc = batch->zc;
+    int large = batch->lens[offset] >= batch->zc_min;
+    int i = offset + 1;
+
+    while (i < batch->count && (batch->lens[i] >= batch->zc_min) == large) i++;
+    *end = i;
+    if (!large || zc->off) return 0;
+    while (zc->next + (i - offset) - zc->done > TX_ZC_WINDOW) {
+        if (tx_zerocopy_reap(zc, 1) < 0) return 0;
+    }
+    return MSG_ZEROCOPY;
+}
+
+/**
+ * Sends every queued datagram. A datagram that the kernel refuses is reported
+ * and skipped, so one unreachable peer does not hold back the rest of the
+ * batch, unless it was refused for its segmentation, in which case its frames
+ * are sent one by one. With zerocopy on, a run the kernel has no room to pin
+ * is copied instead. Returns the number of datagrams that were sent.
+ */
+int
+tx_batch_flush(struct tx_batch *batch)
+{
+    int sent = 0, offset = 0, copy = 0;
+    if (batch->send_batch_func != NULL) {
+        return func_batch_flush(batch);
+    }
+    set_segment_sizes(batch);
+    while (offset < batch->count) {
+        int end = batch->count, flags = 0;
+        if (batch->zc != NULL) flags = zerocopy_run(batch, offset, &end);
+        if (copy) flags = copy = 0;
+        int r = sendmmsg(batch->sock, batch->msgs + offset, end - offset,
+                         flags);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (flags && errno == ENOBUFS) {
+                copy = 1;
+                continue;
+            }
+            if (batch->seg_counts[offset] > 1 &&
+                (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                sent += send_segments(batch, offset);
+            } else {
+                IPOP_LOG("sendto failed\n");
+            }
+            offset++;
+            continue;
+        }
+        if (flags) batch->zc->next += r;
+        offset += r;
+        sent += r;
+    }
+    batch->count = 0;
+    batch->iov_count = 0;
+    return sent;
+}
+
+/**
+ * Sends the datagrams of at least `min_len` bytes of the batch with
+ * MSG_ZEROCOPY from now on, numbered by `zc`, which must be set up for the
+ * socket of the batch. Smaller ones are cheaper to copy than to pin.
+ */
+void
+tx_batch_set_zerocopy(struct tx_batch *batch, struct tx_zerocopy *zc,
+                      size_t min_len)
+{
+    batch->zc = zc;
+    batch->zc_min = min_len;
+}
+
+/**
+ * Turns SO_ZEROCOPY on for `sock` and prepares `zc` to keep track of its sends.
+ * Returns 0 on success, -1 if the kernel does not support it.
+ */
+int
+tx_zerocopy_init(struct tx_zerocopy *zc, int sock)
+{
+    int on = 1;
+
+    memset(zc, 0, sizeof(struct tx_zerocopy));
+    zc->sock = sock;
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "SO_ZEROCOPY is not supported\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the completions the kernel queued for the sends of `zc`, and moves
+ * zc->done past every send that is complete. With `block` set, and sends in
+ * flight, it waits for a completion first. Returns 0 on success, -1 on
+ * failure.
+ */
+int
+tx_zerocopy_reap(struct tx_zerocopy *zc, int block)
+{
+    if (block && zc->next != zc->done) {
+        // a queued completion makes the socket report POLLERR
+        struct pollfd pfd = { .fd = zc->sock, .events = 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed\n");
+            return -1;
+        }
+    }
+    while (1) {
+        union {
+            char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_in))];
+            struct cmsghdr align;
+        } ctrl;
+        struct msghdr msg = {
+            .msg_control = ctrl.buf,
+            .msg_controllen = sizeof(ctrl.buf)
+        };
+        if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            fprintf(stderr, "reading zerocopy completions failed\n");
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // sends ee_info to ee_data, both included
+            uint32_t count = err.ee_data - err.ee_info + 1;
+            zc->completed += count;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc->copied += count;
+            for (uint32_t i = 0; i < count; i++) {
+                zc->complete[(err.ee_info + i) & (TX_ZC_WINDOW - 1)] = 1;
+            }
+        }
+    }
+    while (zc->done != zc->next &&
+           zc->complete[zc->done & (TX_ZC_WINDOW - 1)]) {
+        zc->complete[zc->done & (TX_ZC_WINDOW - 1)] = 0;
+        zc->done++;
+    }
+    if (!zc->off && zc->completed >= TX_ZC_PROBE &&
+        zc->copied == zc->completed) {
+        fprintf(stderr, "the kernel copies every zerocopy send, sending "
+                        "with copies\n");
+        zc->off = 1;
+    }
+    return 0;
+}
+
+/**
+ * Prepares a receive batch of `size` (clamped to IPOP_BATCH_MAX) buffers of
+ * `buflen` bytes, laid out back to back in `bufs`. With `gro` set, UDP_GRO is
+ * turned on for the socket, and the buffers should be RX_GRO_BUFLEN bytes.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+rx_batch_init(struct rx_batch *batch, int sock, unsigned char *const *bufs,
+              size_t buflen, int size, int gro)
+{
+    if (size < 1) {
+        fprintf(stderr, "Bad batch size: %d\n", size);
+        return -1;
+    }
+    memset(batch, 0, sizeof(struct rx_batch));
+    batch->sock = sock;
+    batch->size = (size > IPOP_BATCH_MAX) ? IPOP_BATCH_MAX : size;
+    if (gro) {
+        int on = 1;
+        if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "UDP_GRO is not supported, receiving datagrams "
+                            "one by one\n");
+        } else {
+            batch->gro = 1;
+        }
+    }
+    for (int i = 0; i < batch->size; i++) {
+        batch->iovs[i].iov_base = bufs[i];
+        batch->iovs[i].iov_len = buflen;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+/**
+ * Blocks until at least one datagram arrived, then takes every datagram that
+ * is already queued on the socket, up to the batch size. The length of the
+ * i-th datagram is found in msgs[i].msg_len, its data in iovs[i].iov_base.
+ * Returns the number of datagrams received, or -1 on failure.
+ */
+int
+rx_batch_recv(struct rx_batch *batch)
+{
+    int r;
+    if (batch->gro) {
+        // the kernel shrinks msg_controllen to what it wrote
+        for (int i = 0; i < batch->size; i++) {
+            batch->msgs[i].msg_hdr.msg_control = batch->ctrls[i].buf;
+            batch->msgs[i].msg_hdr.msg_controllen =
+                sizeof(batch->ctrls[i].buf);
+        }
+    }
+    do {
+        r = recvmmsg(batch->sock, batch->msgs, batch->size, MSG_WAITFORONE,
+                     NULL);
+    } while (r < 0 && errno == EINTR);
+    // a datagram larger than its buffer lost its tail, drop it whole
+    for (int i = 0; i < r; i++) {
+        if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            batch->msgs[i].msg_len = 0;
+            batch->truncated++;
+            IPOP_LOG("dropped truncated datagram (%lu so far)\n",
+                     batch->truncated);
+        }
+    }
+    return r;
+}
+
+/**
+ * Returns the size of the datagrams the kernel coalesced into the i-th buffer
+ * of the last rx_batch_recv call. Every one of them but the last has exactly
+ * that size. If nothing was coalesced, this is the length of the buffer's only
+ * datagram.
+ */
+int
+rx_batch_segment_size(const struct rx_batch *batch, int i)
+{
+    const struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    if (batch->gro) {
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR((struct msghdr *) msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int seg_size;
+                memcpy(&seg_size, CMSG_DATA(cmsg), sizeof(int));
+                if (seg_size > 0) return seg_size;
+            }
+        }
+    }
+    return batch->msgs[i].msg_len;
+}
+#endif
@@ -0,0 +1,176 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "ipop_tap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// most datagrams sent with MSG_ZEROCOPY that can be in flight at once, a
+// power of two
+#define TX_ZC_WINDOW 16384
+// completions after which zerocopy is given up if the kernel copied every one
+#define TX_ZC_PROBE 1024
+
+// The datagrams a socket sent with MSG_ZEROCOPY. The kernel numbers these
+// sends, and their memory belongs to it until it reports them complete on the
+// error queue of the socket, in ranges of those numbers. Where the kernel has
+// to copy anyway (such as for peers on the same host) zerocopy only adds to
+// the cost, so it is turned off once that is all the kernel ever did.
+struct tx_zerocopy {
+    int sock;
+    int off; // new sends are copied
+    uint32_t next; // number of the next send
+    uint32_t done; // every send before this one is complete
+    unsigned long long completed; // sends reported complete
+    unsigned long long copied; // sends the kernel ended up copying anyway
+    unsigned char complete[TX_ZC_WINDOW]; // sends past `done`, by number
+};
+
+// Outgoing datagrams that are held back until the batch is flushed with a
+// single sendmmsg call. Every datagram is gathered from a header and a frame.
+// The batch does not own either, the caller must not reuse a buffer until the
+// batch no longer holds it. With segs > 1, consecutive datagrams to the same
+// address are chained into one UDP_SEGMENT datagram that the kernel (or the
+// NIC) splits up again. With aggregate set, small frames to the same address
+// are packed into one container datagram of up to that many bytes instead (see
+// headers.h). A batch set up with tx_batch_init_func is flushed to
+// an upper layer's send_batch_func instead of a socket. One set up with
+// tx_batch_init_handoff queues nothing, every datagram is passed on to its
+// handoff function right away, for another thread to send. With zc set,
+// datagrams of at least zc_min bytes are sent with MSG_ZEROCOPY, so the
+// buffers must be kept until zc says the kernel is done with them.
+struct tx_batch {
+    int sock;
+    int (*send_batch_func)(const char **bufs, const size_t *lens, int count);
+    int (*handoff)(void *ctx, const void *hdr, size_t hdr_len,
+                   const unsigned char *buf, size_t len,
+                   const struct sockaddr_in *addr);
+    void *handoff_ctx;
+    const char *func_bufs[IPOP_BATCH_MAX];
+    size_t func_lens[IPOP_BATCH_MAX];
+    int size; // how many datagrams to hold before the batch is full
+    int segs; // how many frames may share one UDP_SEGMENT datagram
+    int aggregate; // largest container datagram, 0 if frames go alone
+    struct tx_zerocopy *zc;
+    size_t zc_min;
+    int count;
+    int iov_count;
+    struct mmsghdr msgs[IPOP_BATCH_MAX];
+    // a container takes two more for the magic, and has at most
+    // IPOP_GSO_MAX_SEGS frames as well
+    struct iovec iovs[IPOP_BATCH_MAX * (IPOP_GSO_MAX_SEGS + 1) * 2];
+    uint16_t prefixes[IPOP_BATCH_MAX * (IPOP_GSO_MAX_SEGS + 1) * 2];
+    struct sockaddr_in addrs[IPOP_BATCH_MAX];
+    int seg_counts[IPOP_BATCH_MAX];
+    int agg_counts[IPOP_BATCH_MAX]; // frames in a container, 0 for none
+    size_t seg_sizes[IPOP_BATCH_MAX]; // size of every segment but the last
+    size_t lens[IPOP_BATCH_MAX];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctrls[IPOP_BATCH_MAX];
+};
+
+// size of a receive buffer that can take any coalesced UDP_GRO datagram
+#define RX_GRO_BUFLEN 65535
+
+// Buffers for incoming datagrams, filled by a single recvmmsg call. With gro
+// set, the kernel may hand over several datagrams of the same size from the
+// same sender in one buffer, see rx_batch_segment_size.
+struct rx_batch {
+    int sock;
+    int size;
+    int gro;
+    unsigned long truncated;
+    struct mmsghdr msgs[IPOP_BATCH_MAX];
+    struct iovec iovs[IPOP_BATCH_MAX];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrls[IPOP_BATCH_MAX];
+};
+
+int tx_batch_init(struct tx_batch *batch, int sock, int size, int segs,
+                  int aggregate);
+int tx_batch_init_func(struct tx_batch *batch,
+                       int (*send_batch_func)(const char **bufs,
+                                              const size_t *lens, int count),
+                       int size);
+int tx_batch_init_handoff(struct tx_batch *batch,
+                          int (*handoff)(void *ctx, const void *hdr,
+                                         size_t hdr_len,
+                                         const unsigned char *buf, size_t len,
+                                         const struct sockaddr_in *addr),
+                          void *ctx);
+int tx_batch_add(struct tx_batch *batch, const void *hdr, size_t hdr_len,
+                 const unsigned char *buf, size_t len,
+                 const struct sockaddr_in *addr);
+int tx_batch_frames(const struct tx_batch *batch);
+int tx_batch_holds(const struct tx_batch *batch, const unsigned char *buf);
+int tx_batch_flush(struct tx_batch *batch);
+void tx_batch_set_zerocopy(struct tx_batch *batch, struct tx_zerocopy *zc,
+                           size_t min_len);
+
+int tx_zerocopy_init(struct tx_zerocopy *zc, int sock);
+int tx_zerocopy_reap(struct tx_zerocopy *zc, int block);
+
+/**
+ * Tells whether every send with MSG_ZEROCOPY that was made before zc->next
+ * was `mark` is complete.
+ */
+static inline int
+tx_zerocopy_passed(const struct tx_zerocopy *zc, uint32_t mark)
+{
+    return (int32_t) (zc->done - mark) >= 0;
+}
+
+int rx_batch_init(struct rx_batch *batch, int sock,
+                  unsigned char *const *bufs, size_t buflen, int size, int gro);
+int rx_batch_recv(struct rx_batch *batch);
+int rx_batch_segment_size(const struct rx_batch *batch, int i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
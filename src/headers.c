@@ -47,3 +47,71 @@ set_headers(unsigned char *buf, const char *source_id, const char *dest_id)
     memcpy(buf + ID_SIZE, dest_id, ID_SIZE);
     return 0;
 }
+
+/**
+ * Writes a compact link header with the given flags, epoch and index to the
+ * COMPACT_HDR_LEN bytes at `buf`.
+ */
+int
+set_compact_header(unsigned char *buf, int flags, int epoch, int index)
+{
+    epoch &= COMPACT_FIELD_MASK;
+    index &= COMPACT_FIELD_MASK;
+    buf[0] = (COMPACT_VERSION << 4) | (flags & 0x0F);
+    buf[1] = epoch >> 4;
+    buf[2] = ((epoch & 0x0F) << 4) | (index >> 8);
+    buf[3] = index & 0xFF;
+    return 0;
+}
+
+/**
+ * Reads the compact link header at `buf`. Returns -1 if it is of another
+ * version, 0 otherwise.
+ */
+int
+get_compact_header(const unsigned char *buf, int *flags, int *epoch,
+                   int *index)
+{
+    if ((buf[0] >> 4) != COMPACT_VERSION) return -1;
+    *flags = buf[0] & 0x0F;
+    *epoch = (buf[1] << 4) | (buf[2] >> 4);
+    *index = ((buf[2] & 0x0F) << 8) | buf[3];
+    return 0;
+}
+
+// a locally administered unicast MAC address ("ipopA"), which is an invalid
+// IP version for the packets of a tun device
+const unsigned char aggregate_magic[AGG_MAGIC_LEN] = {
+    0x02, 0x69, 0x70, 0x6f, 0x70, 0x41
+};
+
+/**
+ * Tells whether the `len` bytes at `buf` that follow the ipop header are a
+ * container of several frames.
+ */
+int
+is_aggregate(const unsigned char *buf, int len)
+{
+    return len >= AGG_MAGIC_LEN &&
+           memcmp(buf, aggregate_magic, AGG_MAGIC_LEN) == 0;
+}
+
+/**
+ * Walks the frames of the `len` byte container at `buf`. `offset` must start
+ * at 0 and is moved past each frame. Returns the next frame and writes its
+ * length to `frame_len`, or returns NULL once there are no more frames or the
+ * rest of the container is cut short.
+ */
+const unsigned char *
+get_aggregate_frame(const unsigned char *buf, int len, int *offset,
+                    int *frame_len)
+{
+    if (*offset < AGG_MAGIC_LEN) *offset = AGG_MAGIC_LEN;
+    if (*offset + AGG_PREFIX_LEN > len) return NULL;
+    int flen = (buf[*offset] << 8) | buf[*offset + 1];
+    const unsigned char *frame = buf + *offset + AGG_PREFIX_LEN;
+    if (flen == 0 || *offset + AGG_PREFIX_LEN + flen > len) return NULL;
+    *offset += AGG_PREFIX_LEN + flen;
+    *frame_len = flen;
+    return frame;
+}
@@ -32,10 +32,45 @@
 extern "C" {
 #endif
 
+// Small frames for the same peer may share one container datagram. After the
+// ipop header it carries AGG_MAGIC_LEN bytes of aggregate_magic, which sit
+// where the destination MAC (or the IP version) of a frame would be, then
+// every frame preceded by its length as a 16-bit big-endian number.
+#define AGG_MAGIC_LEN 6
+#define AGG_PREFIX_LEN 2
+
+extern const unsigned char aggregate_magic[AGG_MAGIC_LEN];
+
+// In direct mode a compact link header may replace the ipop header. It holds
+// the version (high nibble) and the flags (low nibble), then a 12-bit epoch
+// and a 12-bit index, both big-endian, which is the index the receiver gave
+// the sender under the receiver's epoch, so the receiver finds the sender by
+// an array lookup. Peers
+// learn their indexes from HELLO headers, which carry the epoch and the index
+// of the sender instead, followed by the 20-byte id of the sender. A HELLO
+// with ASK set comes from a sender that does not know its index yet, so the
+// receiver answers with a HELLO of its own.
+#define COMPACT_HDR_LEN 4
+#define COMPACT_HELLO_LEN (COMPACT_HDR_LEN + 20)
+#define COMPACT_VERSION 2
+#define COMPACT_FIELD_MASK 0xFFF // of the epoch and the index
+#define COMPACT_F_HELLO 0x01
+#define COMPACT_F_ASK 0x02
+
 int get_headers(unsigned const char *buf, char *source_id, char *dest_id);
 
 int set_headers(unsigned char *buf, const char *source_id, const char *dest_id);
 
+int set_compact_header(unsigned char *buf, int flags, int epoch, int index);
+
+int get_compact_header(const unsigned char *buf, int *flags, int *epoch,
+                       int *index);
+
+int is_aggregate(const unsigned char *buf, int len);
+
+const unsigned char *get_aggregate_frame(const unsigned char *buf, int len,
+                                         int *offset, int *frame_len);
+
 #ifdef __cplusplus
 }
 #endif
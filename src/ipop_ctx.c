@@ -0,0 +1,101 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ipop_ctx.h"
+#include "peerlist.h"
+#include "translator.h"
+#if defined(LINUX) || defined(ANDROID)
+#include "tap.h"
+#endif
+
+// the context of the functions that take none, its parts are set up as
+// they are used
+static struct ipop_ctx default_ctx = {
+    .peers = &peerlist_default,
+#if defined(LINUX) || defined(ANDROID)
+    .tap = &tap_default,
+#endif
+    .upnp = &upnp_default,
+};
+
+/**
+ * Creates the context of another virtual network, with an empty peerlist and
+ * no tap device yet. Returns NULL on failure.
+ */
+struct ipop_ctx *
+ipop_ctx_new()
+{
+    struct ipop_ctx *ctx = calloc(1, sizeof(struct ipop_ctx));
+    if (ctx == NULL) {
+        fprintf(stderr, "Not enough memory to allocate context.\n");
+        return NULL;
+    }
+    ctx->peers = peerlist_new();
+#if defined(LINUX) || defined(ANDROID)
+    ctx->tap = tap_state_new();
+    if (ctx->tap == NULL) {
+        ipop_ctx_free(ctx);
+        return NULL;
+    }
+#endif
+    ctx->upnp = upnp_state_new();
+    if (ctx->peers == NULL || ctx->upnp == NULL) {
+        ipop_ctx_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Frees a context made by ipop_ctx_new, with its peers. The tap device has to
+ * be closed and the threads of the context stopped before.
+ */
+void
+ipop_ctx_free(struct ipop_ctx *ctx)
+{
+    if (ctx == NULL || ctx == &default_ctx) return;
+    if (ctx->peers != NULL) peerlist_free(ctx->peers);
+#if defined(LINUX) || defined(ANDROID)
+    if (ctx->tap != NULL) tap_state_free(ctx->tap);
+#endif
+    if (ctx->upnp != NULL) upnp_state_free(ctx->upnp);
+    free(ctx);
+}
+
+/**
+ * Returns the context the functions without one work on, which lives for as
+ * long as the process.
+ */
+struct ipop_ctx *
+ipop_ctx_default()
+{
+    return &default_ctx;
+}
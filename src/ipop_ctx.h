@@ -0,0 +1,67 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _IPOP_CTX_H_
+#define _IPOP_CTX_H_
+
+#define WIN32_EXPORT __declspec(dllexport)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct peerlist;
+struct tap_state;
+struct upnp_state;
+
+// Everything one virtual network keeps besides its threads: the peers, the
+// tap device and what the translator learned. A process can drive several
+// networks, each through its own context, which the packet threads get with
+// thread_opts_t.ctx. The functions that take no context work on the default
+// one, see ipop_ctx_default.
+struct ipop_ctx {
+    struct peerlist *peers;
+    struct tap_state *tap; // NULL on windows, see win32_tap.h
+    struct upnp_state *upnp;
+};
+
+#if defined(LINUX) || defined(ANDROID)
+struct ipop_ctx *ipop_ctx_new();
+void ipop_ctx_free(struct ipop_ctx *ctx);
+struct ipop_ctx *ipop_ctx_default();
+#elif defined(WIN32)
+WIN32_EXPORT struct ipop_ctx *ipop_ctx_new();
+WIN32_EXPORT void ipop_ctx_free(struct ipop_ctx *ctx);
+WIN32_EXPORT struct ipop_ctx *ipop_ctx_default();
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ipop_log.h"
+#if defined(LINUX)
+#include "ring.h"
+#endif
+
+// what a thread hands the log thread
+struct log_entry {
+    struct ipop_log_site *site;
+    unsigned long long skipped; // occurrences held back before this one
+    char msg[IPOP_LOG_MSG_LEN];
+};
+
+static struct ipop_log_site *sites; // every site that logged so far
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(LINUX)
+// The ring of one thread, it stays around after the thread exits so that
+// nothing it logged is lost.
+struct log_ring {
+    struct spsc_ring ring;
+    struct log_ring *next;
+};
+
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *thread_ring;
+static __thread int thread_ring_failed;
+static int running;
+static pthread_t log_thread;
+#endif
+
+static unsigned long long
+now_ms()
+{
+    struct timespec now;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Writes a message of `site` to stderr, preceded by how many of its
+ * occurrences were held back since it last printed.
+ */
+static void
+write_entry(struct ipop_log_site *site, unsigned long long skipped,
+            const char *msg)
+{
+    pthread_mutex_lock(&write_lock);
+    if (skipped > 0) {
+        fprintf(stderr, "(%llu more) %s", skipped,
+                site->last[0] != '\0' ? site->last : site->fmt);
+    }
+    if (msg != NULL) {
+        fputs(msg, stderr);
+        strcpy(site->last, msg);
+    }
+    pthread_mutex_unlock(&write_lock);
+}
+
+/**
+ * Claims the next print of `site` if its interval is over. Returns 1 if the
+ * caller may print, 0 if the occurrence is only counted.
+ */
+static int
+claim_site(struct ipop_log_site *site, unsigned long long now)
+{
+    unsigned long long next = __atomic_load_n(&site->next_ms, __ATOMIC_RELAXED);
+    return now >= next &&
+           __atomic_compare_exchange_n(&site->next_ms, &next,
+                                       now + IPOP_LOG_INTERVAL_MS, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void
+register_site(struct ipop_log_site *site)
+{
+    if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL)) return;
+    site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sites, &site->next, site, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Prints the occurrences that `site` held back, if its interval is over or
+ * `force` is set.
+ */
+static void
+flush_site(struct ipop_log_site *site, unsigned long long now, int force)
+{
+    if (__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED) == 0) return;
+    if (!force && !claim_site(site, now)) return;
+    unsigned long long skipped =
+        __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    if (skipped > 0) write_entry(site, skipped, NULL);
+}
+
+#if defined(LINUX)
+/**
+ * The ring of the calling thread, set up on first use. Returns NULL if there
+ * is none, then the thread writes its messages itself.
+ */
+static struct spsc_ring *
+get_thread_ring()
+{
+    if (thread_ring != NULL) return &thread_ring->ring;
+    if (thread_ring_failed) return NULL;
+    // the ends of the ring are aligned to cache lines, so is the ring
+    void *mem = NULL;
+    if (posix_memalign(&mem, RING_ALIGN, sizeof(struct log_ring)) != 0) {
+        mem = NULL;
+    }
+    struct log_ring *r = mem;
+    if (r == NULL || spsc_ring_init(&r->ring, IPOP_LOG_RING,
+                                    sizeof(struct log_entry)) < 0) {
+        free(r);
+        thread_ring_failed = 1;
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = r;
+    return &r->ring;
+}
+
+/**
+ * Writes out everything waiting in the rings, and the summaries of the sites
+ * that are due. With `force` every site prints what it held back.
+ */
+static void
+drain(int force)
+{
+    struct log_entry entry;
+    struct log_ring *r;
+
+    pthread_mutex_lock(&rings_lock);
+    r = rings;
+    pthread_mutex_unlock(&rings_lock);
+    // rings are only ever added at the head, so the rest of the list is safe
+    // to walk without the lock
+    for (; r != NULL; r = r->next) {
+        while (spsc_ring_pop(&r->ring, &entry) == 0) {
+            write_entry(entry.site, entry.skipped, entry.msg);
+        }
+    }
+    unsigned long long now = now_ms();
+    struct ipop_log_site *site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    for (; site != NULL; site = site->next) flush_site(site, now, force);
+}
+
+static void *
+log_thread_main(void *data)
+{
+    struct timespec pause = {
+        .tv_sec = IPOP_LOG_FLUSH_MS / 1000,
+        .tv_nsec = (IPOP_LOG_FLUSH_MS % 1000) * 1000000L
+    };
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        nanosleep(&pause, NULL);
+        drain(0);
+    }
+    return NULL;
+}
+#endif
+
+void
+ipop_log_at(struct ipop_log_site *site, const char *fmt, ...)
+{
+    struct log_entry entry;
+    va_list ap;
+
+    __atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&site->registered, __ATOMIC_RELAXED)) {
+        register_site(site);
+    }
+    if (!claim_site(site, now_ms())) {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    va_start(ap, fmt);
+    int n = vsnprintf(entry.msg, sizeof(entry.msg), fmt, ap);
+    va_end(ap);
+    if (n >= (int) sizeof(entry.msg)) entry.msg[sizeof(entry.msg) - 2] = '\n';
+    entry.site = site;
+    entry.skipped = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+#if defined(LINUX)
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        struct spsc_ring *ring = get_thread_ring();
+        if (ring != NULL) {
+            if (spsc_ring_push(ring, &entry) < 0) {
+                // the log thread is behind, the message turns into a count
+                __atomic_fetch_add(&site->dropped, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&site->suppressed, entry.skipped + 1,
+                                   __ATOMIC_RELAXED);
+            }
+            return;
+        }
+    }
+#endif
+    write_entry(site, entry.skipped, entry.msg);
+}
+
+/**
+ * Starts the thread that writes the messages of IPOP_LOG to stderr. Without
+ * it (and on other platforms than linux) every thread writes its own.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ipop_log_start()
+{
+#if defined(LINUX)
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return 0;
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        fprintf(stderr, "could not start the log thread\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Stops the log thread and writes out what is left, with the number of
+ * occurrences of every site that logged more than once. Meant for when the
+ * process is done, a thread that logs after this writes its messages itself.
+ */
+void
+ipop_log_stop()
+{
+#if defined(LINUX)
+    if (__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL)) {
+        pthread_join(log_thread, NULL);
+    }
+    drain(1);
+#else
+    unsigned long long now = now_ms();
+    struct ipop_log_site *site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    for (; site != NULL; site = site->next) flush_site(site, now, 1);
+#endif
+    struct ipop_log_site *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = s->next) {
+        if (s->count < 2) continue;
+        fprintf(stderr, "%s:%d: %llu occurrences, %llu dropped\n", s->file,
+                s->line, s->count, s->dropped);
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _IPOP_LOG_H_
+#define _IPOP_LOG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IPOP_LOG_RING 256 // messages a thread can have waiting to be written
+#define IPOP_LOG_MSG_LEN 128 // longer messages are cut
+#define IPOP_LOG_INTERVAL_MS 1000 // a site prints at most once this often
+#define IPOP_LOG_FLUSH_MS 100 // how often the log thread empties the rings
+
+// One place in the code that logs, see IPOP_LOG.
+struct ipop_log_site {
+    const char *file;
+    int line;
+    const char *fmt;
+    int registered;
+    unsigned long long next_ms; // when the site may print again
+    unsigned long long suppressed; // occurrences held back since it printed
+    unsigned long long count; // all occurrences
+    unsigned long long dropped; // messages lost to a full ring
+    char last[IPOP_LOG_MSG_LEN]; // what it printed last, owned by the writer
+    struct ipop_log_site *next;
+};
+
+/**
+ * Logs a message from the packet path. The calling thread only formats it
+ * into a ring of its own, the log thread writes it to stderr. Each call site
+ * prints at most once every IPOP_LOG_INTERVAL_MS, the occurrences in between
+ * are counted and printed as one summary. Before ipop_log_start the message
+ * is written right away, still rate limited.
+ */
+#define IPOP_LOG(...) do { \
+    static struct ipop_log_site ipop_log_site_ = { \
+        .file = __FILE__, .line = __LINE__, .fmt = IPOP_LOG_FIRST(__VA_ARGS__) \
+    }; \
+    ipop_log_at(&ipop_log_site_, __VA_ARGS__); \
+} while (0)
+#define IPOP_LOG_FIRST(fmt, ...) fmt
+
+void ipop_log_at(struct ipop_log_site *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int ipop_log_start();
+void ipop_log_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
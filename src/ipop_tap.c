@@ -43,6 +43,8 @@
 
 #include <jansson.h>
 
+#include "ipop_ctx.h"
+#include "ipop_log.h"
 #include "translator.h"
 #include "peerlist.h"
 #include "tap.h"
@@ -51,9 +53,13 @@
 #include "packetio.h"
 #include "ipop_tap.h"
 #include "utils.h"
+#include "placement.h"
 
 #if defined(WIN32)
 #include "win32_tap.h"
+#elif defined(LINUX)
+#include <linux/if_tun.h>
+#include "offload.h"
 #endif
 
 static int generate_ipv6_address(char *prefix, unsigned short prefix_len,
@@ -137,7 +143,14 @@ main_help(const char *executable)
 {
     printf("Usage: %s [-h, --help] [-c|--config path] [-i|--id name]\n"
            "       [-6 ipv6_address] [-p|--port udp_port]\n"
-           "       [-t|--tap device_name] [-v|--verbose]\n\n", executable);
+           "       [-t|--tap device_name] [-q|--queues count]\n"
+           "       [-b|--batch count] [-g|--gso count] [-d|--deadline usec]\n"
+           "       [-r|--gro] [-o|--offload] [-e|--engine name]\n"
+           "       [-w|--workers count] [-s|--spin usec] [-a|--cpus list]\n"
+           "       [-f|--fifo priority] [-m|--mtu bytes] [-u|--tun]\n"
+           "       [-A|--aggregate bytes] [-k|--compact] [-z|--zerocopy bytes]\n"
+           "       [-B|--backlog frames] [-v|--verbose]\n\n",
+           executable);
 
     printf("Arguments:\n");
     printf("    -h, --help:    Show this help message.\n");
@@ -164,6 +177,91 @@ main_help(const char *executable)
                                IFNAMSIZ-1);
 #elif defined(WIN32)
                                99);
+#endif
+#if defined(LINUX) || defined(ANDROID)
+    printf("    -q, --queues:  The number of queues to open on the tap device.\n"
+           "                   Each queue is served by its own pair of send\n"
+           "                   and receive threads. Max of %d. (default: 1)\n",
+                               TAP_MAX_QUEUES);
+#endif
+#if defined(LINUX)
+    printf("    -b, --batch:   The number of packets to send or receive with a\n"
+           "                   single system call, when packets are sent to\n"
+           "                   peers directly over UDP. Max of %d.\n"
+           "                   (default: 1, no batching)\n", IPOP_BATCH_MAX);
+    printf("    -g, --gso:     The number of consecutive frames to the same\n"
+           "                   peer that are sent as one UDP_SEGMENT datagram\n"
+           "                   and split up by the kernel, when packets are\n"
+           "                   sent to peers directly over UDP. Max of %d.\n"
+           "                   (default: 1, no segmentation)\n",
+                               IPOP_GSO_MAX_SEGS);
+    printf("    -d, --deadline: How long in microseconds frames may wait for\n"
+           "                   more to batch with once the tap has none left.\n"
+           "                   (default: 0, send right away)\n");
+    printf("    -A, --aggregate: Pack small frames to the same peer into one\n"
+           "                   container datagram of up to this many bytes,\n"
+           "                   such as 1472 for a 1500 byte network between\n"
+           "                   the peers. Frames wait for company no longer\n"
+           "                   than the --deadline allows. (default: 0, off)\n");
+    printf("    -k, --compact: Replace the 40 byte ipop header with a 4 byte\n"
+           "                   one, when packets are sent to peers directly\n"
+           "                   over UDP. Every peer has to use this option.\n"
+           "                   (default: off)\n");
+    printf("    -z, --zerocopy: Send datagrams of at least this many bytes with\n"
+           "                   MSG_ZEROCOPY, when packets are sent to peers\n"
+           "                   directly over UDP by the 'threads' engine.\n"
+           "                   Pays off for jumbo frames and segmented sends,\n"
+           "                   such as with 10000. (default: 0, off)\n");
+    printf("    -B, --backlog: How many frames from the peers may wait for the\n"
+           "                   tap while it is full. Once that many wait, the\n"
+           "                   oldest is dropped for a new one. 0 drops new\n"
+           "                   frames right away. Not used by the 'io_uring'\n"
+           "                   engine. (default: %d)\n", IPOP_TAP_BACKLOG);
+    printf("    -r, --gro:     Let the kernel coalesce datagrams received from\n"
+           "                   the same peer (UDP_GRO), so a single receive\n"
+           "                   call takes up to 64KB of them. (default: off)\n");
+    printf("    -o, --offload: Let the tap device hand over TCP super-frames of\n"
+           "                   up to 64KB with their checksums left open, and\n"
+           "                   pass them to the peers unsegmented. Every peer\n"
+           "                   has to use this option. (default: off)\n");
+#endif
+#if defined(LINUX)
+    printf("    -e, --engine:  How packets are moved: 'threads' for a send and\n"
+           "                   a receive thread per tap queue, 'epoll' for a\n"
+           "                   single event loop thread per tap queue that\n"
+           "                   handles both directions, 'io_uring' for a\n"
+           "                   single thread per tap queue that keeps many\n"
+           "                   reads in flight, or 'pipeline' for a read, a\n"
+           "                   classify and a send thread per tap queue,\n"
+           "                   plus a receive thread. (default: 'threads')\n");
+    printf("    -w, --workers: The number of classify and send thread pairs\n"
+           "                   the 'pipeline' engine spreads the frames of a\n"
+           "                   tap queue over, by flow. Max of %d.\n"
+           "                   (default: 1)\n", IPOP_MAX_WORKERS);
+    printf("    -s, --spin:    How long in microseconds the send and receive\n"
+           "                   threads poll an empty tap or socket before\n"
+           "                   they sleep, which saves the wakeup latency at\n"
+           "                   the cost of a busy core. Also sets\n"
+           "                   SO_BUSY_POLL on the sockets. (default: 0)\n");
+    printf("    -a, --cpus:    CPUs to pin the packet threads to, one after\n"
+           "                   the other in the order they are started, such\n"
+           "                   as '2-5,8'. Their buffers then come from the\n"
+           "                   local NUMA node. (default: not pinned)\n");
+    printf("    -f, --fifo:    Run the packet threads with SCHED_FIFO at this\n"
+           "                   priority (1-99), which needs CAP_SYS_NICE.\n"
+           "                   (default: 0, the normal scheduler)\n");
+#endif
+    printf("    -m, --mtu:     The MTU of the tap device, between %d and %d.\n"
+           "                   Frames above 1400 bytes or so only fit into\n"
+           "                   one datagram when the network between the\n"
+           "                   peers takes jumbo frames. (default: %d)\n",
+           MTU, MTU_MAX, MTU);
+#if defined(LINUX) || defined(ANDROID)
+    printf("    -u, --tun:     Use a tun device, which carries bare IP\n"
+           "                   packets, instead of a tap device. Saves the\n"
+           "                   ethernet header and the ARP emulation on\n"
+           "                   routed overlays. Every peer has to use this\n"
+           "                   option. (default: off)\n");
 #endif
     printf("    -v, --verbose: Print out extra information about what's\n"
            "                   happening.\n");
@@ -191,6 +289,23 @@ main(int argc, const char *argv[])
 #elif defined(WIN32)
     char tap_device_name[100] = { 0 };
 #endif
+    int queues = 0;
+    int batch = 0;
+    int udp_gso = 0;
+    int flush_usec = -1;
+    int udp_gro = -1;
+    int offload = -1;
+    char engine[16] = { 0 };
+    int workers = 0;
+    int busy_poll_usec = -1;
+    char cpu_list[256] = { 0 };
+    int fifo_priority = -1;
+    int mtu = 0;
+    int tun = -1;
+    int aggregate = -1;
+    int compact = -1;
+    int zerocopy = -1;
+    int tap_backlog = -1;
     int verbose = 0;
 
     // Ideally we'd define defaults first, then configuration file stuff, then
@@ -198,7 +313,7 @@ main(int argc, const char *argv[])
     // set in the arguments, so they must be parsed first.
 
     // read in settings from command line arguments
-    char* short_options = "c:i:4:6:p:t:vh";
+    char* short_options = "c:i:4:6:p:t:q:b:g:d:roe:w:s:a:f:m:uA:kz:B:vh";
 
     static const struct option long_options[] = {
         {"config", required_argument, 0, 'c'},
@@ -207,6 +322,23 @@ main(int argc, const char *argv[])
         {"ipv6", required_argument, 0, '6'},
         {"port", required_argument, 0, 'p'},
         {"tap", required_argument, 0, 't'},
+        {"queues", required_argument, 0, 'q'},
+        {"batch", required_argument, 0, 'b'},
+        {"gso", required_argument, 0, 'g'},
+        {"deadline", required_argument, 0, 'd'},
+        {"gro", no_argument, 0, 'r'},
+        {"offload", no_argument, 0, 'o'},
+        {"engine", required_argument, 0, 'e'},
+        {"workers", required_argument, 0, 'w'},
+        {"spin", required_argument, 0, 's'},
+        {"cpus", required_argument, 0, 'a'},
+        {"fifo", required_argument, 0, 'f'},
+        {"mtu", required_argument, 0, 'm'},
+        {"tun", no_argument, 0, 'u'},
+        {"aggregate", required_argument, 0, 'A'},
+        {"compact", no_argument, 0, 'k'},
+        {"zerocopy", required_argument, 0, 'z'},
+        {"backlog", required_argument, 0, 'B'},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -245,6 +377,74 @@ main(int argc, const char *argv[])
                 strcpy(tap_device_name, optarg);
                 break;
                 
+            case 'q':
+                queues = atoi(optarg);
+                break;
+                
+            case 'b':
+                batch = atoi(optarg);
+                break;
+                
+            case 'g':
+                udp_gso = atoi(optarg);
+                break;
+                
+            case 'd':
+                flush_usec = atoi(optarg);
+                break;
+                
+            case 'r':
+                udp_gro = 1;
+                break;
+                
+            case 'o':
+                offload = 1;
+                break;
+                
+            case 'e':
+                strlcpy(engine, optarg, sizeof(engine));
+                break;
+                
+            case 'w':
+                workers = atoi(optarg);
+                break;
+                
+            case 's':
+                busy_poll_usec = atoi(optarg);
+                break;
+                
+            case 'a':
+                strlcpy(cpu_list, optarg, sizeof(cpu_list));
+                break;
+                
+            case 'f':
+                fifo_priority = atoi(optarg);
+                break;
+                
+            case 'm':
+                mtu = atoi(optarg);
+                break;
+                
+            case 'u':
+                tun = 1;
+                break;
+                
+            case 'A':
+                aggregate = atoi(optarg);
+                break;
+                
+            case 'k':
+                compact = 1;
+                break;
+                
+            case 'z':
+                zerocopy = atoi(optarg);
+                break;
+                
+            case 'B':
+                tap_backlog = atoi(optarg);
+                break;
+                
             case 'v':
                 verbose = 1;
                 break;
@@ -322,6 +522,131 @@ main(int argc, const char *argv[])
                     strlcpy(tap_device_name, str, (sizeof tap_device_name)-1);
                 }
             }
+
+            if (queues == 0) {
+                json_t *queues_json = json_object_get(config_json, "queues");
+                if (queues_json != NULL) {
+                    queues = (int) json_integer_value(queues_json);
+                }
+            }
+
+            if (batch == 0) {
+                json_t *batch_json = json_object_get(config_json, "batch");
+                if (batch_json != NULL) {
+                    batch = (int) json_integer_value(batch_json);
+                }
+            }
+
+            if (udp_gso == 0) {
+                json_t *gso_json = json_object_get(config_json, "gso_segments");
+                if (gso_json != NULL) {
+                    udp_gso = (int) json_integer_value(gso_json);
+                }
+            }
+
+            if (flush_usec == -1) {
+                json_t *flush_json = json_object_get(config_json, "flush_usec");
+                if (flush_json != NULL) {
+                    flush_usec = (int) json_integer_value(flush_json);
+                }
+            }
+
+            if (udp_gro == -1) {
+                json_t *gro_json = json_object_get(config_json, "gro");
+                if (gro_json != NULL) {
+                    udp_gro = json_is_true(gro_json);
+                }
+            }
+
+            if (engine[0] == '\0') {
+                const char *str =
+                    json_string_value(json_object_get(config_json, "engine"));
+                if (str != NULL) {
+                    strlcpy(engine, str, sizeof(engine));
+                }
+            }
+
+            if (offload == -1) {
+                json_t *offload_json = json_object_get(config_json, "offload");
+                if (offload_json != NULL) {
+                    offload = json_is_true(offload_json);
+                }
+            }
+
+            if (workers == 0) {
+                json_t *workers_json = json_object_get(config_json, "workers");
+                if (workers_json != NULL) {
+                    workers = (int) json_integer_value(workers_json);
+                }
+            }
+
+            if (busy_poll_usec == -1) {
+                json_t *spin_json =
+                    json_object_get(config_json, "busy_poll_usec");
+                if (spin_json != NULL) {
+                    busy_poll_usec = (int) json_integer_value(spin_json);
+                }
+            }
+
+            if (cpu_list[0] == '\0') {
+                const char *str =
+                    json_string_value(json_object_get(config_json, "cpus"));
+                if (str != NULL) {
+                    strlcpy(cpu_list, str, sizeof(cpu_list));
+                }
+            }
+
+            if (fifo_priority == -1) {
+                json_t *fifo_json =
+                    json_object_get(config_json, "fifo_priority");
+                if (fifo_json != NULL) {
+                    fifo_priority = (int) json_integer_value(fifo_json);
+                }
+            }
+
+            if (mtu == 0) {
+                json_t *mtu_json = json_object_get(config_json, "mtu");
+                if (mtu_json != NULL) {
+                    mtu = (int) json_integer_value(mtu_json);
+                }
+            }
+
+            if (aggregate == -1) {
+                json_t *aggregate_json =
+                    json_object_get(config_json, "aggregate");
+                if (aggregate_json != NULL) {
+                    aggregate = (int) json_integer_value(aggregate_json);
+                }
+            }
+
+            if (zerocopy == -1) {
+                json_t *zerocopy_json =
+                    json_object_get(config_json, "zerocopy");
+                if (zerocopy_json != NULL) {
+                    zerocopy = (int) json_integer_value(zerocopy_json);
+                }
+            }
+
+            if (tap_backlog == -1) {
+                json_t *backlog_json = json_object_get(config_json, "backlog");
+                if (backlog_json != NULL) {
+                    tap_backlog = (int) json_integer_value(backlog_json);
+                }
+            }
+
+            if (tun == -1) {
+                json_t *tun_json = json_object_get(config_json, "tun");
+                if (tun_json != NULL) {
+                    tun = json_is_true(tun_json);
+                }
+            }
+
+            if (compact == -1) {
+                json_t *compact_json = json_object_get(config_json, "compact");
+                if (compact_json != NULL) {
+                    compact = json_is_true(compact_json);
+                }
+            }
         }
         
     } else {
@@ -343,6 +668,118 @@ main(int argc, const char *argv[])
     if (ipv4_addr[0] == '\0') strcpy(ipv4_addr, "172.31.0.100");
     if (port == 0) port = 5800;
     if (tap_device_name[0] == '\0') strcpy(tap_device_name, "ipop0");
+    if (queues == 0) queues = 1;
+    if (batch == 0) batch = 1;
+    if (udp_gso == 0) udp_gso = 1;
+    if (flush_usec == -1) flush_usec = 0;
+    if (udp_gro == -1) udp_gro = 0;
+    if (offload == -1) offload = 0;
+    if (engine[0] == '\0') strcpy(engine, "threads");
+    if (workers == 0) workers = 1;
+    if (busy_poll_usec == -1) busy_poll_usec = 0;
+    if (fifo_priority == -1) fifo_priority = 0;
+    if (mtu == 0) mtu = MTU;
+    if (tun == -1) tun = 0;
+    if (aggregate == -1) aggregate = 0;
+    if (compact == -1) compact = 0;
+    if (zerocopy == -1) zerocopy = 0;
+    if (tap_backlog == -1) tap_backlog = IPOP_TAP_BACKLOG;
+#if defined(LINUX) || defined(ANDROID)
+    if (mtu < MTU || mtu > MTU_MAX) {
+        fprintf(stderr, "The MTU must be between %d and %d\n", MTU, MTU_MAX);
+        return EXIT_FAILURE;
+    }
+    if (queues < 0 || queues > TAP_MAX_QUEUES) {
+        fprintf(stderr, "The number of queues must be between 1 and %d\n",
+                TAP_MAX_QUEUES);
+        return EXIT_FAILURE;
+    }
+#endif
+#if defined(LINUX)
+    if (batch < 1 || batch > IPOP_BATCH_MAX) {
+        fprintf(stderr, "The batch size must be between 1 and %d\n",
+                IPOP_BATCH_MAX);
+        return EXIT_FAILURE;
+    }
+    if (udp_gso < 1 || udp_gso > IPOP_GSO_MAX_SEGS) {
+        fprintf(stderr, "The number of UDP segments must be between 1 and "
+                        "%d\n", IPOP_GSO_MAX_SEGS);
+        return EXIT_FAILURE;
+    }
+    // the peers read every datagram into a buffer sized for one frame
+    int aggregate_max = BUF_OFFSET + ETH_OVERHEAD + mtu;
+    if (aggregate_max < BUFLEN) aggregate_max = BUFLEN;
+    // with compact headers a datagram is received behind the room the ipop
+    // header leaves, and a HELLO carries the id of the sender as well
+    if (compact > 0) {
+        aggregate_max -= BUF_OFFSET - COMPACT_HDR_LEN;
+        aggregate_max -= COMPACT_HELLO_LEN - COMPACT_HDR_LEN;
+    }
+    if (aggregate < 0 || aggregate > aggregate_max) {
+        fprintf(stderr, "The container size must be between 0 and %d\n",
+                aggregate_max);
+        return EXIT_FAILURE;
+    }
+    if (flush_usec < 0) {
+        fprintf(stderr, "The flush deadline can not be negative\n");
+        return EXIT_FAILURE;
+    }
+    if (zerocopy < 0) {
+        fprintf(stderr, "The zerocopy size can not be negative\n");
+        return EXIT_FAILURE;
+    }
+    if (tap_backlog < 0) {
+        fprintf(stderr, "The tap backlog can not be negative\n");
+        return EXIT_FAILURE;
+    }
+    if (zerocopy > 0 && aggregate > 0) {
+        // the container prefixes live in the batch, which is reused right
+        // after the flush
+        fprintf(stderr, "Zerocopy can not be used with aggregation\n");
+        return EXIT_FAILURE;
+    }
+    if (strcmp(engine, "threads") != 0 && strcmp(engine, "epoll") != 0 &&
+        strcmp(engine, "io_uring") != 0 && strcmp(engine, "pipeline") != 0) {
+        fprintf(stderr, "Unknown engine '%s', use 'threads', 'epoll', "
+                        "'io_uring' or 'pipeline'\n", engine);
+        return EXIT_FAILURE;
+    }
+    int event_loop = (strcmp(engine, "epoll") == 0);
+    int uring = (strcmp(engine, "io_uring") == 0);
+    int pipeline = (strcmp(engine, "pipeline") == 0);
+    if (workers < 1 || workers > IPOP_MAX_WORKERS) {
+        fprintf(stderr, "The number of workers must be between 1 and %d\n",
+                IPOP_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+    if (busy_poll_usec < 0) {
+        fprintf(stderr, "The busy poll time can not be negative\n");
+        return EXIT_FAILURE;
+    }
+    int cpus[PLACEMENT_MAX_CPUS];
+    int cpu_count = 0;
+    if (cpu_list[0] != '\0' &&
+        (cpu_count = placement_parse_cpus(cpu_list, cpus,
+                                          PLACEMENT_MAX_CPUS)) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (placement_init(cpus, cpu_count, fifo_priority) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (tun && offload) {
+        // the super-frames are segmented as ethernet frames
+        fprintf(stderr, "Offload is not supported on a tun device\n");
+        return EXIT_FAILURE;
+    }
+    if (workers > 1 && !pipeline) {
+        fprintf(stderr, "Workers are only used by the 'pipeline' engine\n");
+        return EXIT_FAILURE;
+    }
+    if (zerocopy > 0 && strcmp(engine, "threads") != 0) {
+        fprintf(stderr, "Zerocopy is only used by the 'threads' engine\n");
+        return EXIT_FAILURE;
+    }
+#endif
 
     if (verbose) {
         // pretty-print the client configuration
@@ -351,6 +788,23 @@ main(int argc, const char *argv[])
         printf("    Virtual IPv6 Address: '%s'\n", ipv6_addr);
         printf("    UDP Socket Port: %d\n", port);
         printf("    TAP Virtual Device Name: '%s'\n", tap_device_name);
+        printf("    TAP Queues: %d\n", queues);
+        printf("    TAP MTU: %d\n", mtu);
+        printf("    TAP Mode: %s\n", tun ? "tun" : "tap");
+        printf("    Batch Size: %d\n", batch);
+        printf("    UDP Segments: %d\n", udp_gso);
+        printf("    Flush Deadline: %d usec\n", flush_usec);
+        printf("    Aggregate: %d bytes\n", aggregate);
+        printf("    Compact Headers: %s\n", compact ? "on" : "off");
+        printf("    Zerocopy: %d bytes\n", zerocopy);
+        printf("    TAP Backlog: %d frames\n", tap_backlog);
+        printf("    UDP GRO: %s\n", udp_gro ? "on" : "off");
+        printf("    Offload: %s\n", offload ? "on" : "off");
+        printf("    Engine: %s\n", engine);
+        printf("    Workers: %d\n", workers);
+        printf("    Busy Poll: %d usec\n", busy_poll_usec);
+        printf("    CPUs: '%s'\n", cpu_list);
+        printf("    SCHED_FIFO Priority: %d\n", fifo_priority);
     }
 
     // Initialize the peerlist for possible peers we might add
@@ -386,20 +840,84 @@ main(int argc, const char *argv[])
 
     // write out the threading options to be passed to the runner threads
     thread_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    // the functions used above all work on the default context
+    opts.ctx = ipop_ctx_default();
 #if defined(LINUX) || defined(ANDROID)
-    opts.tap = tap_open(tap_device_name, opts.mac);
+    int tap_fds[TAP_MAX_QUEUES];
+    int sock4_fds[TAP_MAX_QUEUES];
+#if defined(LINUX)
+    int tap_flags = offload ? TAP_VNET_HDR : 0;
+#else
+    int tap_flags = 0;
+#endif
+    if (tun) tap_flags |= TAP_TUN;
+    if (tap_open_mq(tap_device_name, opts.mac, tap_fds, queues,
+                    tap_flags) < 0) {
+        return EXIT_FAILURE;
+    }
+    opts.tap = tap_fds[0];
+#if defined(LINUX)
+    if (offload) {
+        // UFO is gone from the kernel, so only checksum and TCP offloads;
+        // the super-frames have to fit into one datagram with both headers
+        if (tap_set_offload(TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+                            TUN_F_TSO_ECN) < 0) {
+            tap_close();
+            return EXIT_FAILURE;
+        }
+        tap_set_gso_max_size(OFFLOAD_DATAGRAM_MAX - BUF_OFFSET -
+                             VNET_HDR_LEN - 14);
+        opts.vnet_hdr = 1;
+    }
+#endif
 #elif defined(WIN32)
     opts.win32_tap = open_tap(tap_device_name, opts.mac);
 #endif
     opts.local_ip4 = ipv4_addr;
     opts.local_ip6 = ipv6_addr;
-    opts.sock4 = socket_utils_create_ipv4_udp_socket("0.0.0.0", port);
 #if defined(LINUX) || defined(ANDROID)
+    // every queue gets its own socket on the same port, so that each receive
+    // thread only wakes up for the flows the kernel hashed to it
+    for (int i = 0; i < queues; i++) {
+        if (queues > 1) {
+            sock4_fds[i] = socket_utils_create_ipv4_udp_socket_shared("0.0.0.0",
+                                                                      port);
+        } else {
+            sock4_fds[i] = socket_utils_create_ipv4_udp_socket("0.0.0.0",
+                                                               port);
+        }
+    }
+    opts.sock4 = sock4_fds[0];
     opts.sock6 = socket_utils_create_ipv6_udp_socket(
         port, if_nametoindex(tap_device_name)
     );
+#if defined(LINUX)
+    if (busy_poll_usec > 0) {
+        for (int i = 0; i < queues; i++) {
+            socket_utils_set_busy_poll(sock4_fds[i], busy_poll_usec);
+        }
+    }
+#endif
+#else
+    opts.sock4 = socket_utils_create_ipv4_udp_socket("0.0.0.0", port);
 #endif
     opts.translate = 1;
+    opts.tun = tun;
+    opts.mtu = mtu;
+    opts.batch = batch;
+    opts.udp_gso = udp_gso;
+    opts.aggregate = aggregate;
+    opts.compact_hdr = compact;
+    opts.zerocopy = zerocopy;
+    opts.flush_usec = flush_usec;
+    opts.udp_gro = udp_gro;
+#if defined(LINUX)
+    opts.pipeline = pipeline;
+    opts.workers = workers;
+    opts.busy_poll_usec = busy_poll_usec;
+    opts.tap_backlog = tap_backlog;
+#endif
     opts.send_func = NULL;
     opts.recv_func = NULL;
 
@@ -408,7 +926,7 @@ main(int argc, const char *argv[])
 	char myip[4];
     tap_set_ipv4_addr(ipv4_addr, 24, myip);
     tap_set_ipv6_addr(ipv6_addr, 64);
-    tap_set_mtu(MTU);
+    tap_set_mtu(mtu);
     tap_set_base_flags();
     tap_set_up();
 
@@ -417,7 +935,7 @@ main(int argc, const char *argv[])
     if (getuid() == 0) {
         if (setgid(pwd->pw_uid) < 0) {
             fprintf(stderr, "setgid failed\n");
-            close(opts.sock4);
+            for (int i = 0; i < queues; i++) close(sock4_fds[i]);
             close(opts.sock6);
             tap_close();
             
@@ -425,17 +943,55 @@ main(int argc, const char *argv[])
         }
         if (setuid(pwd->pw_gid) < 0) {
             fprintf(stderr, "setuid failed\n");
-            close(opts.sock4);
+            for (int i = 0; i < queues; i++) close(sock4_fds[i]);
             close(opts.sock6);
             tap_close();
             
             return EXIT_FAILURE;
         }
     }
-    pthread_t send_thread, recv_thread;
-    pthread_create(&send_thread, NULL, ipop_send_thread, &opts);
-    pthread_create(&recv_thread, NULL, ipop_recv_thread, &opts);
-    pthread_join(recv_thread, NULL);
+
+    // one send and one receive thread per tap queue, each pair only touches
+    // its own queue and socket. The event loop engine serves each queue with a
+    // single thread instead, as does the io_uring engine, and when that is
+    // the only thread the peerlist does not need its locks.
+    thread_opts_t queue_opts[TAP_MAX_QUEUES];
+    pthread_t send_threads[TAP_MAX_QUEUES], recv_threads[TAP_MAX_QUEUES];
+    // errors on the packet path are written out by a thread of their own
+    ipop_log_start();
+#if defined(LINUX)
+    if ((event_loop || uring) && queues == 1) peerlist_set_locking(0);
+#endif
+    for (int i = 0; i < queues; i++) {
+        queue_opts[i] = opts;
+        queue_opts[i].tap = tap_fds[i];
+        queue_opts[i].sock4 = sock4_fds[i];
+#if defined(LINUX)
+        if (event_loop) {
+            // sock6 is watched by the first queue only
+            if (i > 0) queue_opts[i].sock6 = -1;
+            placement_create_thread(&recv_threads[i], ipop_event_thread,
+                                    &queue_opts[i]);
+            continue;
+        }
+        if (uring) {
+            placement_create_thread(&recv_threads[i], ipop_uring_thread,
+                                    &queue_opts[i]);
+            continue;
+        }
+#endif
+        placement_create_thread(&send_threads[i], ipop_send_thread,
+                                &queue_opts[i]);
+        placement_create_thread(&recv_threads[i], ipop_recv_thread,
+                                &queue_opts[i]);
+    }
+    for (int i = 0; i < queues; i++) {
+        pthread_join(recv_threads[i], NULL);
+    }
+    // every queue closed its own fd and sock4 on the way out
+    close(opts.sock6);
+    tap_close();
+    ipop_log_stop();
 #endif
     return EXIT_SUCCESS;
 }
@@ -30,17 +30,49 @@
 
 #if defined(WIN32)
 #include "win32_tap.h"
+#elif defined(LINUX) || defined(ANDROID)
+#include <sys/uio.h>
 #endif
 
-#define MTU 1280
-#define BUFLEN 2048
+#define MTU 1280 // default MTU of the tap device
+#define MTU_MAX 9000 // largest MTU the tap device can be given
+#define BUFLEN 2048 // smallest buffer, which fits a frame of the default MTU
+#define ETH_OVERHEAD 18 // ethernet header plus a VLAN tag
+#define ETH_HDR_LEN 14 // where the IP header starts in an ethernet frame
 #define BUF_OFFSET 40 // Gives room to store the headers
 #define ID_SIZE 20
 #define MAXBUF 1024
+#define IPOP_BATCH_MAX 64 // most datagrams moved by one sendmmsg/recvmmsg
+#define IPOP_GSO_MAX_SEGS 64 // most frames sent as one UDP_SEGMENT datagram
+#define IPOP_MAX_WORKERS 16 // most classify and send lanes of the pipeline
+#define IPOP_TAP_BACKLOG 64 // default frames waiting for a full tap
 
 #define IPV6_ADDR_FILE "../ipv6_addr"
 
+// Time a packet thread spent waiting for packets with busy polling on, see
+// thread_opts_t.busy_poll_usec.
+struct ipop_poll_stats {
+    unsigned long long spin_ns; // polling without sleeping
+    unsigned long long sleep_ns; // blocked until a packet arrived
+    unsigned long long spin_hits; // waits that ended while polling
+    unsigned long long sleeps; // waits that had to block
+};
+
+// What became of the frames the tap did not take right away, see
+// thread_opts_t.tap_backlog.
+struct ipop_tap_stats {
+    unsigned long long eagain; // writes the full tap turned down
+    unsigned long long queued; // frames that had to wait for the tap
+    unsigned long long drops; // frames that never made it to the tap
+};
+
+struct ipop_shm;
+struct ipop_ctx;
+
 typedef struct thread_opts {
+    // the context the peers, the tap device and the translator state come
+    // from, NULL for the default one (see ipop_ctx.h)
+    struct ipop_ctx *ctx;
     int sock4;
     int sock6;
     int tap;
@@ -49,12 +81,107 @@ typedef struct thread_opts {
 #endif
     int translate;
     int switchmode;
+    // the device is a tun device that carries bare IP packets instead of
+    // ethernet frames, so there is no ARP to answer and no MAC to rewrite
+    // (not with switchmode, all peers have to agree)
+    int tun;
+    // number of datagrams moved per sendmmsg/recvmmsg call in direct mode,
+    // 0 or 1 disables batching (linux only)
+    int batch;
+    // number of frames for the same peer that leave as one UDP_SEGMENT
+    // datagram in direct mode, 0 or 1 disables it (linux only)
+    int udp_gso;
+    // largest container datagram in bytes that small frames for the same
+    // peer are packed into, 0 sends every frame on its own (direct mode,
+    // linux only)
+    int aggregate;
+    // smallest datagram in bytes that is sent with MSG_ZEROCOPY, its buffer
+    // is kept until the kernel is done with it, 0 copies every datagram
+    // (direct mode with the threads engine, linux only)
+    int zerocopy;
+    // how long in microseconds a batch may wait for more frames once the tap
+    // has none left, 0 flushes right away (linux only)
+    int flush_usec;
+    // let the kernel coalesce datagrams from the same peer (UDP_GRO), they
+    // are split up again before processing (linux only)
+    int udp_gro;
+    // frames on the tap carry a virtio-net header, which travels to the peers
+    // as a trailer after the frame, so super-frames can cross the link
+    // unsegmented (linux only, all peers have to agree)
+    int vnet_hdr;
+    // replace the 40-byte ipop header with a compact link header of 4 bytes,
+    // the peers learn each other's index for it in-band (direct mode only,
+    // all peers have to agree)
+    int compact_hdr;
+    // MTU of the tap device, the buffers are sized to fit its frames, 0 for
+    // the default MTU
+    int mtu;
+    // run the send side as a pipeline of read, classify and send threads
+    // connected by rings, so a slow send_func does not hold up tap reads
+    // (linux only)
+    int pipeline;
+    // number of classify and send thread pairs the pipeline spreads frames
+    // over by their flow hash, 0 or 1 for a single pair (linux only)
+    int workers;
+    // how long in microseconds the send and receive threads poll an empty tap
+    // or socket before they block, and the SO_BUSY_POLL budget of the
+    // sockets, 0 blocks right away (linux only)
+    int busy_poll_usec;
+    // written by the send and the receive thread, see ipop_poll_stats
+    struct ipop_poll_stats send_poll;
+    struct ipop_poll_stats recv_poll;
+    // the running pipeline, set by the send thread for ipop_pipeline_stats,
+    // which it only frees once no call of that holds on to it
+    void *pipeline_state;
+    int pipeline_readers;
+    // frames the receive side keeps for the tap while it is full, once this
+    // many wait the oldest is dropped for a new one, 0 drops right away
+    // (linux only)
+    int tap_backlog;
+    // written by the threads that write to the tap, see ipop_tap_stats
+    struct ipop_tap_stats tap_stats;
+    // the frames waiting for the tap, set by the receive thread
+    void *tap_backlog_state;
     char mac[6];
     char my_ip4[4];
     const char *local_ip4;
     const char *local_ip6;
+    // Bytes the upper layer may write in front of and behind every datagram
+    // it is handed, so that it can add its own framing, a nonce or a MAC tag
+    // in place. With send_func and send_batch_func they directly precede and
+    // follow the datagram, with sendv_func they surround the frame, and on
+    // the shared-memory transport `headroom` leading bytes of the slot count
+    // towards the datagram. Datagrams from the upper layer start with
+    // `headroom` bytes of its own, which are skipped, and are received into
+    // buffers with `headroom` plus `tailroom` bytes of extra room.
+    int headroom;
+    int tailroom;
     int (*send_func)(const char *buf, size_t len);
     int (*recv_func)(char *buf, size_t len);
+#if defined(LINUX) || defined(ANDROID)
+    // Optional replacement for send_func, the 40-byte ipop header and the
+    // ethernet frame are passed as separate iovecs (iov[0] and iov[1]) and
+    // must not be modified. Neither is guaranteed to be contiguous with the
+    // other, so a consumer can add its own headroom without a copy.
+    int (*sendv_func)(const struct iovec *iov, int iovcnt);
+#endif
+#if defined(LINUX)
+    // Optional batch replacements for send_func and recv_func. Each datagram
+    // is the 40-byte ipop header followed by the ethernet frame, as with
+    // send_func. send_batch_func is offered `count` datagrams at a time and
+    // returns how many it took, the rest is offered again right away; a
+    // return of 0 or less drops them. recv_batch_func blocks until at least
+    // one datagram is available, fills up to `count` of the `buflen` byte
+    // buffers and their lengths, and returns how many it filled, or -1.
+    int (*send_batch_func)(const char **bufs, const size_t *lens, int count);
+    int (*recv_batch_func)(char **bufs, size_t *lens, size_t buflen,
+                           int count);
+    // Optional shared-memory transport that replaces all of the functions
+    // above. Datagrams for the peers are put on its IPOP_SHM_UP ring, and
+    // the ones from the peers are processed in place off its IPOP_SHM_DOWN
+    // ring, see shm.h. It is not used by the epoll and io_uring engines.
+    struct ipop_shm *shm;
+#endif
 } thread_opts_t;
 
 #endif
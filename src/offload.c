@@ -0,0 +1,206 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * Helpers for taps opened with IFF_VNET_HDR, where the kernel hands us TCP
+ * super-frames of up to 64KB together with a virtio-net header describing
+ * how they are to be segmented.
+ */
+
+#if defined(LINUX)
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "offload.h"
+#include "ipop_log.h"
+
+/**
+ * Adds `len` bytes at `data` to the one's complement sum `sum`.
+ */
+static uint32_t
+csum_add(uint32_t sum, const unsigned char *data, int len)
+{
+    int i;
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (i < len) sum += data[i] << 8;
+    return sum;
+}
+
+static uint16_t
+csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t) ~sum;
+}
+
+/**
+ * Writes the virtio-net header in network byte order to `wire`, which needs
+ * VNET_HDR_LEN bytes. The tap uses the host byte order, so peers of different
+ * endianness can still share their headers.
+ */
+void
+vnet_hdr_to_wire(const struct virtio_net_hdr *vnet, unsigned char *wire)
+{
+    struct virtio_net_hdr out = {
+        .flags = vnet->flags,
+        .gso_type = vnet->gso_type,
+        .hdr_len = htons(vnet->hdr_len),
+        .gso_size = htons(vnet->gso_size),
+        .csum_start = htons(vnet->csum_start),
+        .csum_offset = htons(vnet->csum_offset)
+    };
+    memcpy(wire, &out, VNET_HDR_LEN);
+}
+
+/**
+ * Reads a virtio-net header that was written by vnet_hdr_to_wire.
+ */
+void
+vnet_hdr_from_wire(const unsigned char *wire, struct virtio_net_hdr *vnet)
+{
+    memcpy(vnet, wire, VNET_HDR_LEN);
+    vnet->hdr_len = ntohs(vnet->hdr_len);
+    vnet->gso_size = ntohs(vnet->gso_size);
+    vnet->csum_start = ntohs(vnet->csum_start);
+    vnet->csum_offset = ntohs(vnet->csum_offset);
+}
+
+/**
+ * Prepares to cut the TCP super-frame of `len` bytes at `frame` into frames
+ * carrying at most vnet->gso_size bytes of payload each, in the way the kernel
+ * would have if offloading was off. Only TCP over IPv4 or IPv6 (without
+ * extension headers) is supported. Returns 0 on success, -1 if the frame can
+ * not be segmented.
+ */
+int
+gso_init(struct gso_state *state, const struct virtio_net_hdr *vnet,
+         const unsigned char *frame, int len)
+{
+    int gso_type = vnet->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    memset(state, 0, sizeof(struct gso_state));
+    state->frame = frame;
+    state->len = len;
+    state->l3 = 14;
+    state->mss = vnet->gso_size;
+
+    if (state->mss == 0 || len < state->l3 + 40) return -1;
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 &&
+        frame[12] == 0x08 && frame[13] == 0x00) {
+        state->is_ipv4 = 1;
+        state->l4 = state->l3 + (frame[state->l3] & 0x0F) * 4;
+        if (frame[state->l3 + 9] != 0x06) return -1;
+    } else if (gso_type == VIRTIO_NET_HDR_GSO_TCPV6 &&
+               frame[12] == 0x86 && frame[13] == 0xdd) {
+        state->is_ipv4 = 0;
+        state->l4 = state->l3 + 40;
+        if (frame[state->l3 + 6] != 0x06) return -1;
+    } else {
+        IPOP_LOG("unsupported gso type: 0x%x\n", vnet->gso_type);
+        return -1;
+    }
+    if (state->l4 + 20 > len) return -1;
+    state->hdr_len = state->l4 + (frame[state->l4 + 12] >> 4) * 4;
+    if (state->hdr_len > len) return -1;
+    return 0;
+}
+
+/**
+ * Writes the next segment to `seg`, which must hold the headers plus one mss
+ * worth of payload. The segment carries complete IP and TCP checksums. Returns
+ * the length of the segment, or 0 when the whole super-frame has been cut.
+ */
+int
+gso_next(struct gso_state *state, unsigned char *seg)
+{
+    const unsigned char *frame = state->frame;
+    int payload = state->len - state->hdr_len;
+    if (state->offset >= payload) return 0;
+
+    int chunk = payload - state->offset;
+    if (chunk > state->mss) chunk = state->mss;
+    int first = (state->offset == 0);
+    int last = (state->offset + chunk >= payload);
+    int l3 = state->l3, l4 = state->l4;
+    int tcp_len = state->hdr_len - l4 + chunk;
+
+    memcpy(seg, frame, state->hdr_len);
+    memcpy(seg + state->hdr_len, frame + state->hdr_len + state->offset,
+           chunk);
+
+    if (state->is_ipv4) {
+        int ihl = l4 - l3;
+        uint16_t tot_len = ihl + tcp_len;
+        uint16_t id = ((frame[l3 + 4] << 8) | frame[l3 + 5]) + state->index;
+        seg[l3 + 2] = tot_len >> 8;
+        seg[l3 + 3] = tot_len & 0xFF;
+        seg[l3 + 4] = id >> 8;
+        seg[l3 + 5] = id & 0xFF;
+        seg[l3 + 10] = 0;
+        seg[l3 + 11] = 0;
+        uint16_t ip_csum = csum_fold(csum_add(0, seg + l3, ihl));
+        seg[l3 + 10] = ip_csum >> 8;
+        seg[l3 + 11] = ip_csum & 0xFF;
+    } else {
+        seg[l3 + 4] = tcp_len >> 8;
+        seg[l3 + 5] = tcp_len & 0xFF;
+    }
+
+    // advance the sequence number, and keep FIN and PSH for the last segment
+    // and CWR for the first one only
+    uint32_t seq;
+    memcpy(&seq, frame + l4 + 4, 4);
+    seq = htonl(ntohl(seq) + state->offset);
+    memcpy(seg + l4 + 4, &seq, 4);
+    if (!last) seg[l4 + 13] &= ~0x09;
+    if (!first) seg[l4 + 13] &= ~0x80;
+
+    // checksum over the pseudo header and the whole TCP segment
+    uint32_t sum = 0;
+    if (state->is_ipv4) {
+        sum = csum_add(sum, seg + l3 + 12, 8);
+    } else {
+        sum = csum_add(sum, seg + l3 + 8, 32);
+    }
+    sum += 0x06 + tcp_len;
+    seg[l4 + 16] = 0;
+    seg[l4 + 17] = 0;
+    sum = csum_add(sum, seg + l4, tcp_len);
+    uint16_t tcp_csum = csum_fold(sum);
+    seg[l4 + 16] = tcp_csum >> 8;
+    seg[l4 + 17] = tcp_csum & 0xFF;
+
+    state->offset += chunk;
+    state->index++;
+    return state->hdr_len + chunk;
+}
+#endif
@@ -0,0 +1,76 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+
+#ifndef _OFFLOAD_H_
+#define _OFFLOAD_H_
+
+#include <stdint.h>
+#include <linux/virtio_net.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// size of the virtio-net header in front of every frame on a IFF_VNET_HDR tap,
+// on the wire the same header follows the frame as a trailer
+#define VNET_HDR_LEN ((int) sizeof(struct virtio_net_hdr))
+
+// largest frame the tap may hand us with TSO enabled
+#define OFFLOAD_FRAME_MAX (14 + 65535)
+
+// largest UDP payload that fits into a single IPv4 datagram
+#define OFFLOAD_DATAGRAM_MAX 65507
+
+// State for cutting a TCP super-frame into regular frames, see gso_init
+struct gso_state {
+    const unsigned char *frame;
+    int len;
+    int l3; // offset of the IP header
+    int l4; // offset of the TCP header
+    int hdr_len; // ethernet, IP and TCP headers
+    int mss;
+    int is_ipv4;
+    int offset; // payload bytes already cut
+    int index;
+};
+
+void vnet_hdr_to_wire(const struct virtio_net_hdr *vnet, unsigned char *wire);
+void vnet_hdr_from_wire(const unsigned char *wire, struct virtio_net_hdr *vnet);
+int gso_init(struct gso_state *state, const struct virtio_net_hdr *vnet,
+             const unsigned char *frame, int len);
+int gso_next(struct gso_state *state, unsigned char *seg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
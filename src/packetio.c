@@ -25,12 +25,26 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
+#if defined(LINUX)
+#define _GNU_SOURCE // for the batched socket calls used through batch.h
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #if defined(LINUX) || defined(ANDROID)
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#if defined(LINUX)
+#include <sys/epoll.h>
+#endif
 #include <sys/socket.h>
 #include <net/if.h>
 #include <arpa/inet.h>
@@ -41,12 +55,1986 @@
 #include <win32_tap.h>
 #endif
 
+#include "ipop_ctx.h"
+#include "ipop_log.h"
 #include "peerlist.h"
 #include "headers.h"
 #include "translator.h"
 #include "tap.h"
 #include "ipop_tap.h"
 #include "packetio.h"
+#include "pktbuf.h"
+#include "placement.h"
+#if defined(LINUX)
+#include "batch.h"
+#include "offload.h"
+#include "uring.h"
+#include "ring.h"
+#include "shm.h"
+#else
+struct tx_batch; // batching is only available on linux
+#endif
+
+#if defined(LINUX) || defined(ANDROID)
+#define RECV_TRUNC MSG_TRUNC // recvfrom returns the full datagram length
+#else
+#define RECV_TRUNC 0
+#endif
+
+/**
+ * Number of bytes that follow every frame on the link, which is the virtio-net
+ * header when offloads are on.
+ */
+static inline int
+trailer_length(const thread_opts_t *opts)
+{
+#if defined(LINUX)
+    if (opts->vnet_hdr) return VNET_HDR_LEN;
+#endif
+    return 0;
+}
+
+/**
+ * The context the frames of `opts` belong to.
+ */
+static inline struct ipop_ctx *
+ctx_of(const thread_opts_t *opts)
+{
+    return opts->ctx != NULL ? opts->ctx : ipop_ctx_default();
+}
+
+/**
+ * Offset of the IP header in the frames on the tap, in tun mode they are bare
+ * IP packets.
+ */
+static inline int
+l3_offset(const thread_opts_t *opts)
+{
+    return opts->tun ? 0 : ETH_HDR_LEN;
+}
+
+/**
+ * Size of the buffers holding one datagram, that is the ipop header, a frame
+ * and its trailer, plus the headroom and tailroom of the upper layer. A frame
+ * is as large as the MTU of the tap allows, and with offloads on it may be a
+ * 64KB super-frame.
+ */
+static inline int
+buffer_length(const thread_opts_t *opts)
+{
+    // a datagram with a compact HELLO header is received at link_offset, and
+    // its frame starts after the id of the sender
+    int hello = opts->compact_hdr ? COMPACT_HELLO_LEN - COMPACT_HDR_LEN : 0;
+    int room = opts->headroom + opts->tailroom;
+    int len = BUF_OFFSET + ETH_OVERHEAD + opts->mtu + hello;
+#if defined(LINUX)
+    if (opts->vnet_hdr) {
+        return BUF_OFFSET + OFFLOAD_FRAME_MAX + VNET_HDR_LEN + hello + room;
+    }
+#endif
+    return (len > BUFLEN ? len : BUFLEN) + room;
+}
+
+/**
+ * Bytes kept in front of the frames read from the tap: the room for the ipop
+ * header, and the headroom of the upper layer in front of that.
+ */
+static inline int
+buffer_headroom(const thread_opts_t *opts)
+{
+    return BUF_OFFSET + opts->headroom;
+}
+
+/**
+ * Most bytes a frame read from the tap into `pkt` may take, so that its
+ * trailer and the tailroom of the upper layer still fit behind it.
+ */
+static inline int
+frame_room(const thread_opts_t *opts, const struct pktbuf *pkt)
+{
+    return pktbuf_room(pkt) - trailer_length(opts) - opts->tailroom;
+}
+
+/**
+ * Where in a buffer datagrams from the peers are received. With compact link
+ * headers they land so that the header takes the last bytes of the BUF_OFFSET
+ * bytes of room for it, and the frame starts where it would behind an ipop
+ * header.
+ */
+static inline int
+link_offset(const thread_opts_t *opts)
+{
+    return opts->compact_hdr ? BUF_OFFSET - COMPACT_HDR_LEN : 0;
+}
+
+/**
+ * Reads a frame from the local tap device into `buf`. With offloads on, the
+ * virtio-net header of the frame is placed in the headroom in front of `buf`.
+ * Returns the length of the frame, or -1 on failure.
+ */
+static int
+read_from_tap(thread_opts_t *opts, unsigned char *buf, int len)
+{
+#if defined(LINUX)
+    if (opts->vnet_hdr) {
+        int rcount = read(opts->tap, buf - VNET_HDR_LEN, len + VNET_HDR_LEN);
+        if (rcount < 0) return rcount;
+        return rcount < VNET_HDR_LEN ? 0 : rcount - VNET_HDR_LEN;
+    }
+#endif
+#if defined(LINUX) || defined(ANDROID)
+    return read(opts->tap, buf, len);
+#elif defined(WIN32)
+    return read_tap(opts->win32_tap, (char *)buf, len);
+#endif
+}
+
+/**
+ * Writes a frame back to the local tap device. With offloads on, the
+ * virtio-net header for the frame must be in the headroom in front of `buf`.
+ * Returns the result of the underlying write call.
+ */
+static int
+write_to_tap(thread_opts_t *opts, unsigned char *buf, int len)
+{
+#if defined(LINUX)
+    if (opts->vnet_hdr) {
+        return write(opts->tap, buf - VNET_HDR_LEN, len + VNET_HDR_LEN);
+    }
+#endif
+#if defined(LINUX) || defined(ANDROID)
+    return write(opts->tap, buf, len);
+#elif defined(WIN32)
+    return write_tap(opts->win32_tap, (char *)buf, len);
+#endif
+}
+
+#if defined(LINUX)
+/**
+ * Adds `n` to a counter that other threads may read. Every counter is written
+ * by one thread only, so no atomic read-modify-write is needed.
+ */
+static inline void
+stat_add(unsigned long long *counter, unsigned long long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Same as stat_add, for the counters that more than one thread writes.
+ */
+static inline void
+stat_add_shared(unsigned long long *counter, unsigned long long n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Makes `fd` non-blocking. Returns 0 on success, -1 on failure.
+ */
+static int
+make_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+    return 0;
+}
+
+// how long in milliseconds a receive loop with frames waiting for the tap
+// waits for it at most before it tries again
+#define TAP_RETRY_MSEC 1
+
+// Frames from the peers the tap did not take yet, oldest first. A slot holds
+// what goes to the tap with one write, virtio-net header included.
+struct tap_backlog {
+    unsigned char *slots;
+    int *lens;
+    int slot_size;
+    int size;
+    int head; // the oldest frame
+    int count;
+};
+
+/**
+ * Makes the tap of `opts` non-blocking and sets up the backlog of its receive
+ * side, unless the tap_backlog option is 0. Returns 0 on success, -1 on
+ * failure.
+ */
+static int
+tap_backlog_init(thread_opts_t *opts)
+{
+    struct tap_backlog *q;
+
+    if (make_nonblocking(opts->tap) < 0) {
+        fprintf(stderr, "could not make the tap non-blocking\n");
+        return -1;
+    }
+    if (opts->tap_backlog <= 0) return 0;
+    if ((q = calloc(1, sizeof(struct tap_backlog))) == NULL) return -1;
+    q->size = opts->tap_backlog;
+    q->slot_size = buffer_length(opts) + VNET_HDR_LEN;
+    q->slots = malloc((size_t) q->size * q->slot_size);
+    q->lens = malloc(q->size * sizeof(int));
+    if (q->slots == NULL || q->lens == NULL) {
+        fprintf(stderr, "could not allocate the tap backlog\n");
+        free(q->slots);
+        free(q->lens);
+        free(q);
+        return -1;
+    }
+    opts->tap_backlog_state = q;
+    return 0;
+}
+
+static void
+tap_backlog_free(thread_opts_t *opts)
+{
+    struct tap_backlog *q = opts->tap_backlog_state;
+    if (q == NULL) return;
+    opts->tap_backlog_state = NULL;
+    stat_add_shared(&opts->tap_stats.drops, q->count);
+    free(q->slots);
+    free(q->lens);
+    free(q);
+}
+
+/**
+ * Tells whether frames are waiting in the backlog of the tap.
+ */
+static inline int
+tap_backlog_pending(const thread_opts_t *opts)
+{
+    const struct tap_backlog *q = opts->tap_backlog_state;
+    return q != NULL && q->count > 0;
+}
+
+/**
+ * Writes the frames waiting in `q` to the tap, oldest first, until the tap is
+ * full again. A frame the tap fails on for another reason is dropped. Returns
+ * 0 once `q` is empty, -1 while frames are left.
+ */
+static int
+tap_backlog_flush(thread_opts_t *opts, struct tap_backlog *q)
+{
+    while (q->count > 0) {
+        if (write(opts->tap, q->slots + (size_t) q->head * q->slot_size,
+                  q->lens[q->head]) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stat_add_shared(&opts->tap_stats.eagain, 1);
+                return -1;
+            }
+            stat_add_shared(&opts->tap_stats.drops, 1);
+        }
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+    }
+    return 0;
+}
+
+/**
+ * Queues `len` bytes at `buf` for the tap at the end of `q`. When `q` is full
+ * its oldest frame is dropped to make room, as a fresh frame is worth more to
+ * the host stack than a stale one.
+ */
+static void
+tap_backlog_push(thread_opts_t *opts, struct tap_backlog *q,
+                 const unsigned char *buf, int len)
+{
+    if (len > q->slot_size) {
+        stat_add_shared(&opts->tap_stats.drops, 1);
+        return;
+    }
+    if (q->count == q->size) {
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+        stat_add_shared(&opts->tap_stats.drops, 1);
+    }
+    int tail = (q->head + q->count) % q->size;
+    memcpy(q->slots + (size_t) tail * q->slot_size, buf, len);
+    q->lens[tail] = len;
+    q->count++;
+    stat_add_shared(&opts->tap_stats.queued, 1);
+}
+
+/**
+ * Writes out the backlog of the tap of `opts` as the tap takes frames again,
+ * until it is empty or a datagram is waiting on `sock`. Returns 0 then, -1 on
+ * failure.
+ */
+static int
+wait_tap_backlog(thread_opts_t *opts, int sock)
+{
+    struct tap_backlog *q = opts->tap_backlog_state;
+    struct pollfd pfds[2] = {
+        { .fd = sock, .events = POLLIN },
+        { .fd = opts->tap, .events = POLLOUT },
+    };
+
+    while (tap_backlog_flush(opts, q) < 0) {
+        int r = poll(pfds, 2, TAP_RETRY_MSEC);
+        if (r < 0 && errno != EINTR) return -1;
+        if (r > 0 && pfds[0].revents != 0) break;
+    }
+    return 0;
+}
+#else
+struct tap_backlog; // so is the backlog of the tap
+#endif
+
+/**
+ * Hands a frame to the local tap device, see write_to_tap. Where the tap is
+ * full, the frame waits at the end of the backlog `q` rather than hold up the
+ * caller, or is dropped if `q` is NULL. A frame the tap fails on is dropped as
+ * well, which never stops the thread.
+ */
+static void
+deliver_to_tap(thread_opts_t *opts, struct tap_backlog *q, unsigned char *buf,
+               int len)
+{
+#if defined(LINUX)
+    int vnet_len = opts->vnet_hdr ? VNET_HDR_LEN : 0;
+    // frames leave in the order they came in
+    if (q != NULL && q->count > 0 && tap_backlog_flush(opts, q) < 0) {
+        tap_backlog_push(opts, q, buf - vnet_len, len + vnet_len);
+        return;
+    }
+    if (write_to_tap(opts, buf, len) >= 0) return;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        stat_add_shared(&opts->tap_stats.eagain, 1);
+        if (q != NULL) {
+            tap_backlog_push(opts, q, buf - vnet_len, len + vnet_len);
+        } else {
+            stat_add_shared(&opts->tap_stats.drops, 1);
+        }
+        return;
+    }
+    stat_add_shared(&opts->tap_stats.drops, 1);
+#else
+    if (write_to_tap(opts, buf, len) >= 0) return;
+#endif
+    IPOP_LOG("write to tap failed\n");
+}
+
+/**
+ * Tells whether frames are handed to an upper layer (such as ipop-tincan)
+ * rather than sent to the peers directly over UDP.
+ */
+static inline int
+has_upper_layer(const thread_opts_t *opts)
+{
+#if defined(LINUX)
+    if (opts->send_batch_func != NULL || opts->shm != NULL) return 1;
+#endif
+#if defined(LINUX) || defined(ANDROID)
+    if (opts->sendv_func != NULL) return 1;
+#endif
+    return opts->send_func != NULL;
+}
+
+/**
+ * Tells whether datagrams to the peers are batched, segmented, aggregated or
+ * sent with MSG_ZEROCOPY, which only applies when we talk to the peers
+ * ourselves.
+ */
+static inline int
+direct_batching(const thread_opts_t *opts)
+{
+    return !has_upper_layer(opts) &&
+           (opts->batch > 1 || opts->udp_gso > 1 || opts->aggregate > 0 ||
+            opts->zerocopy > 0);
+}
+
+/**
+ * Hands the 40-byte ipop header at `hdr` and the `len` byte frame at `buf` to
+ * the upper layer. With send_batch_func the datagram is queued on `batch`, or
+ * handed over on its own if there is no batch, and a handoff batch passes it
+ * on to the send stage of the pipeline. With sendv_func both are passed
+ * as they are. The others take them in one piece, so the header is copied into
+ * the BUF_OFFSET bytes of headroom in front of the frame, unless it is already
+ * there.
+ */
+static int
+send_up(thread_opts_t *opts, struct tx_batch *batch, const char *hdr,
+        unsigned char *buf, int len)
+{
+#if defined(LINUX)
+    if (batch != NULL && batch->handoff != NULL) {
+        tx_batch_add(batch, hdr, BUF_OFFSET, buf, len, NULL);
+        return 0;
+    }
+    if (opts->shm != NULL) {
+        struct iovec iov[2] = {
+            { .iov_base = (void *) hdr, .iov_len = BUF_OFFSET },
+            { .iov_base = buf, .iov_len = len }
+        };
+        // a full ring drops the datagram, which the ring counts
+        ipop_shm_send(&opts->shm->rings[IPOP_SHM_UP], iov, 2, opts->headroom,
+                      opts->tailroom);
+        return 0;
+    }
+    if (opts->send_batch_func != NULL) {
+        if (batch != NULL) {
+            if (tx_batch_add(batch, hdr, BUF_OFFSET, buf, len, NULL)) {
+                tx_batch_flush(batch);
+            }
+            return 0;
+        }
+        const char *start = (const char *) buf - BUF_OFFSET;
+        size_t total = len + BUF_OFFSET;
+        if (hdr != start) memcpy(buf - BUF_OFFSET, hdr, BUF_OFFSET);
+        return opts->send_batch_func(&start, &total, 1) == 1 ? 0 : -1;
+    }
+#endif
+#if defined(LINUX) || defined(ANDROID)
+    if (opts->sendv_func != NULL) {
+        struct iovec iov[2] = {
+            { .iov_base = (void *) hdr, .iov_len = BUF_OFFSET },
+            { .iov_base = buf, .iov_len = len }
+        };
+        return opts->sendv_func(iov, 2);
+    }
+#endif
+    unsigned char *ipop_buf = buf - BUF_OFFSET;
+    if ((const unsigned char *) hdr != ipop_buf) {
+        memcpy(ipop_buf, hdr, BUF_OFFSET);
+    }
+    return opts->send_func((const char *) ipop_buf, len + BUF_OFFSET);
+}
+
+/**
+ * Sends the `hdr_len` byte link header at `hdr` and the `len` byte frame at
+ * `buf` to `dest_ipv4_addr_sock` over UDP, or queues the datagram on `batch`
+ * if one is given.
+ */
+static void
+send_datagram(thread_opts_t *opts, struct tx_batch *batch, const char *hdr,
+              int hdr_len, unsigned char *buf, int len,
+              const struct sockaddr_in *dest_ipv4_addr_sock)
+{
+#if defined(LINUX)
+    if (batch != NULL) {
+        if (tx_batch_add(batch, hdr, hdr_len, buf, len,
+                         dest_ipv4_addr_sock)) {
+            tx_batch_flush(batch);
+        }
+        return;
+    }
+#endif
+#if defined(LINUX) || defined(ANDROID)
+    // the header and the frame are gathered by the kernel, so the frame
+    // never has to be shifted or copied to make room for the header
+    struct iovec iov[2] = {
+        { .iov_base = (void *) hdr, .iov_len = hdr_len },
+        { .iov_base = buf, .iov_len = len }
+    };
+    struct msghdr msg = {
+        .msg_name = (void *) dest_ipv4_addr_sock,
+        .msg_namelen = sizeof(struct sockaddr_in),
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+    if (sendmsg(opts->sock4, &msg, 0) < 0) {
+        IPOP_LOG("sendto failed\n");
+    }
+#elif defined(WIN32)
+    memcpy(buf - hdr_len, hdr, hdr_len);
+    // send our processed packet off
+    if (sendto(opts->sock4, (const char *)(buf - hdr_len),
+               len + hdr_len, 0,
+               (const struct sockaddr *)dest_ipv4_addr_sock, sizeof(struct sockaddr_in)) < 0) {
+        IPOP_LOG("sendto failed\n");
+    }
+#endif
+}
+
+/**
+ * Picks the compact link header for frames to `peer` and writes its length to
+ * `hdr_len`. It is a HELLO asking for the peer's index as long as we do not
+ * know it, or learned it more than PEERLIST_INDEX_TTL seconds ago. A peer
+ * that restarted drops frames with the old index without telling us.
+ */
+static const char *
+compact_header(struct peer_state *peer, int *hdr_len)
+{
+    int age = (int) time(NULL) -
+              __atomic_load_n(&peer->index_learned, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&peer->compact_hdr, __ATOMIC_RELAXED) == 0 ||
+        age >= PEERLIST_INDEX_TTL) {
+        *hdr_len = COMPACT_HELLO_LEN;
+        return peer->hello_hdr[1];
+    }
+    *hdr_len = COMPACT_HDR_LEN;
+    return (const char *) &peer->compact_hdr;
+}
+
+/**
+ * Hands a frame and the ipop header at `hdr` to the upper layers, or sends it
+ * straight to `peer` over UDP when there is no upper layer. In the latter case
+ * the datagram is queued on `batch` if one is given, and with compact headers
+ * the peer's compact header replaces the ipop header.
+ */
+static void
+send_to_peer(thread_opts_t *opts, struct tx_batch *batch, const char *hdr,
+             unsigned char *buf, int len, struct peer_state *peer)
+{
+    // If the send_func function pointer is set then we use that to
+    // send packet to upper layers, in IPOP-Tincan this function just
+    // adds to a send blocking queue. If this is not set, then we
+    // send to the IP/port stored in the peerlist when the node was
+    // added to the network
+    if (has_upper_layer(opts)) {
+        if (send_up(opts, batch, hdr, buf, len) < 0) {
+            IPOP_LOG("send_func failed\n");
+        }
+        return;
+    }
+
+    // this is portion of the code allows ipop-tap nodes to
+    // communicate directly among themselves if necessary but
+    // there is no encryption provided with this approach
+    struct sockaddr_in dest_ipv4_addr_sock = {
+        .sin_family = AF_INET,
+        .sin_port = htons(peer->port),
+        .sin_addr = peer->dest_ipv4_addr,
+        .sin_zero = { 0 }
+    };
+    int hdr_len = BUF_OFFSET;
+    if (opts->compact_hdr) hdr = compact_header(peer, &hdr_len);
+    send_datagram(opts, batch, hdr, hdr_len, buf, len, &dest_ipv4_addr_sock);
+}
+
+/**
+ * Processes one frame of `rcount` bytes read from the tap device into `buf`.
+ * The BUF_OFFSET bytes in front of the frame must be writable, they are used
+ * for the ipop header when it has to be contiguous with the frame. Any trailer
+ * must already follow the frame. Returns -1 if the send thread should stop, 0
+ * otherwise.
+ */
+static int
+process_tap_frame(thread_opts_t *opts, struct tx_batch *batch,
+                  unsigned char *buf, int rcount)
+{
+    struct in_addr local_ipv4_addr;
+    struct in6_addr local_ipv6_addr;
+    struct ipop_ctx *ctx = ctx_of(opts);
+    struct peer_state *peer = NULL;
+    int result, is_ipv4;
+    int arp = 0;
+    int l3 = l3_offset(opts);
+    // what goes out to the peers, ARP replies to the tap reuse the (all zero)
+    // virtio-net header that was read with the request
+    int wire_len = rcount + trailer_length(opts);
+
+    /*---------------------------------------------------------------------
+    Switchmode
+    ---------------------------------------------------------------------*/
+    if (opts->switchmode) {
+
+        // Check whether target of ARP request message is tap itself
+        if (is_arp_req(buf) &&
+            is_my_ip4(buf, (const unsigned char *) opts->my_ip4)) {
+            create_arp_response_sw(buf, (unsigned char * ) opts->mac, 
+                                   (unsigned char *) opts->my_ip4);
+            // Write back ARP reply to tap device
+            deliver_to_tap(opts, NULL, buf, rcount);
+        }
+
+        /* If the frame is broadcast message, it sends the frame to
+           every TinCan links as physical switch does */
+        if (is_nonunicast(buf)) {
+            reset_id_table_ctx(ctx);
+            while( !is_id_table_end_ctx(ctx) ) {
+                if ( is_id_exist_ctx(ctx) )  {
+                    /* TODO It may be better to retrieve the iterator rather
+                       than key string itself.  */
+                    peer = retrieve_peer_ctx(ctx);
+                    if (has_upper_layer(opts)) {
+                        if (send_up(opts, batch, peer->hdr, buf, wire_len) < 0) {
+                            IPOP_LOG("send_func failed\n");
+                        }
+                    }
+                }
+                increase_id_table_itr_ctx(ctx);
+            }
+            return 0;
+        }
+
+        /* If the MAC address is in the table, we forward the frame to
+           destined TinCan link */
+        peerlist_get_by_mac_addr_ctx(ctx, buf, &peer);
+        if (has_upper_layer(opts)) {
+            if (send_up(opts, batch, peer->hdr, buf, wire_len) < 0) {
+                IPOP_LOG("send_func failed\n");
+            }
+        }
+        return 0;
+    }
+
+    /*---------------------------------------------------------------------
+    Conventional IPOP Tap (non-switchmode)
+    ---------------------------------------------------------------------*/
+
+    // checks to see if this is an ARP request, if so, send response (a tun
+    // device does not do ARP)
+    if (!opts->tun && buf[12] == 0x08 && buf[13] == 0x06 && buf[21] == 0x01
+        && !opts->switchmode) {
+        if (create_arp_response_ctx(ctx, buf) == 0) {
+            // This doesn't handle partial writes yet, we need a loop to
+            // guarantee a full write.
+            deliver_to_tap(opts, NULL, buf, rcount);
+        }
+        return 0;
+    }
+
+
+    // the peer is found by the destination address of the packet
+    if (rcount > l3 && (buf[l3] >> 4) == 0x04) { // ipv4 packet
+        memcpy(&local_ipv4_addr.s_addr, buf + l3 + 16, 4);
+        is_ipv4 = 1;
+    } else if (rcount > l3 && (buf[l3] >> 4) == 0x06) { // ipv6 packet
+        memcpy(&local_ipv6_addr.s6_addr, buf + l3 + 24, 16);
+        is_ipv4 = 0;
+    } else if (buf[12] == 0x08 && buf[13] == 0x06 && opts->switchmode) {
+        arp = 1;
+        is_ipv4 = 0;
+    } else {
+        IPOP_LOG("unknown IP packet type: 0x%x\n", buf[l3] >> 4);
+        return 0;
+    }
+
+    // we need to initialize peerlist
+    peerlist_reset_iterators_ctx(ctx);
+    while (1) {
+        if (arp || is_ipv4) {
+            result = peerlist_get_by_local_ipv4_addr_ctx(ctx, &local_ipv4_addr,
+                                                         &peer);
+        } else {
+            result = peerlist_get_by_local_ipv6_addr_ctx(ctx, &local_ipv6_addr,
+                                                         &peer);
+        }
+
+        // -1 means something went wrong, should not happen
+        if (result == -1) break;
+
+        // the ipop header is the local peer uid as first 20-bytes and then
+        // the dest peer uid as the next 20-bytes. That is necessary for
+        // routing by upper layers. Every peer keeps a prebuilt copy of it, so
+        // a multicast frame goes out to each peer without being rewritten.
+        const char *hdr;
+        if (arp) {
+            // ARP message should not be forwarded to peers but to 
+            // controller only
+            hdr = peerlist_null_ctx(ctx)->hdr;
+        } else {
+            hdr = peer->hdr;
+        }
+
+        // we only translate if we have IPv4 packet and translate is on
+        if (!arp && is_ipv4 && opts->translate) {
+            translate_packet_ctx(ctx, buf + l3 - ETH_HDR_LEN, NULL, NULL,
+                                 rcount - l3 + ETH_HDR_LEN);
+        }
+
+        send_to_peer(opts, batch, hdr, buf, wire_len, peer);
+        if (result == 0) break;
+    }
+    return 0;
+}
+
+#if defined(LINUX)
+/**
+ * Processes a frame read from a tap with offloads on. The virtio-net header in
+ * front of the frame is appended to it as the trailer. A super-frame that would
+ * not fit into one datagram is cut into regular frames here instead, which only
+ * happens if the device ignored its gso_max_size.
+ */
+static int
+process_tap_vnet_frame(thread_opts_t *opts, struct tx_batch *batch,
+                       unsigned char *buf, int rcount)
+{
+    struct virtio_net_hdr vnet;
+    struct gso_state gso;
+    int len;
+
+    memcpy(&vnet, buf - VNET_HDR_LEN, VNET_HDR_LEN);
+    if (BUF_OFFSET + rcount + VNET_HDR_LEN <= OFFLOAD_DATAGRAM_MAX) {
+        vnet_hdr_to_wire(&vnet, buf + rcount);
+        return process_tap_frame(opts, batch, buf, rcount);
+    }
+
+    if (gso_init(&gso, &vnet, buf, rcount) < 0) return 0;
+
+    // the segments share one scratch buffer, so they can not wait in the
+    // batch, and what is queued already has to leave before them. A handoff
+    // copies each into a buffer of its own, which keeps it behind the frames
+    // handed off before.
+    struct tx_batch *seg_batch = NULL;
+    if (batch != NULL && batch->handoff != NULL) {
+        seg_batch = batch;
+    } else if (batch != NULL) {
+        tx_batch_flush(batch);
+    }
+    unsigned char seg_buf[buffer_headroom(opts) + gso.hdr_len + gso.mss +
+                          VNET_HDR_LEN + opts->tailroom];
+    unsigned char *seg = seg_buf + buffer_headroom(opts);
+
+    // segments carry complete checksums, so their trailer is all zero
+    memset(&vnet, 0, sizeof(vnet));
+    while ((len = gso_next(&gso, seg)) > 0) {
+        vnet_hdr_to_wire(&vnet, seg + len);
+        if (process_tap_frame(opts, seg_batch, seg, len) < 0) return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Processes a frame of `rcount` bytes that read_from_tap placed into `buf`.
+ */
+static int
+process_tap_read(thread_opts_t *opts, struct tx_batch *batch,
+                 unsigned char *buf, int rcount)
+{
+#if defined(LINUX)
+    if (opts->vnet_hdr) {
+        return process_tap_vnet_frame(opts, batch, buf, rcount);
+    }
+#endif
+    return process_tap_frame(opts, batch, buf, rcount);
+}
+
+/**
+ * Writes the frame of one datagram from a remote peer to the tap, `rcount`
+ * bytes long including the BUF_OFFSET bytes of link header room at `ipop_buf`.
+ * The datagram came from `source`, or if that is NULL, from the peer named by
+ * the ipop header. Returns -1 if the receive thread should stop, 0 otherwise.
+ */
+static int
+deliver_link_frame(thread_opts_t *opts, unsigned char *ipop_buf, int rcount,
+                   struct peer_state *source)
+{
+    // ipop_buf will contain 40-byte header + ethernet frame
+    unsigned char *buf = ipop_buf + BUF_OFFSET;
+    char source_id[ID_SIZE] = { 0 };
+    char dest_id[ID_SIZE] = { 0 };
+    struct ipop_ctx *ctx = ctx_of(opts);
+    struct peer_state *peer = NULL;
+    int partial_csum = 0;
+#if defined(LINUX)
+    struct virtio_net_hdr vnet;
+#endif
+
+    // update packet size to remove 40-byte header size, this is
+    // important to have correct size when writing packet to VNIC
+    rcount -= BUF_OFFSET;
+
+#if defined(LINUX)
+    // the virtio-net header travels as a trailer after the frame, it is put
+    // in front of the frame again right before the frame goes to the tap
+    if (opts->vnet_hdr) {
+        if (rcount < VNET_HDR_LEN) return 0;
+        rcount -= VNET_HDR_LEN;
+        vnet_hdr_from_wire(buf + rcount, &vnet);
+        partial_csum = vnet.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+#endif
+
+    // read the 20-byte source and dest uids from the ipop header
+    get_headers(ipop_buf, source_id, dest_id);
+
+    // ARP request target the tap of myself. It create ARP reply and sends
+    // back the message back to the IPOP link it comes from.
+    if (is_arp_req(buf) && (opts->switchmode == 1) &&
+        is_my_ip4(buf, (const unsigned char *) opts->my_ip4)) {
+
+        // Swaps source and destination UID (IPOP link identifier)
+        // so that the ARP reply message goes back to source
+        char temp[ID_SIZE];
+        memcpy(temp, ipop_buf, ID_SIZE);
+        memcpy(ipop_buf, ipop_buf+ID_SIZE, ID_SIZE);
+        memcpy(ipop_buf + ID_SIZE, temp, ID_SIZE);
+
+        create_arp_response_sw(buf, (unsigned char *) opts->mac,
+                               (unsigned char *) opts->my_ip4);
+
+        if (has_upper_layer(opts)) {
+            if (send_up(opts, NULL, (const char *) ipop_buf, buf,
+                        rcount + trailer_length(opts)) < 0) {
+               IPOP_LOG("send_func failed\n");
+            }
+        }
+        // Do not need to go further
+        return 0;
+    }
+
+    /* L2 broadcasting is forwarded from TinCan link. 
+       To make switchmode working, TinCan requires mac learning. Checking
+       all ethernet frame may be overkill. So it check only L2 broadcast
+       (for BOOTP/DHCP) and ARP for mac learning process.  */
+    if (ipop_buf[52] == 0x08 && ipop_buf[53] == 0x06 && 
+        (ipop_buf[61] == 0x02 || ipop_buf[61] == 0x01) && 
+        opts->switchmode == 1) {
+        /* ARP message is forwarded from TinCan links. Add the mac to the
+           table  */
+        arp_sha_mac_add_ctx(ctx, (const unsigned char *) ipop_buf);
+    }
+
+    if (ipop_buf[40] == 0xff && ipop_buf[41] == 0xff && 
+        ipop_buf[42] == 0xff && ipop_buf[43] == 0xff &&
+        ipop_buf[44] == 0xff && ipop_buf[45] == 0xff && 
+        opts->switchmode == 1) {
+        /* L2 Broadcast is forwarded from TinCan links. Add source mac to
+           the table  */
+        source_mac_add_ctx(ctx, (const unsigned char *) ipop_buf);
+    }
+
+    // perform translation if IPv4 and translate is enabled
+    int l3 = l3_offset(opts);
+    if (rcount > l3 && (buf[l3] >> 4) == 0x04 && opts->translate) {
+        // the translator finds the IP header ETH_HDR_LEN bytes into the
+        // frame and leaves the bytes in front of it alone, so a bare IP
+        // packet is handed over as if it had an ethernet header
+        unsigned char *frame = buf + l3 - ETH_HDR_LEN;
+        int frame_len = rcount - l3 + ETH_HDR_LEN;
+        const struct peer_state *local = peerlist_local_ctx(ctx);
+        // the sender is known already if the datagram had a compact header
+        peer = source;
+        int peer_found = (peer != NULL) ? 0 :
+                         peerlist_get_by_id_ctx(ctx, source_id, &peer);
+        // -1 indicates that no peer was found in the list so translation
+        // cannot be performed, it is important to keep in mind that the
+        // packet will get written to OS even if it is not translated
+        // this is necessary for multicast and broadcast packets.
+        // TODO - Do not allow untranslated packets to go to OS in svpn
+        if (peer_found != -1) {
+            // this call updates IP packet payload for MDNS and UPNP
+            translate_packet_ctx(ctx, frame,
+                           (char *)(&peer->local_ipv4_addr.s_addr),
+                           (char *)(&local->local_ipv4_addr.s_addr),
+                           frame_len);
+            // this call updates the IPv4 header with locally assign source
+            // and destination ip addresses obtained from the peerlist
+            if (partial_csum) {
+                translate_headers_partial(frame,
+                           (char *)(&peer->local_ipv4_addr.s_addr),
+                           (char *)(&local->local_ipv4_addr.s_addr),
+                           frame_len);
+            } else {
+                translate_headers(frame,
+                           (char *)(&peer->local_ipv4_addr.s_addr),
+                           (char *)(&local->local_ipv4_addr.s_addr),
+                           frame_len);
+            }
+        }
+    }
+
+    // it is important to make sure Eternet frame has the correct dest mac
+    // address for OS to accept the packet. Since ipop tap mac address is
+    // only known locally, this is a mandatory step
+    // When we need to broadcast arp request message it should be destined
+    // to every nodes in l2 network, so we do not update mac of destination.
+
+    // In switchmode, the destination mac address should be the mac address
+    // of final destination mac address but not the ipop mac address. Here, 
+    // if the source mac address (buf[6:12]) is the same with the
+    // destination  mac address (buf[0:6]), we regard this frame from the
+    // remote host. If it is different, we think this frame comes from the
+    // container. 
+    // More accurate implementation would be tap device
+    // keeping ARP table or query O/S whether certain mac address is in 
+    // network. 
+    // A tun device has no ethernet header to fix up.
+    if (!opts->tun && (opts->switchmode == 0 ||
+         (memcmp(buf, buf+6, 6) == 0 && opts->switchmode == 1))) {
+        update_mac(buf, opts->mac);
+    }
+#if defined(LINUX)
+    if (opts->vnet_hdr) memcpy(buf - VNET_HDR_LEN, &vnet, VNET_HDR_LEN);
+#endif
+    deliver_to_tap(opts, opts->tap_backlog_state, buf, rcount);
+    return 0;
+}
+
+/**
+ * Unpacks a container datagram of `rcount` bytes at `ipop_buf` from `source`
+ * (see deliver_link_frame) and delivers every frame in it as if it had come on
+ * its own. Each frame is copied behind its own copy of the link header room,
+ * which delivery may rewrite. Containers within containers are dropped.
+ * Returns -1 if the receive thread should stop, 0 otherwise.
+ */
+static int
+process_aggregate(thread_opts_t *opts, unsigned char *ipop_buf, int rcount,
+                  struct peer_state *source)
+{
+    const unsigned char *container = ipop_buf + BUF_OFFSET;
+    int len = rcount - BUF_OFFSET;
+    int offset = 0, frame_len;
+    const unsigned char *frame;
+    unsigned char frame_buf[rcount];
+
+    while ((frame = get_aggregate_frame(container, len, &offset,
+                                        &frame_len)) != NULL) {
+        if (is_aggregate(frame, frame_len)) continue;
+        memcpy(frame_buf, ipop_buf, BUF_OFFSET);
+        memcpy(frame_buf + BUF_OFFSET, frame, frame_len);
+        if (deliver_link_frame(opts, frame_buf, BUF_OFFSET + frame_len,
+                               source) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Answers a HELLO that asked for our index with a HELLO of our own that
+ * carries no frame, so that the index gets across even if no traffic goes
+ * back to the peer. Peers keep asking until they heard from us, the answers
+ * are limited to one per second.
+ */
+static void
+answer_hello(thread_opts_t *opts, struct peer_state *peer)
+{
+    int now = (int) time(NULL);
+    if (__atomic_exchange_n(&peer->hello_sent, now, __ATOMIC_RELAXED) == now) {
+        return;
+    }
+    struct sockaddr_in dest_ipv4_addr_sock = {
+        .sin_family = AF_INET,
+        .sin_port = htons(peer->port),
+        .sin_addr = peer->dest_ipv4_addr,
+        .sin_zero = { 0 }
+    };
+    unsigned char hello[COMPACT_HELLO_LEN];
+    // WIN32 puts the header in front of the frame
+    send_datagram(opts, NULL, peer->hello_hdr[0], COMPACT_HELLO_LEN,
+                  hello + COMPACT_HELLO_LEN, 0, &dest_ipv4_addr_sock);
+}
+
+/**
+ * Finds the peer a datagram with a compact link header came from. The header
+ * must be in the last COMPACT_HDR_LEN bytes of the link header room at
+ * `*ipop_buf`. A HELLO tells us the peer's index for us, and its frame starts
+ * after the id of the peer, so `*ipop_buf` and `*rcount` are moved past that.
+ * Returns 0 if there is a frame to process, -1 if the datagram is done with.
+ */
+static int
+resolve_compact_header(thread_opts_t *opts, unsigned char **ipop_buf,
+                       int *rcount, struct peer_state **source)
+{
+    unsigned char *hdr = *ipop_buf + BUF_OFFSET - COMPACT_HDR_LEN;
+    int flags, epoch, index;
+    const int id_len = COMPACT_HELLO_LEN - COMPACT_HDR_LEN;
+
+    if (*rcount < BUF_OFFSET ||
+        get_compact_header(hdr, &flags, &epoch, &index) < 0) {
+        return -1;
+    }
+    if (!(flags & COMPACT_F_HELLO)) {
+        return peerlist_get_by_index_ctx(ctx_of(opts), epoch, index, source);
+    }
+
+    // the slow path, once per peer or so
+    if (*rcount < BUF_OFFSET + id_len ||
+        peerlist_get_by_id_ctx(ctx_of(opts),
+                               (const char *) hdr + COMPACT_HDR_LEN,
+                               source) < 0) {
+        return -1;
+    }
+    peerlist_learn_index(*source, epoch, index);
+    if (flags & COMPACT_F_ASK) answer_hello(opts, *source);
+    *ipop_buf += id_len;
+    *rcount -= id_len;
+    return *rcount > BUF_OFFSET ? 0 : -1;
+}
+
+/**
+ * Processes one datagram received from a remote peer, `rcount` bytes long
+ * including the 40-byte ipop header at `ipop_buf`. With compact link headers
+ * the datagram was received BUF_OFFSET - COMPACT_HDR_LEN bytes into
+ * `ipop_buf`, see link_offset. Returns -1 if the receive thread should stop,
+ * 0 otherwise.
+ */
+static int
+process_link_frame(thread_opts_t *opts, unsigned char *ipop_buf, int rcount)
+{
+    struct peer_state *source = NULL;
+
+    if (opts->compact_hdr) {
+        if (resolve_compact_header(opts, &ipop_buf, &rcount, &source) < 0) {
+            return 0;
+        }
+    } else if (is_icc(ipop_buf)) {
+        /* ICC message use certain MAC address value (00-69-70-6f-70-0?) to
+           identify itself as ICC message. Generally, in this receiving
+           thread, we receive the message from TinCan link and put to tap
+           device. But, this ICC message need to go to the TinCan manager and
+           then controller.*/
+        if (has_upper_layer(opts)) {
+            /* Set destination and source uid field all NULL that tincan pass
+               this message to the controller */
+            memset(ipop_buf+ID_SIZE, 0x00, ID_SIZE);
+            if (send_up(opts, NULL, (const char *) ipop_buf,
+                        ipop_buf + BUF_OFFSET, rcount - BUF_OFFSET) < 0) {
+               IPOP_LOG("send_func failed\n");
+            }
+        }
+        return 0;
+    }
+
+    if (is_aggregate(ipop_buf + BUF_OFFSET, rcount - BUF_OFFSET)) {
+        return process_aggregate(opts, ipop_buf, rcount, source);
+    }
+    return deliver_link_frame(opts, ipop_buf, rcount, source);
+}
+
+/**
+ * Processes one datagram the upper layer handed over, `len` bytes long of
+ * which the first `headroom` are the upper layer's own. Returns -1 if the
+ * receive thread should stop, 0 otherwise.
+ */
+static int
+process_upper_frame(thread_opts_t *opts, unsigned char *buf, int len)
+{
+    if (len < opts->headroom) return 0;
+    return process_link_frame(opts, buf + opts->headroom,
+                              len - opts->headroom);
+}
+
+#if defined(LINUX)
+
+/**
+ * Blocks until the (non-blocking) file descriptor `fd` has data to read, or
+ * until `timeout` passed if it is not NULL. Returns a positive number if `fd`
+ * is readable, 0 on timeout and -1 on failure.
+ */
+static int
+wait_readable(int fd, const struct timespec *timeout)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int r;
+    do {
+        r = ppoll(&pfd, 1, timeout, NULL);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+static long long
+elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000LL +
+           (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Waits for the non-blocking `fd` to become readable after a read came up
+ * empty. With busy polling on (`usec` > 0) it polls without sleeping for up
+ * to `usec` microseconds first, which saves the scheduler wakeup when the next
+ * packet is close, and the time spent either way is added to `stats`. Returns
+ * 0 once `fd` is readable, -1 on failure.
+ */
+static int
+wait_busy(int fd, int usec, struct ipop_poll_stats *stats)
+{
+    static const struct timespec zero = { 0, 0 };
+    struct timespec start, now;
+    int r;
+
+    if (usec <= 0) return wait_readable(fd, NULL) < 0 ? -1 : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        r = wait_readable(fd, &zero);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (r != 0) {
+            stat_add(&stats->spin_ns, elapsed_ns(&start, &now));
+            if (r > 0) stat_add(&stats->spin_hits, 1);
+            return r < 0 ? -1 : 0;
+        }
+    } while (elapsed_ns(&start, &now) < usec * 1000LL);
+    stat_add(&stats->spin_ns, elapsed_ns(&start, &now));
+
+    start = now;
+    r = wait_readable(fd, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stat_add(&stats->sleep_ns, elapsed_ns(&start, &now));
+    stat_add(&stats->sleeps, 1);
+    return r < 0 ? -1 : 0;
+}
+
+/**
+ * Copies the counters in `from` to `to`, while their thread may update them.
+ */
+static void
+copy_poll_stats(struct ipop_poll_stats *to, const struct ipop_poll_stats *from)
+{
+    to->spin_ns = __atomic_load_n(&from->spin_ns, __ATOMIC_RELAXED);
+    to->sleep_ns = __atomic_load_n(&from->sleep_ns, __ATOMIC_RELAXED);
+    to->spin_hits = __atomic_load_n(&from->spin_hits, __ATOMIC_RELAXED);
+    to->sleeps = __atomic_load_n(&from->sleeps, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies how long the send and receive threads for `opts` spent polling and
+ * sleeping while they waited for packets to `send` and `recv`.
+ */
+void
+ipop_poll_stats(const struct thread_opts *opts, struct ipop_poll_stats *send,
+                struct ipop_poll_stats *recv)
+{
+    copy_poll_stats(send, &opts->send_poll);
+    copy_poll_stats(recv, &opts->recv_poll);
+}
+
+/**
+ * Copies what became of the frames the tap of `opts` did not take right away
+ * to `stats`.
+ */
+void
+ipop_tap_stats(const struct thread_opts *opts, struct ipop_tap_stats *stats)
+{
+    stats->eagain = __atomic_load_n(&opts->tap_stats.eagain, __ATOMIC_RELAXED);
+    stats->queued = __atomic_load_n(&opts->tap_stats.queued, __ATOMIC_RELAXED);
+    stats->drops = __atomic_load_n(&opts->tap_stats.drops, __ATOMIC_RELAXED);
+}
+
+/**
+ * Prints the busy polling counters of one side when its thread stops.
+ */
+static void
+report_poll_stats(const char *side, const struct ipop_poll_stats *stats)
+{
+    fprintf(stderr, "%s thread polled %llu ms (%llu hits), slept %llu ms "
+                    "(%llu times)\n", side, stats->spin_ns / 1000000,
+            stats->spin_hits, stats->sleep_ns / 1000000, stats->sleeps);
+}
+
+/**
+ * Prints the tap counters when the receive side stops, if the tap ever was
+ * full.
+ */
+static void
+report_tap_stats(const struct ipop_tap_stats *stats)
+{
+    if (stats->eagain == 0 && stats->drops == 0) return;
+    fprintf(stderr, "tap was full %llu times, %llu frames waited for it, "
+                    "%llu dropped\n", stats->eagain, stats->queued,
+            stats->drops);
+}
+
+/**
+ * Waits for the tap to become readable again while datagrams are pending in
+ * the batch, for what is left of the flush deadline of `usec` microseconds
+ * that started at `since`. Returns 1 if the tap is readable before the
+ * deadline, 0 if the batch should be flushed now.
+ */
+static int
+wait_for_more(int tap, int usec, const struct timespec *since)
+{
+    struct timespec now, left;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - since->tv_sec) * 1000000L +
+                   (now.tv_nsec - since->tv_nsec) / 1000;
+    if (elapsed >= usec) return 0;
+    left.tv_sec = (usec - elapsed) / 1000000L;
+    left.tv_nsec = ((usec - elapsed) % 1000000L) * 1000;
+    return wait_readable(tap, &left) > 0;
+}
+
+/**
+ * Drops the buffers in `held`, once the datagrams that pointed into them have
+ * left.
+ */
+static void
+release_held(struct pktbuf **held, int *nheld)
+{
+    for (int i = 0; i < *nheld; i++) {
+        pktbuf_put(held[i]);
+    }
+    *nheld = 0;
+}
+
+// Buffers whose datagrams may have left with MSG_ZEROCOPY, in the order they
+// were sent. Each is kept until every zerocopy send made before it was retired
+// is complete.
+struct zc_pending {
+    struct tx_zerocopy zc;
+    struct pktbuf **pkts;
+    uint32_t *marks;
+    int size;
+    int head;
+    int count;
+};
+
+static int
+zc_pending_init(struct zc_pending *pending, int sock, int size)
+{
+    memset(pending, 0, sizeof(struct zc_pending));
+    if (tx_zerocopy_init(&pending->zc, sock) < 0) return -1;
+    pending->pkts = malloc(size * sizeof(struct pktbuf *));
+    pending->marks = malloc(size * sizeof(uint32_t));
+    if (pending->pkts == NULL || pending->marks == NULL) {
+        free(pending->pkts);
+        free(pending->marks);
+        return -1;
+    }
+    pending->size = size;
+    return 0;
+}
+
+/**
+ * Drops the pending buffers the kernel is done with, after reading its
+ * completions, which with `block` set waits for at least one of them. Returns
+ * 0 on success, -1 on failure.
+ */
+static int
+zc_pending_reap(struct zc_pending *pending, int block)
+{
+    if (tx_zerocopy_reap(&pending->zc, block) < 0) return -1;
+    while (pending->count > 0 &&
+           tx_zerocopy_passed(&pending->zc, pending->marks[pending->head])) {
+        pktbuf_put(pending->pkts[pending->head]);
+        pending->head = (pending->head + 1) % pending->size;
+        pending->count--;
+    }
+    return 0;
+}
+
+/**
+ * Waits until the kernel is done with every pending buffer, then frees the
+ * queue.
+ */
+static void
+zc_pending_free(struct zc_pending *pending)
+{
+    while (pending->count > 0 && zc_pending_reap(pending, 1) == 0);
+    free(pending->pkts);
+    free(pending->marks);
+}
+
+/**
+ * Drops `pkt` once nothing points into it. Without zerocopy that is now, with
+ * it the buffer waits in `pending` for the sends made so far to complete.
+ */
+static void
+retire(struct zc_pending *pending, struct pktbuf *pkt)
+{
+    if (pending == NULL) {
+        pktbuf_put(pkt);
+        return;
+    }
+    int tail = (pending->head + pending->count++) % pending->size;
+    pending->pkts[tail] = pkt;
+    pending->marks[tail] = pending->zc.next;
+}
+
+/**
+ * Retires the buffers in `held`, once the datagrams that pointed into them
+ * have left.
+ */
+static void
+retire_held(struct zc_pending *pending, struct pktbuf **held, int *nheld)
+{
+    if (pending == NULL) {
+        release_held(held, nheld);
+        return;
+    }
+    for (int i = 0; i < *nheld; i++) {
+        retire(pending, held[i]);
+    }
+    *nheld = 0;
+}
+
+/**
+ * Keeps `pkt` in `held` while the datagram last queued on `batch` points into
+ * it, and retires it otherwise. Whatever was held before is retired as soon as
+ * the batch is empty, since an early flush while the frame was processed sent
+ * all of it.
+ */
+static void
+hold_or_retire(struct tx_batch *batch, struct zc_pending *pending,
+               struct pktbuf **held, int *nheld, struct pktbuf *pkt)
+{
+    if (batch->count == 0) retire_held(pending, held, nheld);
+    if (tx_batch_holds(batch, pkt->data)) {
+        held[(*nheld)++] = pkt;
+    } else {
+        retire(pending, pkt);
+    }
+}
+
+/**
+ * Sends what is queued on `batch` and retires the buffers it held. The peers
+ * may be replaced afterwards once no zerocopy send is pending.
+ */
+static void
+flush_held(struct tx_batch *batch, struct zc_pending *pending,
+           struct pktbuf **held, int *nheld)
+{
+    tx_batch_flush(batch);
+    retire_held(pending, held, nheld);
+    if (pending != NULL) zc_pending_reap(pending, 0);
+    // zerocopy sends still point at the headers of their peers
+    if (pending == NULL || pending->count == 0) peerlist_quiescent();
+}
+
+/**
+ * The send loop used when batching is enabled in direct mode, or when the
+ * upper layer takes batches. Frames are read from the (now non-blocking) tap
+ * as long as the kernel has any queued, each into its own buffer, and the
+ * resulting datagrams leave with one sendmmsg (or send_batch_func) call once
+ * the tap runs dry (and the flush deadline passed) or the batch is full. With
+ * UDP segmentation a datagram may carry several frames. With zerocopy on, the
+ * buffers of large datagrams go back to the pool only once the kernel
+ * reported their send complete.
+ */
+static void
+send_loop_batched(thread_opts_t *opts, int size)
+{
+    struct tx_batch batch;
+    struct timespec first_queued = { 0, 0 };
+    if (opts->send_batch_func != NULL) {
+        if (tx_batch_init_func(&batch, opts->send_batch_func, size) < 0) {
+            return;
+        }
+    } else if (tx_batch_init(&batch, opts->sock4, size, opts->udp_gso,
+                             opts->aggregate) < 0) {
+        return;
+    }
+
+    // every frame waiting in the batch needs a buffer of its own, super-frames
+    // hardly ever share a datagram so they get one buffer per datagram only
+    struct pktbuf_pool pool;
+    size = batch.size;
+    if (!opts->vnet_hdr) size = tx_batch_frames(&batch);
+
+    // zerocopy sends keep their buffers for a while after the flush, twice
+    // as many let the next batch fill up in the meantime
+    struct zc_pending zc_pending, *pending = NULL;
+    if (opts->zerocopy > 0 && opts->send_batch_func == NULL) {
+        if (zc_pending_init(&zc_pending, opts->sock4, 2 * size) == 0) {
+            pending = &zc_pending;
+            tx_batch_set_zerocopy(&batch, &pending->zc, opts->zerocopy);
+        } else {
+            fprintf(stderr, "sending without zerocopy\n");
+        }
+    }
+    if (pktbuf_pool_init(&pool, pending != NULL ? 2 * size : size,
+                         buffer_length(opts), buffer_headroom(opts)) < 0) {
+        if (pending != NULL) zc_pending_free(pending);
+        return;
+    }
+    struct pktbuf *held[size]; // buffers queued datagrams point into
+    int nheld = 0;
+
+    if (make_nonblocking(opts->tap) < 0) {
+        fprintf(stderr, "could not make the tap non-blocking\n");
+        if (pending != NULL) zc_pending_free(pending);
+        pktbuf_pool_destroy(&pool);
+        return;
+    }
+
+    while (1) {
+        struct pktbuf *pkt = pktbuf_alloc(&pool);
+        if (pkt == NULL) {
+            // every buffer is pending, waiting for the kernel
+            if (zc_pending_reap(pending, 1) < 0) break;
+            continue;
+        }
+        int rcount = read_from_tap(opts, pkt->data, frame_room(opts, pkt));
+        if (rcount < 0) {
+            pktbuf_put(pkt);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (batch.count > 0 && opts->flush_usec > 0 &&
+                    wait_for_more(opts->tap, opts->flush_usec,
+                                  &first_queued)) {
+                    continue;
+                }
+                flush_held(&batch, pending, held, &nheld);
+                if (wait_busy(opts->tap, opts->busy_poll_usec,
+                              &opts->send_poll) < 0) {
+                    break;
+                }
+                continue;
+            }
+            if (errno == EINTR) continue;
+            fprintf(stderr, "tap read failed\n");
+            break;
+        }
+        pkt->len = rcount;
+
+        int was_empty = (batch.count == 0);
+        if (process_tap_read(opts, &batch, pkt->data, pkt->len) < 0) {
+            pktbuf_put(pkt);
+            break;
+        }
+        if (was_empty && batch.count > 0 && opts->flush_usec > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &first_queued);
+        }
+
+        // the pool must not run dry, so the batch leaves once it holds every
+        // buffer
+        hold_or_retire(&batch, pending, held, &nheld, pkt);
+        if (nheld >= size) flush_held(&batch, pending, held, &nheld);
+    }
+    flush_held(&batch, pending, held, &nheld);
+    if (pending != NULL) zc_pending_free(pending);
+    pktbuf_pool_destroy(&pool);
+}
+
+/**
+ * Processes the `count` buffers the last rx_batch_recv call filled. Datagrams
+ * the kernel coalesced are split up again and processed one after the other,
+ * in place. Returns -1 if the receiving side should stop, 0 otherwise.
+ */
+static int
+process_rx_batch(thread_opts_t *opts, struct rx_batch *batch, int count)
+{
+    int link_off = link_offset(opts);
+    for (int i = 0; i < count; i++) {
+        unsigned char *data = batch->iovs[i].iov_base;
+        int len = batch->msgs[i].msg_len;
+        int seg_size = rx_batch_segment_size(batch, i);
+        for (int offset = 0; offset < len; offset += seg_size) {
+            int seg_len = len - offset;
+            if (seg_len > seg_size) seg_len = seg_size;
+            // the room in front of a segment held the one before, which is
+            // done with
+            if (process_link_frame(opts, data + offset - link_off,
+                                   seg_len + link_off) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * The receive loop used when batching or UDP_GRO is enabled in direct mode,
+ * every recvmmsg call takes as many datagrams as are waiting, up to the batch
+ * size. Datagrams the kernel coalesced are split up again and processed one
+ * after the other, in place.
+ */
+static void
+recv_loop_batched(thread_opts_t *opts, int size)
+{
+    struct rx_batch batch;
+    struct pktbuf_pool pool;
+    unsigned char *bufs[IPOP_BATCH_MAX];
+    int link_off = link_offset(opts);
+    int buflen = buffer_length(opts);
+    if (opts->udp_gro && buflen < RX_GRO_BUFLEN + link_off) {
+        buflen = RX_GRO_BUFLEN + link_off;
+    }
+    if (size > IPOP_BATCH_MAX) size = IPOP_BATCH_MAX;
+
+    // the buffers stay posted for as long as the loop runs, each datagram is
+    // done with before the next recvmmsg call
+    if (pktbuf_pool_init(&pool, size, buflen, BUF_OFFSET) < 0) return;
+    for (int i = 0; i < size; i++) {
+        bufs[i] = pktbuf_alloc(&pool)->head + link_off;
+    }
+    if (rx_batch_init(&batch, opts->sock4, bufs, buflen - link_off, size,
+                      opts->udp_gro) < 0) {
+        pktbuf_pool_destroy(&pool);
+        return;
+    }
+    if (opts->busy_poll_usec > 0 && make_nonblocking(opts->sock4) < 0) {
+        fprintf(stderr, "could not make the socket non-blocking\n");
+        pktbuf_pool_destroy(&pool);
+        return;
+    }
+
+    while (1) {
+        if (tap_backlog_pending(opts) &&
+            wait_tap_backlog(opts, opts->sock4) < 0) {
+            break;
+        }
+        int count = rx_batch_recv(&batch);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_busy(opts->sock4, opts->busy_poll_usec,
+                          &opts->recv_poll) < 0) {
+                break;
+            }
+            continue;
+        }
+        if (count < 0) {
+            fprintf(stderr, "udp recv failed\n");
+            break;
+        }
+        if (process_rx_batch(opts, &batch, count) < 0) break;
+        peerlist_quiescent();
+    }
+    pktbuf_pool_destroy(&pool);
+}
+
+/**
+ * The receive loop used when the upper layer hands over batches through
+ * recv_batch_func, each call drains up to `size` datagrams.
+ */
+static void
+recv_loop_func(thread_opts_t *opts, int size)
+{
+    struct pktbuf_pool pool;
+    char *bufs[IPOP_BATCH_MAX];
+    size_t lens[IPOP_BATCH_MAX];
+    int buflen = buffer_length(opts);
+    if (size > IPOP_BATCH_MAX) size = IPOP_BATCH_MAX;
+
+    if (pktbuf_pool_init(&pool, size, buflen, BUF_OFFSET) < 0) return;
+    for (int i = 0; i < size; i++) {
+        bufs[i] = (char *) pktbuf_alloc(&pool)->head;
+    }
+
+    while (1) {
+        int count = opts->recv_batch_func(bufs, lens, buflen, size);
+        if (count < 0) {
+            fprintf(stderr, "recv_batch_func failed\n");
+            break;
+        }
+        int stop = 0;
+        for (int i = 0; i < count && !stop; i++) {
+            stop = process_upper_frame(opts, (unsigned char *) bufs[i],
+                                       lens[i]) < 0;
+        }
+        peerlist_quiescent();
+        if (stop) break;
+    }
+    pktbuf_pool_destroy(&pool);
+}
+
+/**
+ * The receive loop used with a shared-memory transport. Datagrams are
+ * processed right in the slots of the ring, which go back to the upper layer
+ * once each is done with.
+ */
+static void
+recv_loop_shm(thread_opts_t *opts)
+{
+    struct ipop_shm_ring *ring = &opts->shm->rings[IPOP_SHM_DOWN];
+    unsigned char *data;
+    size_t len;
+
+    while (ipop_shm_wait(ring) == 0) {
+        while ((data = ipop_shm_peek(ring, &len)) != NULL) {
+            int stop = process_upper_frame(opts, data, len) < 0;
+            ipop_shm_release(ring);
+            peerlist_quiescent();
+            if (stop) return;
+        }
+    }
+}
+
+// frames each ring of the send pipeline holds, super-frames take 40 times the
+// memory so they get shorter rings
+#define PIPELINE_DEPTH 256
+#define PIPELINE_DEPTH_OFFLOAD 32
+
+// A datagram the classify stage passes on to the send stage.
+struct pipeline_msg {
+    struct pktbuf *pkt; // one reference is held for the message
+    char hdr[BUF_OFFSET]; // a copy, the peer may be replaced meanwhile
+    int hdr_len;
+    unsigned char *buf;
+    int len;
+    int direct; // sent to addr over UDP, rather than to the upper layer
+    struct sockaddr_in addr;
+};
+
+struct pipeline;
+
+// A classify stage and the send stage behind it. The read stage spreads the
+// frames over the lanes by flow, so every lane keeps the order of its flows.
+struct pipeline_lane {
+    struct pipeline *pipe;
+    struct spsc_ring classify_ring; // buffers from the read stage
+    struct spsc_ring send_ring; // datagrams from the classify stage
+    struct tx_batch *tx; // the send stage's, NULL when it sends one by one
+    int tx_frames; // most buffers the send stage holds on to
+    struct ipop_stage_stats stats[IPOP_STAGES]; // classify and send only
+    pthread_t classify_thread;
+    pthread_t send_thread;
+    int running; // both threads were started
+};
+
+// State of the send pipeline. The read stage fills buffers from the tap and
+// queues them for the classify stage of a lane, which does the ARP handling,
+// the peer lookup and the translation, and queues the resulting datagrams for
+// the send stage of the lane. Each stage runs in a thread of its own.
+struct pipeline {
+    thread_opts_t *opts;
+    struct pktbuf_pool pool;
+    struct ipop_stage_stats read_stats;
+    int stop;
+    int nlanes;
+    struct pipeline_lane lanes[IPOP_MAX_WORKERS];
+};
+
+/**
+ * The handoff function of the classify stage, queues a datagram for the send
+ * stage of the lane. A frame in a buffer of the pipeline gains a reference for
+ * the datagram, any other (a segment cut from a super-frame) is copied into a
+ * buffer of its own. Returns 0 on success, -1 if the datagram was dropped.
+ */
+static int
+pipeline_handoff(void *ctx, const void *hdr, size_t hdr_len,
+                 const unsigned char *buf, size_t len,
+                 const struct sockaddr_in *addr)
+{
+    struct pipeline_lane *lane = (struct pipeline_lane *) ctx;
+    struct pktbuf_pool *pool = &lane->pipe->pool;
+    struct pipeline_msg msg = {
+        .pkt = pktbuf_of(pool, buf),
+        .hdr_len = hdr_len,
+        .buf = (unsigned char *) buf,
+        .len = len,
+        .direct = (addr != NULL)
+    };
+
+    if (hdr_len > sizeof(msg.hdr)) return -1;
+    memcpy(msg.hdr, hdr, hdr_len);
+    if (addr != NULL) msg.addr = *addr;
+    if (msg.pkt != NULL) {
+        pktbuf_get(msg.pkt);
+    } else if (len <= (size_t) (pool->size - pool->headroom) &&
+               (msg.pkt = pktbuf_alloc(pool)) != NULL) {
+        memcpy(msg.pkt->data, buf, len);
+        msg.pkt->len = len;
+        msg.buf = msg.pkt->data;
+    } else {
+        stat_add(&lane->stats[IPOP_STAGE_CLASSIFY].drops, 1);
+        return -1;
+    }
+    if (spsc_ring_push(&lane->send_ring, &msg) < 0) {
+        pktbuf_put(msg.pkt);
+        stat_add(&lane->stats[IPOP_STAGE_CLASSIFY].drops, 1);
+        return -1;
+    }
+    stat_add(&lane->stats[IPOP_STAGE_CLASSIFY].frames, 1);
+    return 0;
+}
+
+/**
+ * The classify stage of a lane. It stops when the read stage does, or when a
+ * frame can not be processed, which stops the whole pipeline.
+ */
+static void *
+pipeline_classify(void *data)
+{
+    struct pipeline_lane *lane = (struct pipeline_lane *) data;
+    struct tx_batch *handoff = malloc(sizeof(struct tx_batch));
+    struct pktbuf *pkt;
+
+    peerlist_reader_add_ctx(ctx_of(lane->pipe->opts));
+    if (handoff == NULL ||
+        tx_batch_init_handoff(handoff, pipeline_handoff, lane) < 0) {
+        goto done;
+    }
+    while (spsc_ring_wait(&lane->classify_ring) == 0) {
+        while (spsc_ring_pop(&lane->classify_ring, &pkt) == 0) {
+            int result = process_tap_read(lane->pipe->opts, handoff,
+                                          pkt->data, pkt->len);
+            pktbuf_put(pkt);
+            peerlist_quiescent();
+            if (result < 0) goto done;
+        }
+    }
+
+done:
+    __atomic_store_n(&lane->pipe->stop, 1, __ATOMIC_RELEASE);
+    spsc_ring_close(&lane->send_ring);
+    free(handoff);
+    peerlist_reader_remove();
+    return NULL;
+}
+
+/**
+ * The send stage of a lane. Datagrams are batched as in send_loop_batched
+ * when the options allow it, and the batch leaves whenever the ring runs dry.
+ * The headers of the queued datagrams are kept in `hdrs` until it leaves.
+ */
+static void *
+pipeline_send(void *data)
+{
+    struct pipeline_lane *lane = (struct pipeline_lane *) data;
+    thread_opts_t *opts = lane->pipe->opts;
+    struct pktbuf *held[lane->tx_frames];
+    char hdrs[lane->tx_frames][BUF_OFFSET];
+    struct pipeline_msg msg;
+    int nheld = 0, nhdrs = 0;
+
+    while (spsc_ring_wait(&lane->send_ring) == 0) {
+        while (spsc_ring_pop(&lane->send_ring, &msg) == 0) {
+            const char *hdr = msg.hdr;
+            if (lane->tx != NULL) {
+                if (lane->tx->count == 0) {
+                    nhdrs = 0;
+                } else if (nhdrs >= lane->tx_frames) {
+                    tx_batch_flush(lane->tx);
+                    release_held(held, &nheld);
+                    nhdrs = 0;
+                }
+                hdr = memcpy(hdrs[nhdrs++], msg.hdr, msg.hdr_len);
+            }
+            if (msg.direct) {
+                send_datagram(opts, lane->tx, hdr, msg.hdr_len, msg.buf,
+                              msg.len, &msg.addr);
+            } else if (send_up(opts, lane->tx, hdr, msg.buf, msg.len) < 0) {
+                IPOP_LOG("send_func failed\n");
+            }
+            stat_add(&lane->stats[IPOP_STAGE_SEND].frames, 1);
+            if (lane->tx == NULL) {
+                pktbuf_put(msg.pkt);
+                continue;
+            }
+            hold_or_retire(lane->tx, NULL, held, &nheld, msg.pkt);
+            if (nheld >= lane->tx_frames) {
+                tx_batch_flush(lane->tx);
+                release_held(held, &nheld);
+            }
+        }
+        if (lane->tx != NULL) {
+            tx_batch_flush(lane->tx);
+            release_held(held, &nheld);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sets up the rings and the send batch of a lane with rings of `depth`
+ * entries. Returns 0 on success, -1 on failure.
+ */
+static int
+pipeline_lane_init(struct pipeline_lane *lane, struct pipeline *pipe,
+                   int depth)
+{
+    thread_opts_t *opts = pipe->opts;
+
+    lane->pipe = pipe;
+    lane->tx_frames = 1;
+    if (opts->send_batch_func != NULL || direct_batching(opts)) {
+        int size = opts->batch > 1 ? opts->batch : 1;
+        if ((lane->tx = malloc(sizeof(struct tx_batch))) == NULL) return -1;
+        int r = (opts->send_batch_func != NULL) ?
+            tx_batch_init_func(lane->tx, opts->send_batch_func,
+                               opts->batch > 1 ? size : IPOP_BATCH_MAX) :
+            tx_batch_init(lane->tx, opts->sock4, size, opts->udp_gso,
+                          opts->aggregate);
+        if (r < 0) return -1;
+        lane->tx_frames = lane->tx->size;
+        if (!opts->vnet_hdr) lane->tx_frames = tx_batch_frames(lane->tx);
+    }
+    if (spsc_ring_init(&lane->classify_ring, depth,
+                       sizeof(struct pktbuf *)) < 0 ||
+        spsc_ring_init(&lane->send_ring, depth,
+                       sizeof(struct pipeline_msg)) < 0) {
+        return -1;
+    }
+    lane->stats[IPOP_STAGE_CLASSIFY].capacity =
+        spsc_ring_capacity(&lane->classify_ring);
+    lane->stats[IPOP_STAGE_SEND].capacity =
+        spsc_ring_capacity(&lane->send_ring);
+    return 0;
+}
+
+/**
+ * Sets up the lanes and the buffers of the pipeline. Returns 0 on success, -1
+ * on failure.
+ */
+static int
+pipeline_init(struct pipeline *pipe, thread_opts_t *opts)
+{
+    int depth = opts->vnet_hdr ? PIPELINE_DEPTH_OFFLOAD : PIPELINE_DEPTH;
+    int count = 1; // the read stage's spare
+
+    pipe->opts = opts;
+    pipe->nlanes = opts->workers > 1 ? opts->workers : 1;
+    if (pipe->nlanes > IPOP_MAX_WORKERS) pipe->nlanes = IPOP_MAX_WORKERS;
+    for (int i = 0; i < pipe->nlanes; i++) {
+        struct pipeline_lane *lane = &pipe->lanes[i];
+        if (pipeline_lane_init(lane, pipe, depth) < 0) return -1;
+        // a buffer is either waiting in one of the rings or held by the send
+        // batch, plus one in the hands of each stage
+        count += spsc_ring_capacity(&lane->classify_ring) +
+                 spsc_ring_capacity(&lane->send_ring) + lane->tx_frames + 2;
+    }
+    if (pktbuf_pool_init(&pipe->pool, count, buffer_length(opts),
+                         buffer_headroom(opts)) < 0) {
+        return -1;
+    }
+    pipe->read_stats.capacity = pipe->pool.count;
+    return 0;
+}
+
+/**
+ * Stops the threads of the pipeline and frees it.
+ */
+static void
+pipeline_free(struct pipeline *pipe)
+{
+    struct pktbuf *pkt;
+
+    for (int i = 0; i < pipe->nlanes; i++) {
+        struct pipeline_lane *lane = &pipe->lanes[i];
+        if (lane->running) {
+            spsc_ring_close(&lane->classify_ring);
+            pthread_join(lane->classify_thread, NULL);
+            pthread_join(lane->send_thread, NULL);
+        }
+        // the classify stage may have stopped early and left frames behind
+        if (lane->classify_ring.slots != NULL) {
+            while (spsc_ring_pop(&lane->classify_ring, &pkt) == 0) {
+                pktbuf_put(pkt);
+            }
+        }
+        spsc_ring_free(&lane->classify_ring);
+        spsc_ring_free(&lane->send_ring);
+        free(lane->tx);
+    }
+    pktbuf_pool_destroy(&pipe->pool);
+    free(pipe);
+}
+
+/**
+ * Starts the classify and send threads of every lane. Returns 0 on success,
+ * -1 on failure.
+ */
+static int
+pipeline_start(struct pipeline *pipe)
+{
+    for (int i = 0; i < pipe->nlanes; i++) {
+        struct pipeline_lane *lane = &pipe->lanes[i];
+        if (placement_create_thread(&lane->classify_thread,
+                                    pipeline_classify, lane) != 0) {
+            return -1;
+        }
+        if (placement_create_thread(&lane->send_thread, pipeline_send,
+                                    lane) != 0) {
+            spsc_ring_close(&lane->classify_ring);
+            pthread_join(lane->classify_thread, NULL);
+            return -1;
+        }
+        lane->running = 1;
+    }
+    return 0;
+}
+
+/**
+ * Runs the send side as a pipeline, with the calling thread as the read
+ * stage. Frames are spread over the lanes by their flow hash. When the pool
+ * or the classify ring of the lane is full, a frame is still read, so the tap
+ * does not back up, but dropped and counted.
+ */
+static void
+send_pipeline(thread_opts_t *opts)
+{
+    struct pipeline *pipe = calloc(1, sizeof(struct pipeline));
+    struct ipop_stage_stats *stats;
+    struct pktbuf *spare;
+
+    if (pipe == NULL || pipeline_init(pipe, opts) < 0 ||
+        pipeline_start(pipe) < 0) {
+        fprintf(stderr, "could not set up the send pipeline\n");
+        if (pipe != NULL) pipeline_free(pipe);
+        return;
+    }
+    stats = &pipe->read_stats;
+    spare = pktbuf_alloc(&pipe->pool);
+    __atomic_store_n(&opts->pipeline_state, pipe, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE)) {
+        struct pktbuf *pkt = pktbuf_alloc(&pipe->pool);
+        unsigned char *buf = (pkt != NULL) ? pkt->data : spare->data;
+        int rcount = read_from_tap(opts, buf, frame_room(opts, spare));
+        if (rcount < 0) {
+            if (pkt != NULL) pktbuf_put(pkt);
+            if (errno == EINTR) continue;
+            // the receive thread made the tap non-blocking
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_readable(opts->tap, NULL) < 0) break;
+                continue;
+            }
+            fprintf(stderr, "tap read failed\n");
+            break;
+        }
+        if (pkt == NULL) {
+            stat_add(&stats->drops, 1);
+            continue;
+        }
+        pkt->len = rcount;
+
+        struct pipeline_lane *lane = &pipe->lanes[0];
+        if (pipe->nlanes > 1) {
+            uint32_t hash = opts->tun ?
+                flow_hash_ip(pkt->data, pkt->len) :
+                flow_hash(pkt->data, pkt->len, opts->switchmode);
+            lane += hash % pipe->nlanes;
+        }
+        if (spsc_ring_push(&lane->classify_ring, &pkt) < 0) {
+            pktbuf_put(pkt);
+            stat_add(&stats->drops, 1);
+            continue;
+        }
+        stat_add(&stats->frames, 1);
+    }
+
+    // pairs with ipop_pipeline_stats: either it sees NULL, or this sees it
+    // reading
+    __atomic_store_n(&opts->pipeline_state, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&opts->pipeline_readers, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    pktbuf_put(spare);
+    pipeline_free(pipe);
+}
+
+/**
+ * Copies the counters of the send pipeline started for `opts` to `stats`,
+ * which has room for IPOP_STAGES entries. The counters of the classify and
+ * send stages are summed over the lanes. The occupancy of the read stage is
+ * the number of buffers in use, that of the other stages the number of
+ * entries waiting in the rings in front of them. May be called from any
+ * thread at any time. Returns 0 on success, -1 if there is no pipeline.
+ */
+int
+ipop_pipeline_stats(struct thread_opts *opts, struct ipop_stage_stats *stats)
+{
+    // keeps the send thread from freeing the pipeline while it is read
+    __atomic_add_fetch(&opts->pipeline_readers, 1, __ATOMIC_SEQ_CST);
+    struct pipeline *pipe = __atomic_load_n(&opts->pipeline_state,
+                                            __ATOMIC_SEQ_CST);
+    if (pipe == NULL) {
+        __atomic_sub_fetch(&opts->pipeline_readers, 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    memset(stats, 0, IPOP_STAGES * sizeof(struct ipop_stage_stats));
+    stats[IPOP_STAGE_READ].frames =
+        __atomic_load_n(&pipe->read_stats.frames, __ATOMIC_RELAXED);
+    stats[IPOP_STAGE_READ].drops =
+        __atomic_load_n(&pipe->read_stats.drops, __ATOMIC_RELAXED);
+    stats[IPOP_STAGE_READ].occupancy = pipe->pool.count -
+        __atomic_load_n(&pipe->pool.available, __ATOMIC_RELAXED);
+    stats[IPOP_STAGE_READ].capacity = pipe->read_stats.capacity;
+
+    for (int i = 0; i < pipe->nlanes; i++) {
+        struct pipeline_lane *lane = &pipe->lanes[i];
+        for (int j = IPOP_STAGE_CLASSIFY; j < IPOP_STAGES; j++) {
+            stats[j].frames += __atomic_load_n(&lane->stats[j].frames,
+                                               __ATOMIC_RELAXED);
+            stats[j].drops += __atomic_load_n(&lane->stats[j].drops,
+                                              __ATOMIC_RELAXED);
+            stats[j].capacity += lane->stats[j].capacity;
+        }
+        stats[IPOP_STAGE_CLASSIFY].occupancy +=
+            spsc_ring_count(&lane->classify_ring);
+        stats[IPOP_STAGE_SEND].occupancy += spsc_ring_count(&lane->send_ring);
+    }
+    __atomic_sub_fetch(&opts->pipeline_readers, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
 
 /**
  * Reads packet data from the tap device that was locally written, and sends it
@@ -58,205 +2046,85 @@ ipop_send_thread(void *data)
     // thread_opts data structure is shared by both send and recv threads
     // so do not modify its contents only read
     thread_opts_t *opts = (thread_opts_t *) data;
-    int sock4 = opts->sock4;
-    int sock6 = opts->sock6;
-#if defined(LINUX) || defined(ANDROID)
-    int tap = opts->tap;
-#elif defined(WIN32)
-    windows_tap *win32_tap = opts->win32_tap;
-#endif
-
-    int rcount, ncount;
-
-    // ipop_buf will contain 40-byte header + ethernet frame
-    unsigned char ipop_buf[BUFLEN];
-
-    // BUF_OFFSET leaves 40-bytes for header
-    unsigned char *buf = ipop_buf + BUF_OFFSET ;
-    struct in_addr local_ipv4_addr;
-    struct in6_addr local_ipv6_addr;
-    struct peer_state *peer = NULL;
-    int result, is_ipv4;
 
-    while (1) {
+    int rcount;
 
-        int arp = 0;
+    // every buffer holds the 40-byte header + ethernet frame, the frame is
+    // read BUF_OFFSET bytes in to leave room for the header
+    struct pktbuf_pool pool;
+    struct pktbuf *pkt;
 
-#if defined(LINUX) || defined(ANDROID)
-        if ((rcount = read(tap, buf, BUFLEN-BUF_OFFSET)) < 0) {
-#elif defined(WIN32)
-        if ((rcount = read_tap(win32_tap, (char *)buf, BUFLEN-BUF_OFFSET)) < 0) {
+    // the peers looked up for a frame stay valid until peerlist_quiescent
+    peerlist_reader_add_ctx(ctx_of(opts));
+#if defined(LINUX)
+    if (opts->pipeline) {
+        send_pipeline(opts);
+        goto done;
+    }
+    // an upper layer that takes batches gets them as large as the tap allows
+    if (opts->send_batch_func != NULL) {
+        send_loop_batched(opts, opts->batch > 1 ? opts->batch
+                                                : IPOP_BATCH_MAX);
+        goto done;
+    }
+    // otherwise batching only applies when we talk to the peers ourselves
+    if (direct_batching(opts)) {
+        send_loop_batched(opts, opts->batch > 1 ? opts->batch : 1);
+        goto done;
+    }
 #endif
-            fprintf(stderr, "tap read failed\n");
-            break;
-        }
 
-        ncount = rcount + BUF_OFFSET;
-
-        /*---------------------------------------------------------------------
-        Switchmode
-        ---------------------------------------------------------------------*/
-        if (opts->switchmode) {
-
-            // Check whether target of ARP request message is tap itself
-            if (is_arp_req(buf) &&
-                is_my_ip4(buf, (const unsigned char *) opts->my_ip4)) {
-                create_arp_response_sw(buf, (unsigned char * ) opts->mac, 
-                                       (unsigned char *) opts->my_ip4);
-                // Write back ARP reply to tap device
-#if defined(LINUX) || defined(ANDROID)
-                int r = write(tap, buf, rcount);
-#elif defined(WIN32)
-                int r = write_tap(win32_tap, (char *)buf, rcount);
+#if defined(LINUX)
+    // the receive thread makes the tap non-blocking either way
+    if (make_nonblocking(opts->tap) < 0) {
+        fprintf(stderr, "could not make the tap non-blocking\n");
+        goto done;
+    }
 #endif
-                if (r < 0) {
-                    fprintf(stderr, "write to tap failed\n");
-                }
-            }
-
-            /* If the frame is broadcast message, it sends the frame to
-               every TinCan links as physical switch does */
-            if (is_nonunicast(buf)) {
-                reset_id_table();
-                while( !is_id_table_end() ) {
-                    if ( is_id_exist() )  {
-                        /* TODO It may be better to retrieve the iterator rather
-                           than key string itself.  */
-                        peer = retrieve_peer();
-                        set_headers(ipop_buf, peerlist_local.id, peer->id);
-                        if (opts->send_func != NULL) {
-                            if (opts->send_func((const char*)ipop_buf, ncount) < 0) {
-                                fprintf(stderr, "send_func failed\n");
-                            }
-                        }
-                    }
-                    increase_id_table_itr();
+    // each frame is done with before the next one is read, so one buffer does
+    if (pktbuf_pool_init(&pool, 1, buffer_length(opts),
+                         buffer_headroom(opts)) < 0) {
+        goto done;
+    }
+    while ((pkt = pktbuf_alloc(&pool)) != NULL) {
+        if ((rcount = read_from_tap(opts, pkt->data,
+                                    frame_room(opts, pkt))) < 0) {
+            pktbuf_put(pkt);
+#if defined(LINUX)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_busy(opts->tap, opts->busy_poll_usec,
+                              &opts->send_poll) < 0) {
+                    break;
                 }
                 continue;
             }
-
-            /* If the MAC address is in the table, we forward the frame to
-               destined TinCan link */
-            peerlist_get_by_mac_addr(buf, &peer);
-            set_headers(ipop_buf, peerlist_local.id, peer->id);
-            if (opts->send_func != NULL) {
-                if (opts->send_func((const char*)ipop_buf, ncount) < 0) {
-                    fprintf(stderr, "send_func failed\n");
-                }
-            }
-            continue;
-        }
-
-        /*---------------------------------------------------------------------
-        Conventional IPOP Tap (non-switchmode)
-        ---------------------------------------------------------------------*/
-
-        // checks to see if this is an ARP request, if so, send response
-        if (buf[12] == 0x08 && buf[13] == 0x06 && buf[21] == 0x01
-            && !opts->switchmode) {
-            if (create_arp_response(buf) == 0) {
-#if defined(LINUX) || defined(ANDROID)
-                int r = write(tap, buf, rcount);
-#elif defined(WIN32)
-                int r = write_tap(win32_tap, (char *)buf, rcount);
 #endif
-                // This doesn't handle partial writes yet, we need a loop to
-                // guarantee a full write.
-                if (r < 0) {
-                    fprintf(stderr, "tap write failed\n");
-                    break;
-                }
-            }
-            continue;
-        }
-
-
-        if ((buf[14] >> 4) == 0x04) { // ipv4 packet
-            memcpy(&local_ipv4_addr.s_addr, buf + 30, 4);
-            is_ipv4 = 1;
-        } else if ((buf[14] >> 4) == 0x06) { // ipv6 packet
-            memcpy(&local_ipv6_addr.s6_addr, buf + 38, 16);
-            is_ipv4 = 0;
-        } else if (buf[12] == 0x08 && buf[13] == 0x06 && opts->switchmode) {
-            arp = 1;
-            is_ipv4 = 0;
-        } else {
-            fprintf(stderr, "unknown IP packet type: 0x%x\n", buf[14] >> 4);
-            continue;
+            fprintf(stderr, "tap read failed\n");
+            break;
         }
+        pkt->len = rcount;
 
-        // we need to update the size of packet to account for ipop header
-        ncount = rcount + BUF_OFFSET;
-
-        // we need to initialize peerlist
-        peerlist_reset_iterators();
-        while (1) {
-            if (arp || is_ipv4) {
-                result = peerlist_get_by_local_ipv4_addr(&local_ipv4_addr,
-                                                         &peer);
-            } else {
-                result = peerlist_get_by_local_ipv6_addr(&local_ipv6_addr,
-                                                         &peer);
-            }
-
-            // -1 means something went wrong, should not happen
-            if (result == -1) break;
-
-            if (arp) {
-                // ARP message should not be forwarded to peers but to 
-                // controller only
-                set_headers(ipop_buf, peerlist_local.id, null_peer.id);
-            } else {
-                // we set ipop header by copying local peer uid as first
-                // 20-bytes and then dest peer uid as the next 20-bytes. That is
-                // necessary for routing by upper layers
-                set_headers(ipop_buf, peerlist_local.id, peer->id);
-            }
-
-            // we only translate if we have IPv4 packet and translate is on
-            if (!arp && is_ipv4 && opts->translate) {
-                translate_packet(buf, NULL, NULL, rcount);
-            }
-
-            // If the send_func function pointer is set then we use that to
-            // send packet to upper layers, in IPOP-Tincan this function just
-            // adds to a send blocking queue. If this is not set, then we
-            // send to the IP/port stored in the peerlist when the node was
-            // added to the network
-            if (opts->send_func != NULL) {
-                if (opts->send_func((const char*)ipop_buf, ncount) < 0) {
-                    fprintf(stderr, "send_func failed\n");
-                }
-            }
-            else {
-                // this is portion of the code allows ipop-tap nodes to
-                // communicate directly among themselves if necessary but
-                // there is no encryption provided with this approach
-                struct sockaddr_in dest_ipv4_addr_sock = {
-                    .sin_family = AF_INET,
-                    .sin_port = htons(peer->port),
-                    .sin_addr = peer->dest_ipv4_addr,
-                    .sin_zero = { 0 }
-                };
-                // send our processed packet off
-                if (sendto(sock4, (const char *)ipop_buf, ncount, 0,
-                           (struct sockaddr *)(&dest_ipv4_addr_sock),
-                           sizeof(struct sockaddr_in)) < 0) {
-                    fprintf(stderr, "sendto failed\n");
-                }
-            }
-            if (result == 0) break;
-        }
+        int result = process_tap_read(opts, NULL, pkt->data, pkt->len);
+        pktbuf_put(pkt);
+        peerlist_quiescent();
+        if (result < 0) break;
     }
+    pktbuf_pool_destroy(&pool);
 
-    close(sock4);
-    close(sock6);
+done:
+#if defined(LINUX)
+    if (opts->busy_poll_usec > 0) {
+        report_poll_stats("send", &opts->send_poll);
+    }
+#endif
 #if defined(LINUX) || defined(ANDROID)
-    tap_close();
+    // the receive thread of the queue closes its fd and sock4, main closes
+    // sock6 and the device
 #elif defined(WIN32)
     // TODO - Add close socket for tap
     WSACleanup();
 #endif
+    peerlist_reader_remove();
     pthread_exit(NULL);
     return NULL;
 }
@@ -272,173 +2140,602 @@ ipop_recv_thread(void *data)
     // so do not modify its contents only read
     thread_opts_t *opts = (thread_opts_t *) data;
     int sock4 = opts->sock4;
-    int sock6 = opts->sock6;
-#if defined(LINUX) || defined(ANDROID)
-    int tap = opts->tap;
-#elif defined(WIN32)
-    windows_tap *win32_tap = opts->win32_tap;
-#endif
 
     int rcount;
+    unsigned long truncated = 0;
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
 
-    // ipop_buf will contain 40-byte header + ethernet frame
-    unsigned char ipop_buf[BUFLEN];
+    // every buffer will contain 40-byte header + ethernet frame
+    struct pktbuf_pool pool;
+    struct pktbuf *pkt;
+    int buflen = buffer_length(opts);
+    int link_off = link_offset(opts);
 
-    // ipop_buf will contain 40-byte header + ethernet frame
-    unsigned char *buf = ipop_buf + BUF_OFFSET;
-    char source_id[ID_SIZE] = { 0 };
-    char dest_id[ID_SIZE] = { 0 };
-    struct peer_state *peer = NULL;
+    peerlist_reader_add_ctx(ctx_of(opts));
+#if defined(LINUX)
+    if (tap_backlog_init(opts) < 0) goto done;
+    if (opts->shm != NULL) {
+        recv_loop_shm(opts);
+        goto done;
+    }
+    if (opts->recv_batch_func != NULL) {
+        recv_loop_func(opts, opts->batch > 1 ? opts->batch : IPOP_BATCH_MAX);
+        goto done;
+    }
+    if (opts->recv_func == NULL && (opts->batch > 1 || opts->udp_gro)) {
+        recv_loop_batched(opts, opts->batch > 1 ? opts->batch : 1);
+        goto done;
+    }
+#endif
 
-    while (1) {
+#if defined(LINUX)
+    if (opts->recv_func == NULL && opts->busy_poll_usec > 0 &&
+        make_nonblocking(sock4) < 0) {
+        fprintf(stderr, "could not make the socket non-blocking\n");
+        goto done;
+    }
+#endif
+    if (pktbuf_pool_init(&pool, 1, buflen, BUF_OFFSET) < 0) goto done;
+    while ((pkt = pktbuf_alloc(&pool)) != NULL) {
+#if defined(LINUX)
+        if (opts->recv_func == NULL && tap_backlog_pending(opts) &&
+            wait_tap_backlog(opts, sock4) < 0) {
+            pktbuf_put(pkt);
+            break;
+        }
+#endif
         // if recv function pointer is set then use that to get packets
         // in IPOP-Tincan, this just reads from a recv blocking queue.
         // Otherwise, just read from the UDP socket
         if (opts->recv_func != NULL) {
             // read from ipop-tincan
-            if ((rcount = opts->recv_func((char *)ipop_buf, BUFLEN)) < 0) {
+            if ((rcount = opts->recv_func((char *)pkt->head, buflen)) < 0) {
               fprintf(stderr, "recv_func failed\n");
+              pktbuf_put(pkt);
               break;
             }
         }
-        else if ((rcount = recvfrom(sock4, (char *)ipop_buf, BUFLEN, 0,
-                               (struct sockaddr*) &addr, &addrlen)) < 0) {
+        else if ((rcount = recvfrom(sock4, (char *)pkt->head + link_off,
+                                    buflen - link_off, RECV_TRUNC,
+                                    (struct sockaddr*) &addr,
+                                    &addrlen)) < 0) {
             // read from UDP socket (useful for testing)
-            fprintf(stderr, "udp recv failed\n");
-            break;
-        }
-
-        /* ICC message use certain MAC address value (00-69-70-6f-70-0?) to
-           identify itself as ICC message. Generally, in this receiving thread,
-           we receive the message from TinCan link and put to tap device. But,
-           this ICC message need to go to the TinCan manager and then
-           controller.*/
-        if (is_icc(ipop_buf)) {
-            if (opts->send_func != NULL) {
-                /* Set destination and source uid field all NULL that tincan pass
-                   this message to the controller */
-                memset(ipop_buf+ID_SIZE, 0x00, ID_SIZE);
-                if (opts->send_func((const char*)ipop_buf, rcount)  < 0) {
-                   fprintf(stderr, "send_func failed\n");
+            pktbuf_put(pkt);
+#if defined(LINUX)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_busy(sock4, opts->busy_poll_usec,
+                              &opts->recv_poll) < 0) {
+                    break;
                 }
+                continue;
             }
+#endif
+            fprintf(stderr, "udp recv failed\n");
+            break;
+        } else if (rcount > buflen - link_off) {
+            // the real length came back, the tail of the datagram is lost
+            truncated++;
+            IPOP_LOG("dropped truncated datagram (%lu so far)\n", truncated);
+            pktbuf_put(pkt);
             continue;
+        } else {
+            rcount += link_off;
         }
+        pkt->len = rcount - BUF_OFFSET;
 
-        // update packet size to remove 40-byte header size, this is
-        // important to have correct size when writing packet to VNIC
-        rcount -= BUF_OFFSET;
+        int result = (opts->recv_func != NULL) ?
+            process_upper_frame(opts, pkt->head, rcount) :
+            process_link_frame(opts, pkt->head, rcount);
+        pktbuf_put(pkt);
+        peerlist_quiescent();
+        if (result < 0) break;
+    }
+    pktbuf_pool_destroy(&pool);
 
-        // read the 20-byte source and dest uids from the ipop header
-        get_headers(ipop_buf, source_id, dest_id);
+done:
+#if defined(LINUX)
+    if (opts->busy_poll_usec > 0) {
+        report_poll_stats("receive", &opts->recv_poll);
+    }
+    tap_backlog_free(opts);
+    report_tap_stats(&opts->tap_stats);
+#endif
+    // sock6 and the device are shared by all the queues, main closes them
+    close(sock4);
+#if defined(LINUX) || defined(ANDROID)
+    tap_close_queue_ctx(ctx_of(opts), opts->tap);
+#elif defined(WIN32)
+    // TODO - Add close for windows tap
+    WSACleanup();
+#endif
+    peerlist_reader_remove();
+    pthread_exit(NULL);
+    return NULL;
+}
 
-        // ARP request target the tap of myself. It create ARP reply and sends
-        // back the message back to the IPOP link it comes from.
-        if (is_arp_req(buf) && (opts->switchmode == 1) &&
-            is_my_ip4(buf, (const unsigned char *) opts->my_ip4)) {
+#if defined(LINUX)
+// frames or datagrams handled per readiness event before the event loop looks
+// at the other descriptors again
+#define EVENT_BUDGET 64
 
-            // Swaps source and destination UID (IPOP link identifier)
-            // so that the ARP reply message goes back to source
-            char temp[ID_SIZE];
-            memcpy(temp, ipop_buf, ID_SIZE);
-            memcpy(ipop_buf, ipop_buf+ID_SIZE, ID_SIZE);
-            memcpy(ipop_buf + ID_SIZE, temp, ID_SIZE);
+// State of the event loop, so that both directions can share one thread.
+struct event_loop {
+    thread_opts_t *opts;
+    int buflen;
+    // send side, frames read from the tap
+    struct tx_batch *tx; // NULL when datagrams are sent one by one
+    struct pktbuf_pool tx_pool;
+    // receive side, datagrams read from the sockets
+    struct rx_batch *rx; // NULL when datagrams are received one by one
+    struct pktbuf_pool rx_pool;
+    unsigned char *rx_bufs[IPOP_BATCH_MAX];
+    unsigned long truncated; // datagrams dropped for not fitting rx_bufs
+};
 
-            create_arp_response_sw(buf, (unsigned char *) opts->mac,
-                                   (unsigned char *) opts->my_ip4);
+/**
+ * Makes `fd` non-blocking and registers it with the epoll instance `epfd`.
+ */
+static int
+watch_fd(int epfd, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (make_nonblocking(fd) < 0) return -1;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-            if (opts->send_func != NULL) {
-                if (opts->send_func((const char*)ipop_buf,
-                    rcount + BUF_OFFSET) < 0) {
-                   fprintf(stderr, "send_func failed\n");
-                }
+/**
+ * Handles up to EVENT_BUDGET frames that are waiting on the tap. Batched
+ * datagrams leave before this returns. Returns -1 if the loop should stop, 0
+ * otherwise.
+ */
+static int
+drain_tap(struct event_loop *loop)
+{
+    thread_opts_t *opts = loop->opts;
+    struct pktbuf *held[loop->tx_pool.count];
+    int nheld = 0, result = 0;
+
+    for (int n = 0; n < EVENT_BUDGET; n++) {
+        struct pktbuf *pkt = pktbuf_alloc(&loop->tx_pool);
+        int rcount = read_from_tap(opts, pkt->data, frame_room(opts, pkt));
+        if (rcount < 0) {
+            pktbuf_put(pkt);
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
             }
-            // Do not need to go further
+            fprintf(stderr, "tap read failed\n");
+            result = -1;
+            break;
+        }
+        pkt->len = rcount;
+        if (process_tap_read(opts, loop->tx, pkt->data, pkt->len) < 0) {
+            pktbuf_put(pkt);
+            result = -1;
+            break;
+        }
+        if (loop->tx == NULL) {
+            pktbuf_put(pkt);
             continue;
         }
 
-        /* L2 broadcasting is forwarded from TinCan link. 
-           To make switchmode working, TinCan requires mac learning. Checking
-           all ethernet frame may be overkill. So it check only L2 broadcast
-           (for BOOTP/DHCP) and ARP for mac learning process.  */
-        if (ipop_buf[52] == 0x08 && ipop_buf[53] == 0x06 && 
-            (ipop_buf[61] == 0x02 || ipop_buf[61] == 0x01) && 
-            opts->switchmode == 1) {
-            /* ARP message is forwarded from TinCan links. Add the mac to the
-               table  */
-            arp_sha_mac_add((const unsigned char *) &ipop_buf);
-        }
-
-        if (ipop_buf[40] == 0xff && ipop_buf[41] == 0xff && 
-            ipop_buf[42] == 0xff && ipop_buf[43] == 0xff &&
-            ipop_buf[44] == 0xff && ipop_buf[45] == 0xff && 
-            opts->switchmode == 1) {
-            /* L2 Broadcast is forwarded from TinCan links. Add source mac to
-               the table  */
-            source_mac_add((const unsigned char *) &ipop_buf);
-        }
-
-        // perform translation if IPv4 and translate is enabled
-        if ((buf[14] >> 4) == 0x04 && opts->translate) {
-            int peer_found = peerlist_get_by_id(source_id, &peer);
-            // -1 indicates that no peer was found in the list so translation
-            // cannot be performed, it is important to keep in mind that the
-            // packet will get written to OS even if it is not translated
-            // this is necessary for multicast and broadcast packets.
-            // TODO - Do not allow untranslated packets to go to OS in svpn
-            if (peer_found != -1) {
-                // this call updates IP packet payload for MDNS and UPNP
-                translate_packet(buf, (char *)(&peer->local_ipv4_addr.s_addr),
-                               (char *)(&peerlist_local.local_ipv4_addr.s_addr),
-                               rcount);
-                // this call updates the IPv4 header with locally assign source
-                // and destination ip addresses obtained from the peerlist
-                translate_headers(buf, (char *)(&peer->local_ipv4_addr.s_addr),
-                               (char *)(&peerlist_local.local_ipv4_addr.s_addr),
-                               rcount);
+        // same buffer bookkeeping as send_loop_batched
+        hold_or_retire(loop->tx, NULL, held, &nheld, pkt);
+        if (nheld >= loop->tx_pool.count) {
+            tx_batch_flush(loop->tx);
+            release_held(held, &nheld);
+        }
+    }
+    if (loop->tx != NULL) tx_batch_flush(loop->tx);
+    release_held(held, &nheld);
+    return result;
+}
+
+/**
+ * Handles up to EVENT_BUDGET datagrams that are waiting on `sock`. Returns -1
+ * if the loop should stop, 0 otherwise.
+ */
+static int
+drain_socket(struct event_loop *loop, int sock)
+{
+    thread_opts_t *opts = loop->opts;
+
+    if (loop->rx != NULL && sock == loop->rx->sock) {
+        int count = rx_batch_recv(loop->rx);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            fprintf(stderr, "udp recv failed\n");
+            return -1;
+        }
+        return process_rx_batch(opts, loop->rx, count);
+    }
+
+    int link_off = link_offset(opts);
+    for (int n = 0; n < EVENT_BUDGET; n++) {
+        int rcount = recv(sock, loop->rx_bufs[0], loop->buflen - link_off,
+                          RECV_TRUNC);
+        if (rcount < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
             }
+            fprintf(stderr, "udp recv failed\n");
+            return -1;
+        }
+        if (rcount > loop->buflen - link_off) {
+            // the real length came back, the tail of the datagram is lost
+            loop->truncated++;
+            IPOP_LOG("dropped truncated datagram (%lu so far)\n",
+                     loop->truncated);
+            continue;
+        }
+        if (process_link_frame(opts, loop->rx_bufs[0] - link_off,
+                               rcount + link_off) < 0) {
+            return -1;
         }
+    }
+    return 0;
+}
+
+/**
+ * Sets up the buffers and batches of the event loop, following the same
+ * options as the send and receive threads. Returns 0 on success, -1 on
+ * failure.
+ */
+static int
+event_loop_init(struct event_loop *loop, thread_opts_t *opts)
+{
+    memset(loop, 0, sizeof(struct event_loop));
+    loop->opts = opts;
+    int link_off = link_offset(opts);
+    loop->buflen = buffer_length(opts);
+    if (opts->udp_gro && loop->buflen < RX_GRO_BUFLEN + link_off) {
+        loop->buflen = RX_GRO_BUFLEN + link_off;
+    }
+    int size = opts->batch > 1 ? opts->batch : 1;
+    if (size > IPOP_BATCH_MAX) size = IPOP_BATCH_MAX;
+
+    int tx_count = 1;
+    if (opts->send_batch_func != NULL || direct_batching(opts)) {
+        if ((loop->tx = malloc(sizeof(struct tx_batch))) == NULL) return -1;
+        int r = (opts->send_batch_func != NULL) ?
+            tx_batch_init_func(loop->tx, opts->send_batch_func,
+                               opts->batch > 1 ? size : IPOP_BATCH_MAX) :
+            tx_batch_init(loop->tx, opts->sock4, size, opts->udp_gso,
+                          opts->aggregate);
+        if (r < 0) return -1;
+        tx_count = loop->tx->size;
+        if (!opts->vnet_hdr) tx_count = tx_batch_frames(loop->tx);
+    }
+    if (pktbuf_pool_init(&loop->tx_pool, tx_count, buffer_length(opts),
+                         buffer_headroom(opts)) < 0) {
+        return -1;
+    }
+
+    // the receive buffers stay posted for as long as the loop runs
+    int rx_count = 1;
+    if (opts->batch > 1 || opts->udp_gro) {
+        if ((loop->rx = malloc(sizeof(struct rx_batch))) == NULL) return -1;
+        rx_count = size;
+    }
+    if (pktbuf_pool_init(&loop->rx_pool, rx_count, loop->buflen,
+                         BUF_OFFSET) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < rx_count; i++) {
+        loop->rx_bufs[i] = pktbuf_alloc(&loop->rx_pool)->head + link_off;
+    }
+    if (loop->rx != NULL &&
+        rx_batch_init(loop->rx, opts->sock4, loop->rx_bufs,
+                      loop->buflen - link_off, size, opts->udp_gro) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+event_loop_free(struct event_loop *loop)
+{
+    free(loop->tx);
+    pktbuf_pool_destroy(&loop->tx_pool);
+    free(loop->rx);
+    pktbuf_pool_destroy(&loop->rx_pool);
+}
+
+/**
+ * Handles both directions in a single thread: the tap and the sockets are
+ * multiplexed with epoll, and every frame or datagram is processed to
+ * completion as soon as it is read. Upper layers can still take the frames
+ * read from the tap, but datagrams always come from sock4 and sock6, since
+ * recv_func, recv_batch_func and the shared-memory transport would block the
+ * loop.
+ */
+void *
+ipop_event_thread(void *data)
+{
+    thread_opts_t *opts = (thread_opts_t *) data;
+    struct epoll_event events[3];
+    struct event_loop loop = { .opts = opts };
+    int epfd = -1;
+
+    if (opts->recv_func != NULL || opts->recv_batch_func != NULL ||
+        opts->shm != NULL) {
+        fprintf(stderr, "the event loop can not receive from the upper "
+                        "layer\n");
+        goto done;
+    }
+    peerlist_reader_add_ctx(ctx_of(opts));
+    if (event_loop_init(&loop, opts) < 0 || tap_backlog_init(opts) < 0) {
+        goto done;
+    }
+
+    if ((epfd = epoll_create1(0)) < 0 || watch_fd(epfd, opts->tap) < 0 ||
+        watch_fd(epfd, opts->sock4) < 0 ||
+        (opts->sock6 >= 0 && watch_fd(epfd, opts->sock6) < 0)) {
+        fprintf(stderr, "could not set up epoll\n");
+        goto done;
+    }
 
-        // it is important to make sure Eternet frame has the correct dest mac
-        // address for OS to accept the packet. Since ipop tap mac address is
-        // only known locally, this is a mandatory step
-        // When we need to broadcast arp request message it should be destined
-        // to every nodes in l2 network, so we do not update mac of destination.
-
-        // In switchmode, the destination mac address should be the mac address
-        // of final destination mac address but not the ipop mac address. Here, 
-        // if the source mac address (buf[6:12]) is the same with the
-        // destination  mac address (buf[0:6]), we regard this frame from the
-        // remote host. If it is different, we think this frame comes from the
-        // container. 
-        // More accurate implementation would be tap device
-        // keeping ARP table or query O/S whether certain mac address is in 
-        // network. 
-        if ( opts->switchmode == 0 ||
-             (memcmp(buf, buf+6, 6) == 0 && opts->switchmode == 1)) {
-            update_mac(buf, opts->mac);
+    while (1) {
+        // frames waiting for the tap are retried every TAP_RETRY_MSEC
+        int n = epoll_wait(epfd, events, 3,
+                           tap_backlog_pending(opts) ? TAP_RETRY_MSEC : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait failed\n");
+            break;
         }
-#if defined(LINUX) || defined(ANDROID)
-        if (write(tap, buf, rcount) < 0) {
-#elif defined(WIN32)
-        if (write_tap(win32_tap, (char *)buf, rcount) < 0) {
+        if (tap_backlog_pending(opts)) {
+            tap_backlog_flush(opts, opts->tap_backlog_state);
+        }
+        int result = 0;
+        for (int i = 0; i < n && result == 0; i++) {
+            if (events[i].data.fd == opts->tap) {
+                result = drain_tap(&loop);
+            } else {
+                result = drain_socket(&loop, events[i].data.fd);
+            }
+        }
+        peerlist_quiescent();
+        if (result < 0) break;
+    }
+
+done:
+    if (epfd >= 0) close(epfd);
+    event_loop_free(&loop);
+    tap_backlog_free(opts);
+    report_tap_stats(&opts->tap_stats);
+    close(opts->sock4);
+    tap_close_queue_ctx(ctx_of(opts), opts->tap);
+    peerlist_reader_remove();
+    pthread_exit(NULL);
+    return NULL;
+}
 #endif
-            fprintf(stderr, "write to tap error\n");
+
+#if defined(LINUX)
+// reads the io_uring engine keeps posted on the tap and on sock4 each, unless
+// the batch size asks for another number
+#define URING_DEPTH 32
+
+// what a completion belongs to, kept in the upper half of its user_data
+#define URING_TAP_READ 1ULL
+#define URING_SOCK_READ 2ULL
+
+// State of the io_uring engine. The first `depth` buffers are read into from
+// the tap, the others from sock4.
+struct uring_loop {
+    thread_opts_t *opts;
+    struct uring ring;
+    int depth;
+    int fixed; // the buffers are registered with the ring
+    int buflen;
+    // one buffer per posted read, taken from the pool for the life of the loop
+    struct pktbuf_pool pool;
+    struct pktbuf *pkts[2 * IPOP_BATCH_MAX];
+    // the receives posted on sock4, one per buffer
+    struct msghdr msgs[IPOP_BATCH_MAX];
+    struct iovec iovs[IPOP_BATCH_MAX];
+    unsigned long truncated; // datagrams dropped for not fitting a buffer
+    struct tx_batch *tx;
+};
+
+/**
+ * Queues a read into buffer `index` on the tap or on sock4, as `kind` says.
+ * Frames from the tap land BUF_OFFSET bytes into the buffer (with their
+ * virtio-net header in front, if any), datagrams at the start of it (or
+ * right where their compact header belongs, see link_offset). A plain read
+ * can not tell that a datagram did not fit, so sock4 gets a recvmsg with
+ * MSG_TRUNC, which completes with the full length of the datagram.
+ */
+static void
+post_read(struct uring_loop *loop, uint64_t kind, int index)
+{
+    thread_opts_t *opts = loop->opts;
+    unsigned char *buf = loop->pkts[index]->head;
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    int len = loop->buflen;
+
+    // the ring has room for every buffer, so this can not fail
+    sqe->user_data = (kind << 32) | (uint32_t) index;
+    if (kind == URING_SOCK_READ) {
+        struct msghdr *msg = &loop->msgs[index - loop->depth];
+        struct iovec *iov = &loop->iovs[index - loop->depth];
+        iov->iov_base = buf + link_offset(opts);
+        iov->iov_len = len - link_offset(opts);
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_iov = iov;
+        msg->msg_iovlen = 1;
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = opts->sock4;
+        sqe->addr = (uint64_t) (uintptr_t) msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_TRUNC;
+        return;
+    }
+
+    int vnet_len = opts->vnet_hdr ? VNET_HDR_LEN : 0;
+    buf += buffer_headroom(opts) - vnet_len;
+    len -= buffer_headroom(opts) + trailer_length(opts) + opts->tailroom -
+           vnet_len;
+    sqe->opcode = loop->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = opts->tap;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = (uint64_t) -1; // current position, the only one a stream has
+    sqe->buf_index = loop->fixed ? index : 0;
+}
+
+/**
+ * Sets up the ring and the buffers of the io_uring engine. Returns 0 on
+ * success, -1 on failure.
+ */
+static int
+uring_loop_init(struct uring_loop *loop, thread_opts_t *opts)
+{
+    loop->opts = opts;
+    loop->depth = opts->batch > 1 ? opts->batch : URING_DEPTH;
+    // the buffers and completions are tracked in arrays of this size
+    if (loop->depth > IPOP_BATCH_MAX) loop->depth = IPOP_BATCH_MAX;
+    loop->buflen = buffer_length(opts);
+
+    if (uring_init(&loop->ring, 2 * loop->depth) < 0) return -1;
+    if (pktbuf_pool_init(&loop->pool, 2 * loop->depth, loop->buflen,
+                         BUF_OFFSET) < 0) {
+        return -1;
+    }
+
+    struct iovec iovs[2 * IPOP_BATCH_MAX];
+    for (int i = 0; i < 2 * loop->depth; i++) {
+        loop->pkts[i] = pktbuf_alloc(&loop->pool);
+        iovs[i].iov_base = loop->pkts[i]->head;
+        iovs[i].iov_len = loop->buflen;
+    }
+    if (uring_register_buffers(&loop->ring, iovs, 2 * loop->depth) == 0) {
+        loop->fixed = 1;
+    } else {
+        // likely RLIMIT_MEMLOCK, plain reads work all the same
+        fprintf(stderr, "could not register ring buffers, using plain "
+                        "reads\n");
+    }
+
+    // datagrams are gathered for one sendmmsg (or send_batch_func) call per
+    // round of completions
+    if (opts->send_batch_func != NULL || !has_upper_layer(opts)) {
+        if ((loop->tx = malloc(sizeof(struct tx_batch))) == NULL) return -1;
+        int size = loop->depth > IPOP_BATCH_MAX ? IPOP_BATCH_MAX : loop->depth;
+        int r = (opts->send_batch_func != NULL) ?
+            tx_batch_init_func(loop->tx, opts->send_batch_func, size) :
+            tx_batch_init(loop->tx, opts->sock4, size, opts->udp_gso,
+                          opts->aggregate);
+        if (r < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Handles one completion. Returns -1 if the engine should stop, 0 otherwise.
+ */
+static int
+uring_complete(struct uring_loop *loop, uint64_t kind, int index, int res)
+{
+    thread_opts_t *opts = loop->opts;
+    unsigned char *buf = loop->pkts[index]->head;
+
+    if (res == -EINTR || res == -EAGAIN) return 0;
+    if (kind == URING_TAP_READ) {
+        if (res < 0) {
+            fprintf(stderr, "tap read failed\n");
+            return -1;
+        }
+        if (opts->vnet_hdr) res = res < VNET_HDR_LEN ? 0 : res - VNET_HDR_LEN;
+        return process_tap_read(opts, loop->tx, buf + buffer_headroom(opts),
+                                res);
+    }
+    if (res < 0) {
+        fprintf(stderr, "udp recv failed\n");
+        return -1;
+    }
+    if (res > (int) loop->iovs[index - loop->depth].iov_len) {
+        // the real length came back, the tail of the datagram is lost
+        loop->truncated++;
+        IPOP_LOG("dropped truncated datagram (%lu so far)\n", loop->truncated);
+        return 0;
+    }
+    return process_link_frame(opts, buf, res + link_offset(opts));
+}
+
+/**
+ * Handles both directions in a single thread with io_uring. A number of reads
+ * are kept posted on the tap and on sock4 at all times, those on the tap into
+ * buffers that are registered with the kernel. Completions are reaped in
+ * rounds, the datagrams a round produces leave with one batched send, and then
+ * the buffers are posted again, so a round costs a single io_uring_enter call
+ * plus the send. Like the event loop, this does not use recv_func,
+ * recv_batch_func or the shared-memory transport to receive, and UDP_GRO is
+ * not used since the receives do not ask for segment sizes. The tap stays
+ * blocking, since reads of a non-blocking file complete with EAGAIN rather
+ * than wait, so frames from the peers have no backlog here.
+ */
+void *
+ipop_uring_thread(void *data)
+{
+    thread_opts_t *opts = (thread_opts_t *) data;
+    struct uring_loop loop = { .opts = opts, .ring = { .fd = -1 } };
+    int reaped[2 * IPOP_BATCH_MAX];
+    uint64_t kinds[2 * IPOP_BATCH_MAX];
+
+    if (opts->recv_func != NULL || opts->recv_batch_func != NULL ||
+        opts->shm != NULL) {
+        fprintf(stderr, "the io_uring engine can not receive from the upper "
+                        "layer\n");
+        goto done;
+    }
+    peerlist_reader_add_ctx(ctx_of(opts));
+    if (uring_loop_init(&loop, opts) < 0) goto done;
+
+    for (int i = 0; i < loop.depth; i++) {
+        post_read(&loop, URING_TAP_READ, i);
+        post_read(&loop, URING_SOCK_READ, loop.depth + i);
+    }
+
+    while (1) {
+        if (uring_submit_and_wait(&loop.ring, 1) < 0) {
+            fprintf(stderr, "io_uring_enter failed\n");
             break;
         }
+
+        struct io_uring_cqe *cqe;
+        int count = 0, stop = 0;
+        while ((cqe = uring_peek_cqe(&loop.ring)) != NULL) {
+            kinds[count] = cqe->user_data >> 32;
+            reaped[count] = (int) (uint32_t) cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&loop.ring);
+            if (!stop && uring_complete(&loop, kinds[count], reaped[count],
+                                        res) < 0) {
+                stop = 1;
+            }
+            count++;
+        }
+        if (loop.tx != NULL) tx_batch_flush(loop.tx);
+        peerlist_quiescent();
+        if (stop) break;
+
+        // the buffers are free again once the batch left
+        for (int i = 0; i < count; i++) {
+            post_read(&loop, kinds[i], reaped[i]);
+        }
     }
 
-    close(sock4);
-    close(sock6);
-#if defined(LINUX) || defined(ANDROID)
-    tap_close();
-#elif defined(WIN32)
-    // TODO - Add close for windows tap
-    WSACleanup();
-#endif
+done:
+    uring_free(&loop.ring);
+    pktbuf_pool_destroy(&loop.pool);
+    free(loop.tx);
+    report_tap_stats(&opts->tap_stats);
+    close(opts->sock4);
+    tap_close_queue_ctx(ctx_of(opts), opts->tap);
+    peerlist_reader_remove();
     pthread_exit(NULL);
     return NULL;
 }
-
+#endif
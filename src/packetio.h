@@ -37,6 +37,37 @@ extern "C" {
 #if defined(LINUX) || defined(ANDROID)
 void *ipop_send_thread(void *data);
 void *ipop_recv_thread(void *data);
+#if defined(LINUX)
+void *ipop_event_thread(void *data);
+void *ipop_uring_thread(void *data);
+
+// stages of the send pipeline, see thread_opts_t.pipeline
+enum {
+    IPOP_STAGE_READ, // reads frames from the tap
+    IPOP_STAGE_CLASSIFY, // ARP handling, peer lookup and translation
+    IPOP_STAGE_SEND, // hands datagrams to the sockets or the upper layer
+    IPOP_STAGES
+};
+
+// Counters of one stage of the send pipeline.
+struct ipop_stage_stats {
+    unsigned long long frames; // frames or datagrams the stage passed on
+    unsigned long long drops; // dropped since the next ring or the pool was full
+    unsigned int occupancy; // entries waiting for the stage
+    unsigned int capacity; // most entries that can wait for the stage
+};
+
+struct thread_opts;
+struct ipop_poll_stats;
+struct ipop_tap_stats;
+int ipop_pipeline_stats(struct thread_opts *opts,
+                        struct ipop_stage_stats *stats);
+void ipop_poll_stats(const struct thread_opts *opts,
+                     struct ipop_poll_stats *send,
+                     struct ipop_poll_stats *recv);
+void ipop_tap_stats(const struct thread_opts *opts,
+                    struct ipop_tap_stats *stats);
+#endif
 #elif defined(WIN32)
 WIN32_EXPORT void* ipop_send_thread(void *data);
 WIN32_EXPORT void* ipop_recv_thread(void *data);
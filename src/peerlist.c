@@ -30,55 +30,198 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #if defined(LINUX) || defined(ANDROID)
 #include <sys/socket.h>
 #include <netinet/in.h>
 #endif
 
+#include "ipop_ctx.h"
+#include "ipop_log.h"
 #include "peerlist.h"
 
 #include "../lib/klib/khash.h"
 
-static pthread_mutex_t id_tbl_lck = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t mac_tbl_lck = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t ip4_tbl_lck = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t ip6_tbl_lck = PTHREAD_MUTEX_INITIALIZER;
+// The peers are found by their id, their virtual IPv4 address and their
+// virtual IPv6 address as they are, without turning them into strings first.
+// Their words are mixed with the finalizer of MurmurHash3, so that addresses
+// that only differ in their last byte spread over the table.
+typedef struct { char id[ID_SIZE]; } id_key_t;
 
-KHASH_MAP_INIT_STR(pmap, struct peer_state*)
+static inline uint64_t
+mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t
+load64(const void *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline khint_t
+id_hash(id_key_t key)
+{
+    uint32_t tail;
+    memcpy(&tail, key.id + 16, sizeof(tail));
+    return (khint_t) mix64(load64(key.id) ^ mix64(load64(key.id + 8) ^ tail));
+}
+
+static inline khint_t
+ipv6_hash(struct in6_addr addr)
+{
+    return (khint_t) mix64(load64(addr.s6_addr) ^
+                           mix64(load64(addr.s6_addr + 8)));
+}
+
+#define id_equal(a, b) (memcmp((a).id, (b).id, ID_SIZE) == 0)
+#define ipv4_hash(addr) ((khint_t) mix64(addr))
+#define ipv6_equal(a, b) (memcmp((a).s6_addr, (b).s6_addr, 16) == 0)
+
+KHASH_INIT(idmap, id_key_t, struct peer_state*, 1, id_hash, id_equal)
+KHASH_INIT(ip4map, uint32_t, struct peer_state*, 1, ipv4_hash,
+           kh_int_hash_equal)
+KHASH_INIT(ip6map, struct in6_addr, struct peer_state*, 1, ipv6_hash,
+           ipv6_equal)
 /* KHASH only use a integer or string as a key
    We convert 48bit MAC address to 64bit integer as a key */
 KHASH_MAP_INIT_INT64(64, struct peer_state*)
 
-static khash_t(pmap) *id_table;
-static khash_t(pmap) *ipv4_addr_table;
-static khash_t(pmap) *ipv6_addr_table;
-static khash_t(64) *mac_table;
-static khint_t id_iterator;
-static khint_t ipv4_iterator;
-static khint_t ipv6_iterator;
-
-//static char local_id[ID_SIZE]; // +1 for \0
-static struct in_addr local_ipv4_addr; // Our virtual IPv4 address
-static struct in6_addr local_ipv6_addr; // Our virtual IPv6 address
-// With IPv4 addresses, each peer is assigned sequentially, as to prevent
-// collisions. This causes some disparity between how we see the peer, and how
-// the peer sees itself, but that can (usually) be solved with some translation.
-// With IPv6 addresses, each peer gets a (typically random) address that is not
-// sequential. We get informed by the user when that peer is added what the IPv6
-// address is. Since the address space is so large, we can just assume there
-// will be no collisions, and thus there will be no disparity or translation!
-static struct in_addr base_ipv4_addr; // iterated when adding a peer, is
-                                      // assigned to peer
-
-
-// Stores the local subnet mask 
-static struct in_addr subnet_mask = { .s_addr = ~(0u) };
-
-// Stores the subnet mask for router mode
-static struct in_addr router_subnet_mask = { .s_addr = ~(0u) };
+// most packet threads that can register with a peerlist, more turn the
+// reclaiming of replaced peers off
+#define PEERLIST_MAX_READERS 64
+#define READER_OFFLINE (~0UL)
+
+// A packet thread that looks up peers and uses them until its next quiescent
+// point, see peerlist_reader_add_ctx. Each takes a cache line of its own.
+struct peerlist_reader {
+    // the grace count when the thread last went online, READER_OFFLINE while
+    // it holds no peer
+    unsigned long seen;
+    struct peerlist *pl; // NULL while the slot is free
+    char pad[64 - sizeof(unsigned long) - sizeof(struct peerlist *)];
+};
+
+// The peers of one context (see struct ipop_ctx) and what we know about
+// ourselves in it.
+struct peerlist {
+    pthread_mutex_t id_tbl_lck;
+    pthread_mutex_t mac_tbl_lck;
+    pthread_mutex_t ip4_tbl_lck;
+    pthread_mutex_t ip6_tbl_lck;
+    // cleared by peerlist_set_locking when a single thread owns the peerlist
+    int locking;
+
+    khash_t(idmap) *id_table;
+    khash_t(ip4map) *ipv4_addr_table; // by s_addr, in network byte order
+    khash_t(ip6map) *ipv6_addr_table;
+    khash_t(64) *mac_table;
+
+    //char local_id[ID_SIZE]; // +1 for \0
+    struct in_addr local_ipv4_addr; // Our virtual IPv4 address
+    struct in6_addr local_ipv6_addr; // Our virtual IPv6 address
+    // With IPv4 addresses, each peer is assigned sequentially, as to prevent
+    // collisions. This causes some disparity between how we see the peer, and
+    // how the peer sees itself, but that can (usually) be solved with some
+    // translation. With IPv6 addresses, each peer gets a (typically random)
+    // address that is not sequential. We get informed by the user when that
+    // peer is added what the IPv6 address is. Since the address space is so
+    // large, we can just assume there will be no collisions, and thus there
+    // will be no disparity or translation!
+    struct in_addr base_ipv4_addr; // iterated when adding a peer, is
+                                   // assigned to peer
+
+    // Stores the local subnet mask
+    struct in_addr subnet_mask;
+
+    // Stores the subnet mask for router mode
+    struct in_addr router_subnet_mask;
+
+    // the local peer, and the peer for frames that have no other, these are
+    // peerlist_local and null_peer in the default context
+    struct peer_state *local;
+    struct peer_state *null;
+    // peers replaced by put_id, the packet threads may still point at them,
+    // so each is freed once every reader passed a quiescent point after it
+    // was retired, see reclaim_peers
+    struct peer_state *retired;
+    unsigned long grace; // bumped for every retired peer
+    int reclaim_off; // a thread could not register, keep retired peers
+    struct peerlist_reader readers[PEERLIST_MAX_READERS];
+    struct peer_state local_peer;
+    struct peer_state null_peer;
+
+    // the peers by the index they are given for compact link headers, an
+    // index stays with the id it was given to, and the receive path reads
+    // them without taking a lock
+    struct peer_state *index_table[PEERLIST_MAX_INDEX];
+    int next_index;
+    int epoch; // tells our indexes from those before a restart
+};
+
+static inline void
+table_lock(const struct peerlist *pl, pthread_mutex_t *lck)
+{
+    if (pl->locking) pthread_mutex_lock(lck);
+}
+
+static inline void
+table_unlock(const struct peerlist *pl, pthread_mutex_t *lck)
+{
+    if (pl->locking) pthread_mutex_unlock(lck);
+}
+
+// The iterators are per thread, so that several packet workers can walk the
+// tables for multicast and broadcast frames at the same time. A thread walks
+// the tables of one context at a time.
+static __thread khint_t id_iterator;
+static __thread khint_t ipv4_iterator;
+static __thread khint_t ipv6_iterator;
+static __thread char id_hex[2 * ID_SIZE + 1]; // handed out by retrieve_id
+static __thread struct peerlist_reader *this_reader;
+
+/**
+ * Marks the calling thread as one that holds peers of `pl` from now until its
+ * next quiescent point, if it is a registered reader. Called by every lookup.
+ */
+static inline void
+reader_online(struct peerlist *pl)
+{
+    struct peerlist_reader *r = this_reader;
+    if (r == NULL || r->pl != pl ||
+        __atomic_load_n(&r->seen, __ATOMIC_RELAXED) != READER_OFFLINE) {
+        return;
+    }
+    // pairs with the fence in reclaim_peers: either that sees this thread
+    // online, or this thread's lookups miss the peers retired before
+    __atomic_store_n(&r->seen, __atomic_load_n(&pl->grace, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
 struct peer_state null_peer = { .id = {0} };
 struct peer_state peerlist_local; // used to publicly expose the local peer info
+int peerlist_epoch = 0;
+
+struct peerlist peerlist_default = {
+    .id_tbl_lck = PTHREAD_MUTEX_INITIALIZER,
+    .mac_tbl_lck = PTHREAD_MUTEX_INITIALIZER,
+    .ip4_tbl_lck = PTHREAD_MUTEX_INITIALIZER,
+    .ip6_tbl_lck = PTHREAD_MUTEX_INITIALIZER,
+    .locking = 1,
+    .subnet_mask = { .s_addr = ~(0u) },
+    .router_subnet_mask = { .s_addr = ~(0u) },
+    .local = &peerlist_local,
+    .null = &null_peer,
+};
 
 static int
 convert_to_hex_string(const char *source, int source_len,
@@ -96,42 +239,250 @@ convert_to_hex_string(const char *source, int source_len,
     return 0;
 }
 
+/**
+ * Fills in the ipop header that precedes every frame sent to `peer`, the local
+ * id followed by the id of the peer, so the send path can hand it out as is.
+ */
+static inline void
+build_header(struct peerlist *pl, struct peer_state *peer)
+{
+    memcpy(peer->hdr, pl->local->id, ID_SIZE);
+    memcpy(peer->hdr + ID_SIZE, peer->id, ID_SIZE);
+}
+
+/**
+ * Gives `peer` an index for compact link headers, the one of `old` if it
+ * replaces a peer with the same id, and builds its HELLO headers, which carry
+ * the index.
+ */
+static void
+assign_index(struct peerlist *pl, struct peer_state *peer,
+             const struct peer_state *old)
+{
+    if (old != NULL) {
+        peer->index = old->index;
+    } else if (pl->next_index < PEERLIST_MAX_INDEX) {
+        peer->index = pl->next_index++;
+    } else {
+        fprintf(stderr, "Out of peer indexes, compact link headers from new "
+                        "peers are dropped.\n");
+        peer->index = PEERLIST_MAX_INDEX;
+    }
+    for (int ask = 0; ask < 2; ask++) {
+        unsigned char *hello = (unsigned char *) peer->hello_hdr[ask];
+        set_compact_header(hello, COMPACT_F_HELLO | (ask ? COMPACT_F_ASK : 0),
+                           pl->epoch, peer->index);
+        memcpy(hello + COMPACT_HDR_LEN, pl->local->id, ID_SIZE);
+    }
+    peer->compact_hdr = 0;
+    peer->hello_sent = 0;
+    if (peer->index < PEERLIST_MAX_INDEX) {
+        __atomic_store_n(&pl->index_table[peer->index], peer, __ATOMIC_RELEASE);
+    }
+}
+
 /**
  * To ensure each client gets a unique local (virtual) ipv4 address, we keep a
  * counter, and increment it, giving each client a sequentially assigned
  * address.
  */
 static inline void
-increment_base_ipv4_addr()
+increment_base_ipv4_addr(struct peerlist *pl)
 {
-    unsigned char *ip = (unsigned char *)&base_ipv4_addr.s_addr;
+    unsigned char *ip = (unsigned char *)&pl->base_ipv4_addr.s_addr;
     ip[3]++;
 }
 
 /**
+ * Picks the epoch of a new peerlist. It has to differ from the one before a
+ * restart, so it comes from the system's entropy rather than rand(), which
+ * embedders may never seed.
+ */
+static int
+new_epoch()
+{
+    unsigned int r = 0;
+#if defined(LINUX) || defined(ANDROID)
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f != NULL) {
+        size_t n = fread(&r, sizeof(r), 1, f);
+        fclose(f);
+        if (n == 1) return r & COMPACT_FIELD_MASK;
+    }
+#endif
+    r = (unsigned int) rand() ^ (unsigned int) time(NULL) ^
+        (unsigned int) clock();
+    return r & COMPACT_FIELD_MASK;
+}
+
+/**
+ * Sets up the tables of the peerlist of `ctx`, unless that happened already.
  * Returns 0 on success, -1 on failure.
  */
 int
-peerlist_init()
+peerlist_init_ctx(struct ipop_ctx *ctx)
 {
+    struct peerlist *pl = ctx->peers;
+    if (pl->id_table != NULL) return 0;
 	// init hash table
-    id_table = kh_init(pmap);
-    ipv4_addr_table = kh_init(pmap);
-    ipv6_addr_table = kh_init(pmap);
-    mac_table = kh_init(64);
+    pl->id_table = kh_init(idmap);
+    pl->ipv4_addr_table = kh_init(ip4map);
+    pl->ipv6_addr_table = kh_init(ip6map);
+    pl->mac_table = kh_init(64);
+    pl->epoch = new_epoch();
     return 0;
 }
 
+/**
+ * Allocates the peerlist of a context made by ipop_ctx_new, with its tables
+ * set up. Returns NULL on failure.
+ */
+struct peerlist *
+peerlist_new()
+{
+    struct peerlist *pl = calloc(1, sizeof(struct peerlist));
+    if (pl == NULL) {
+        fprintf(stderr, "Not enough memory to allocate peerlist.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&pl->id_tbl_lck, NULL);
+    pthread_mutex_init(&pl->mac_tbl_lck, NULL);
+    pthread_mutex_init(&pl->ip4_tbl_lck, NULL);
+    pthread_mutex_init(&pl->ip6_tbl_lck, NULL);
+    pl->locking = 1;
+    pl->subnet_mask.s_addr = ~(0u);
+    pl->router_subnet_mask.s_addr = ~(0u);
+    pl->local = &pl->local_peer;
+    pl->null = &pl->null_peer;
+    struct ipop_ctx ctx = { .peers = pl };
+    peerlist_init_ctx(&ctx);
+    return pl;
+}
+
+/**
+ * Frees a peerlist made by peerlist_new, with all of its peers. Its readers
+ * must have stopped.
+ */
+void
+peerlist_free(struct peerlist *pl)
+{
+    for (khint_t k = kh_begin(pl->id_table); k != kh_end(pl->id_table); ++k) {
+        if (kh_exist(pl->id_table, k)) free(kh_value(pl->id_table, k));
+    }
+    while (pl->retired != NULL) {
+        struct peer_state *next = pl->retired->retired_next;
+        free(pl->retired);
+        pl->retired = next;
+    }
+    kh_destroy(idmap, pl->id_table);
+    kh_destroy(ip4map, pl->ipv4_addr_table);
+    kh_destroy(ip6map, pl->ipv6_addr_table);
+    kh_destroy(64, pl->mac_table);
+    pthread_mutex_destroy(&pl->id_tbl_lck);
+    pthread_mutex_destroy(&pl->mac_tbl_lck);
+    pthread_mutex_destroy(&pl->ip4_tbl_lck);
+    pthread_mutex_destroy(&pl->ip6_tbl_lck);
+    free(pl);
+}
+
+/**
+ * Returns the local peer of `ctx`, see peerlist_set_local_ctx.
+ */
+struct peer_state *
+peerlist_local_ctx(struct ipop_ctx *ctx)
+{
+    return ctx->peers->local;
+}
+
+/**
+ * Returns the peer of `ctx` that stands for frames without a peer, such as
+ * those for the controller. Its ipop header carries our id and a zero id.
+ */
+struct peer_state *
+peerlist_null_ctx(struct ipop_ctx *ctx)
+{
+    return ctx->peers->null;
+}
+
+/**
+ * Turns the locks around the peer tables on or off. They may only be turned
+ * off when a single thread uses the peerlist, such as the epoll engine serving
+ * a single tap queue, and only before that thread starts.
+ */
+void
+peerlist_set_locking_ctx(struct ipop_ctx *ctx, int enabled)
+{
+    struct peerlist *pl = ctx->peers;
+    pl->locking = enabled;
+}
+
+/**
+ * Registers the calling thread as a reader of the peers of `ctx`: the peers it
+ * looks up stay valid until its next peerlist_quiescent, even when put_id
+ * replaces them. Returns 0 on success, -1 if there are too many readers, in
+ * which case replaced peers are kept until the peerlist is freed.
+ */
 int
-peerlist_reset_iterators()
+peerlist_reader_add_ctx(struct ipop_ctx *ctx)
+{
+    struct peerlist *pl = ctx->peers;
+	table_lock(pl, &pl->id_tbl_lck);
+    for (int i = 0; i < PEERLIST_MAX_READERS; i++) {
+        struct peerlist_reader *r = &pl->readers[i];
+        if (r->pl == NULL) {
+            r->seen = READER_OFFLINE;
+            __atomic_store_n(&r->pl, pl, __ATOMIC_RELEASE);
+            this_reader = r;
+			table_unlock(pl, &pl->id_tbl_lck);
+            return 0;
+        }
+    }
+    pl->reclaim_off = 1;
+	table_unlock(pl, &pl->id_tbl_lck);
+    fprintf(stderr, "Too many peerlist readers, keeping replaced peers.\n");
+    return -1;
+}
+
+/**
+ * Unregisters the calling thread, see peerlist_reader_add_ctx. It must not
+ * use the peers it looked up afterwards.
+ */
+void
+peerlist_reader_remove()
+{
+    struct peerlist_reader *r = this_reader;
+    if (r == NULL) return;
+    __atomic_store_n(&r->seen, READER_OFFLINE, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->pl, NULL, __ATOMIC_RELEASE);
+    this_reader = NULL;
+}
+
+/**
+ * Tells that the calling thread holds none of the peers it looked up, so the
+ * replaced ones may be freed. Packet threads call it between frames.
+ */
+void
+peerlist_quiescent()
+{
+    struct peerlist_reader *r = this_reader;
+    if (r == NULL ||
+        __atomic_load_n(&r->seen, __ATOMIC_RELAXED) == READER_OFFLINE) {
+        return;
+    }
+    __atomic_store_n(&r->seen, READER_OFFLINE, __ATOMIC_RELEASE);
+}
+
+int
+peerlist_reset_iterators_ctx(struct ipop_ctx *ctx)
 {
+    struct peerlist *pl = ctx->peers;
     // the klib library requires that we initialize the tables
-	pthread_mutex_lock(&ip4_tbl_lck);
-	pthread_mutex_lock(&ip6_tbl_lck);
-    ipv4_iterator = kh_begin(ipv4_addr_table);
-    ipv6_iterator = kh_begin(ipv6_addr_table);
-	pthread_mutex_unlock(&ip6_tbl_lck);	
-	pthread_mutex_unlock(&ip4_tbl_lck);
+	table_lock(pl, &pl->ip4_tbl_lck);
+	table_lock(pl, &pl->ip6_tbl_lck);
+    ipv4_iterator = kh_begin(pl->ipv4_addr_table);
+    ipv6_iterator = kh_begin(pl->ipv6_addr_table);
+	table_unlock(pl, &pl->ip6_tbl_lck);	
+	table_unlock(pl, &pl->ip4_tbl_lck);
     return 0;
 }
 
@@ -140,15 +491,16 @@ peerlist_reset_iterators()
  * identifier and a local IPv4/6 address pair.
  */
 int
-peerlist_set_local(const char *_local_id,
-                   const struct in_addr *_local_ipv4_addr,
-                   const struct in6_addr *_local_ipv6_addr)
+peerlist_set_local_ctx(struct ipop_ctx *ctx, const char *_local_id,
+                       const struct in_addr *_local_ipv4_addr,
+                       const struct in6_addr *_local_ipv6_addr)
 {
+    struct peerlist *pl = ctx->peers;
     //memcpy(local_id, _local_id, ID_SIZE);
-    memcpy(&local_ipv4_addr, _local_ipv4_addr, sizeof(struct in_addr));
-    memcpy(&base_ipv4_addr,  _local_ipv4_addr, sizeof(struct in_addr));
-    increment_base_ipv4_addr();
-    memcpy(&local_ipv6_addr, _local_ipv6_addr, sizeof(struct in6_addr));
+    memcpy(&pl->local_ipv4_addr, _local_ipv4_addr, sizeof(struct in_addr));
+    memcpy(&pl->base_ipv4_addr,  _local_ipv4_addr, sizeof(struct in_addr));
+    increment_base_ipv4_addr(pl);
+    memcpy(&pl->local_ipv6_addr, _local_ipv6_addr, sizeof(struct in6_addr));
     struct in_addr dest_ipv4_addr;
     char ip[] = "127.0.0.1";
 #if defined(LINUX) || defined(ANDROID)
@@ -164,11 +516,24 @@ peerlist_set_local(const char *_local_id,
     }
 
     // initialize the local peer struct
-    memcpy(peerlist_local.id, _local_id, ID_SIZE);
-    peerlist_local.local_ipv4_addr = local_ipv4_addr;
-    peerlist_local.local_ipv6_addr = local_ipv6_addr;
-    peerlist_local.dest_ipv4_addr = dest_ipv4_addr;
-    peerlist_local.port = 0;
+    memcpy(pl->local->id, _local_id, ID_SIZE);
+    pl->local->local_ipv4_addr = pl->local_ipv4_addr;
+    pl->local->local_ipv6_addr = pl->local_ipv6_addr;
+    pl->local->dest_ipv4_addr = dest_ipv4_addr;
+    pl->local->port = 0;
+
+    // the prebuilt headers carry our id, refresh those that already exist
+    build_header(pl, pl->null);
+    if (pl->id_table != NULL) {
+        table_lock(pl, &pl->id_tbl_lck);
+        for (khint_t k = kh_begin(pl->id_table); k != kh_end(pl->id_table);
+             ++k) {
+            if (kh_exist(pl->id_table, k)) {
+                build_header(pl, kh_value(pl->id_table, k));
+            }
+        }
+        table_unlock(pl, &pl->id_tbl_lck);
+    }
 
     return 0;
 }
@@ -178,8 +543,9 @@ peerlist_set_local(const char *_local_id,
  * identifier and a local IPv4/6 address pair. Addresses are given as strings.
  */
 int
-peerlist_set_local_p(const char *_local_id, const char *_local_ipv4_addr_p,
-                     const char *_local_ipv6_addr_p)
+peerlist_set_local_p_ctx(struct ipop_ctx *ctx, const char *_local_id,
+                         const char *_local_ipv4_addr_p,
+                         const char *_local_ipv6_addr_p)
 {
     struct in_addr local_ipv4_addr_n;
     struct in6_addr local_ipv6_addr_n;
@@ -206,8 +572,111 @@ peerlist_set_local_p(const char *_local_id, const char *_local_ipv4_addr_p,
         fprintf(stderr, "Bad IPv6 address format: %s\n", _local_ipv6_addr_p);
         return -1;
     }
-    return peerlist_set_local(_local_id, &local_ipv4_addr_n,
-                                         &local_ipv6_addr_n);
+    return peerlist_set_local_ctx(ctx, _local_id, &local_ipv4_addr_n,
+                                  &local_ipv6_addr_n);
+}
+
+/**
+ * Frees the retired peers that no reader can still hold, those retired before
+ * every online reader went online. Must be called with the id table locked.
+ */
+static void
+reclaim_peers(struct peerlist *pl)
+{
+    unsigned long oldest = READER_OFFLINE;
+    struct peer_state **link = &pl->retired;
+
+    if (pl->reclaim_off) return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < PEERLIST_MAX_READERS; i++) {
+        unsigned long seen = __atomic_load_n(&pl->readers[i].seen,
+                                             __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pl->readers[i].pl, __ATOMIC_RELAXED) != NULL &&
+            seen < oldest) {
+            oldest = seen;
+        }
+    }
+    while (*link != NULL) {
+        struct peer_state *old = *link;
+        if (old->retired_at <= oldest) {
+            *link = old->retired_next;
+            free(old);
+        } else {
+            link = &old->retired_next;
+        }
+    }
+}
+
+/**
+ * Drops the address entries of `old`, which `peer` replaces, points its MAC
+ * entries at `peer` and retires it.
+ */
+static void
+forget_peer(struct peerlist *pl, struct peer_state *old,
+            struct peer_state *peer)
+{
+    khint_t k;
+
+	table_lock(pl, &pl->ip4_tbl_lck);
+    k = kh_get(ip4map, pl->ipv4_addr_table, old->local_ipv4_addr.s_addr);
+    if (k != kh_end(pl->ipv4_addr_table) &&
+        kh_value(pl->ipv4_addr_table, k) == old) {
+        kh_del(ip4map, pl->ipv4_addr_table, k);
+    }
+	table_unlock(pl, &pl->ip4_tbl_lck);
+
+	table_lock(pl, &pl->ip6_tbl_lck);
+    k = kh_get(ip6map, pl->ipv6_addr_table, old->local_ipv6_addr);
+    if (k != kh_end(pl->ipv6_addr_table) &&
+        kh_value(pl->ipv6_addr_table, k) == old) {
+        kh_del(ip6map, pl->ipv6_addr_table, k);
+    }
+	table_unlock(pl, &pl->ip6_tbl_lck);
+
+	table_lock(pl, &pl->mac_tbl_lck);
+    for (k = kh_begin(pl->mac_table); k != kh_end(pl->mac_table); ++k) {
+        if (kh_exist(pl->mac_table, k) && kh_value(pl->mac_table, k) == old) {
+            kh_value(pl->mac_table, k) = peer;
+        }
+    }
+	table_unlock(pl, &pl->mac_tbl_lck);
+
+	table_lock(pl, &pl->id_tbl_lck);
+    // no lookup finds it any more, readers that go online from now on can
+    // not hold it
+    old->retired_at = __atomic_add_fetch(&pl->grace, 1, __ATOMIC_SEQ_CST);
+    old->retired_next = pl->retired;
+    pl->retired = old;
+    reclaim_peers(pl);
+	table_unlock(pl, &pl->id_tbl_lck);
+}
+
+/**
+ * Puts `peer` into the id table, in place of a peer with the same id, if
+ * there is one. Returns 0 on success, -1 on failure.
+ */
+static int
+put_id(struct peerlist *pl, struct peer_state *peer)
+{
+    struct peer_state *old = NULL;
+    id_key_t key;
+    int ret;
+
+    memcpy(key.id, peer->id, ID_SIZE);
+	table_lock(pl, &pl->id_tbl_lck);
+    khint_t k = kh_put(idmap, pl->id_table, key, &ret);
+    if (ret == -1) {
+        fprintf(stderr, "put failed for id_table.\n"); 
+		table_unlock(pl, &pl->id_tbl_lck); 
+        free(peer);
+		return -1;
+    }
+    if (!ret) old = kh_value(pl->id_table, k);
+    assign_index(pl, peer, old);
+    kh_value(pl->id_table, k) = peer;
+	table_unlock(pl, &pl->id_tbl_lck);
+    if (old != NULL) forget_peer(pl, old, peer);
+    return 0;
 }
 
 /**
@@ -222,133 +691,73 @@ peerlist_set_local_p(const char *_local_id, const char *_local_ipv4_addr_p,
  * port --      The port to communicate with the client peer over.
  */
 int
-peerlist_add(const char *id, const struct in_addr *dest_ipv4,
-             const struct in6_addr *dest_ipv6, const uint16_t port)
+peerlist_add_ctx(struct ipop_ctx *ctx, const char *id,
+                 const struct in_addr *dest_ipv4,
+                 const struct in6_addr *dest_ipv6, const uint16_t port)
 {
+    struct peerlist *pl = ctx->peers;
     // create and populate a peer structure
-    struct peer_state *peer = malloc(sizeof(struct peer_state));
+    struct peer_state *peer = calloc(1, sizeof(struct peer_state));
     if (peer == NULL) {
         fprintf(stderr, "Not enough memory to allocate peer.\n");
+        return -1;
     }
     memcpy(peer->id, id, ID_SIZE);
-    memcpy(&peer->local_ipv4_addr, &base_ipv4_addr, sizeof(struct in_addr));
+    build_header(pl, peer);
+    memcpy(&peer->local_ipv4_addr, &pl->base_ipv4_addr, sizeof(struct in_addr));
     memcpy(&peer->local_ipv6_addr, dest_ipv6, sizeof(struct in6_addr));
     memcpy(&peer->dest_ipv4_addr, dest_ipv4, sizeof(struct in_addr));
     peer->port = port;
 
-    // Allocate space for our keys:
-    // hsearch requires our keys to be null-terminated strings, so we convert
-    // in_addr and in6_addr values with inet_ntop first, but we need to allocate
-    // space for the keys.
-    const int ipv4_key_length = 4*4;
-    const int ipv6_key_length = 8*5;
-    const int id_key_length = ID_SIZE * 2 + 1;
-    char *ipv4_key = malloc(ipv4_key_length * sizeof(char));
-    char *ipv6_key = malloc(ipv6_key_length * sizeof(char));
-    char *id_key = malloc(id_key_length * sizeof(char));
-
     int ret;
     khint_t k;
 
-    // id_table
-    convert_to_hex_string(peer->id, ID_SIZE, id_key, id_key_length);
-	pthread_mutex_lock(&id_tbl_lck);
-    k = kh_put(pmap, id_table, id_key, &ret);
-    if (ret == -1) {
-        fprintf(stderr, "put failed for id_table.\n"); return -1;
-    }
-    else if (!ret) {
-        free(&kh_key(id_table, k));
-        free(kh_value(id_table, k));
-        kh_del(pmap, id_table, k);
-    }
-    kh_value(id_table, k) = peer;
-	pthread_mutex_unlock(&id_tbl_lck);
+    if (put_id(pl, peer) < 0) return -1;
     // Router mode support
-    peer->local_ipv4_addr.s_addr &= router_subnet_mask.s_addr;
+    peer->local_ipv4_addr.s_addr &= pl->router_subnet_mask.s_addr;
 
     // ipv4_addr_table
-#if defined(LINUX) || defined(ANDROID)
-    inet_ntop(AF_INET, &peer->local_ipv4_addr, ipv4_key, ipv4_key_length);
-#elif defined(WIN32)
-    RtlIpv4AddressToString(&peer->local_ipv4_addr, ipv4_key);
-#endif
-	pthread_mutex_lock(&ip4_tbl_lck);
-    k = kh_put(pmap, ipv4_addr_table, ipv4_key, &ret);
+	table_lock(pl, &pl->ip4_tbl_lck);
+    k = kh_put(ip4map, pl->ipv4_addr_table, peer->local_ipv4_addr.s_addr,
+               &ret);
     if (ret == -1) {
         fprintf(stderr, "put failed for ipv4_table.\n"); 
-		pthread_mutex_unlock(&ip4_tbl_lck);
+		table_unlock(pl, &pl->ip4_tbl_lck);
 		return -1;
     }
-    else if (!ret) {
-        free(&kh_key(ipv4_addr_table, k));
-        kh_del(pmap, ipv4_addr_table, k);
-    }
-    kh_value(ipv4_addr_table, k) = peer;
-	pthread_mutex_unlock(&ip4_tbl_lck);
+    kh_value(pl->ipv4_addr_table, k) = peer;
+	table_unlock(pl, &pl->ip4_tbl_lck);
 
     // ipv6_addr_table:
-#if defined(LINUX) || defined(ANDROID)
-    inet_ntop(AF_INET6, &peer->local_ipv6_addr, ipv6_key, ipv6_key_length);
-#elif defined(WIN32)
-    RtlIpv6AddressToString(&peer->local_ipv6_addr, ipv6_key);
-#endif
-	pthread_mutex_lock(&ip6_tbl_lck);
-    k = kh_put(pmap, ipv6_addr_table, ipv6_key, &ret);
+	table_lock(pl, &pl->ip6_tbl_lck);
+    k = kh_put(ip6map, pl->ipv6_addr_table, peer->local_ipv6_addr, &ret);
     if (ret == -1) {
         fprintf(stderr, "put failed for ipv6_table.\n"); 
-		pthread_mutex_unlock(&ip6_tbl_lck); 
+		table_unlock(pl, &pl->ip6_tbl_lck); 
 		return -1;
     }
-    else if (!ret) {
-        free(&kh_key(ipv6_addr_table, k));
-        kh_del(pmap, ipv6_addr_table, k);
-    }
-    kh_value(ipv6_addr_table, k) = peer;
-	pthread_mutex_unlock(&ip6_tbl_lck);
+    kh_value(pl->ipv6_addr_table, k) = peer;
+	table_unlock(pl, &pl->ip6_tbl_lck);
 
-    increment_base_ipv4_addr(); // only actually increment on success
+    increment_base_ipv4_addr(pl); // only actually increment on success
     return 0;
 }
 
 // Create peer with given uid and make index by uid
 int
-peerlist_add_by_uid(const char *id)
+peerlist_add_by_uid_ctx(struct ipop_ctx *ctx, const char *id)
 {
+    struct peerlist *pl = ctx->peers;
     // create and populate a peer structure
-    struct peer_state *peer = malloc(sizeof(struct peer_state));
+    struct peer_state *peer = calloc(1, sizeof(struct peer_state));
     if (peer == NULL) {
         fprintf(stderr, "Not enough memory to allocate peer.\n");
+        return -1;
     }
     memcpy(peer->id, id, ID_SIZE);
+    build_header(pl, peer);
 
-    // Allocate space for our keys:
-    // hsearch requires our keys to be null-terminated strings, so we convert
-    // in_addr and in6_addr values with inet_ntop first, but we need to allocate
-    // space for the keys.
-    const int id_key_length = ID_SIZE * 2 + 1;
-    char *id_key = malloc(id_key_length * sizeof(char));
-
-    int ret;
-    khint_t k;
-
-    // id_table
-    convert_to_hex_string(peer->id, ID_SIZE, id_key, id_key_length);
-	pthread_mutex_lock(&id_tbl_lck);
-    k = kh_put(pmap, id_table, id_key, &ret);
-    if (ret == -1) {
-        fprintf(stderr, "put failed for id_table.\n"); 
-		pthread_mutex_unlock(&id_tbl_lck); 
-		return -1;
-    }
-    else if (!ret) {
-        free(&kh_key(id_table, k));
-        free(kh_value(id_table, k));
-        kh_del(pmap, id_table, k);
-    }
-    kh_value(id_table, k) = peer;
-	pthread_mutex_unlock(&id_tbl_lck);
-    return 0;
+    return put_id(pl, peer);
 }
 
 /**
@@ -357,8 +766,8 @@ peerlist_add_by_uid(const char *id)
  * with `inet_pton`.
  */
 int
-peerlist_add_p(const char *id, const char *dest_ipv4, const char *dest_ipv6,
-               const uint16_t port)
+peerlist_add_p_ctx(struct ipop_ctx *ctx, const char *id, const char *dest_ipv4,
+                   const char *dest_ipv6, const uint16_t port)
 {
     struct in_addr dest_ipv4_n;
     struct in6_addr dest_ipv6_n;
@@ -383,23 +792,21 @@ peerlist_add_p(const char *id, const char *dest_ipv4, const char *dest_ipv6,
         fprintf(stderr, "Bad IPv6 address format: %s\n", dest_ipv6);
         return -1;
     }
-    return peerlist_add(id, &dest_ipv4_n, &dest_ipv6_n, port);
+    return peerlist_add_ctx(ctx, id, &dest_ipv4_n, &dest_ipv6_n, port);
 }
 
 // Associate mac address with TinCan peer.
 // Fill up MAC address in peer and make index for mac as key and peer as value
 int
-mac_add(const unsigned char * ipop_buf, int mac_offset)
+mac_add_ctx(struct ipop_ctx *ctx, const unsigned char * ipop_buf,
+            int mac_offset)
 {
-    int id_key_length = ID_SIZE*2+1;
-    char id_key [id_key_length];
+    struct peerlist *pl = ctx->peers;
     int ret;
-    convert_to_hex_string((const char *) ipop_buf, ID_SIZE, id_key,
-                          id_key_length);
     struct peer_state *peer = NULL;
-    peerlist_get_by_ids(id_key, &peer);
+    peerlist_get_by_id_ctx(ctx, (const char *) ipop_buf, &peer);
     if (peer == NULL) {
-        fprintf(stderr, "Unable to find the peer with given key.\n"); return -1;
+        IPOP_LOG("Unable to find the peer with given key.\n"); return -1;
     }
     int i;
     long long key = 0;
@@ -407,29 +814,29 @@ mac_add(const unsigned char * ipop_buf, int mac_offset)
         *(peer->mac)=*(ipop_buf+mac_offset+i);
         key += (long long) *(ipop_buf+mac_offset+i) << 8*i;
     }
-	pthread_mutex_lock(&mac_tbl_lck);
-    khint_t k = kh_put(64, mac_table, key, &ret);
+	table_lock(pl, &pl->mac_tbl_lck);
+    khint_t k = kh_put(64, pl->mac_table, key, &ret);
     if (ret == -1) {
         fprintf(stderr, "put failed for mac_table.\n"); 
-		pthread_mutex_unlock(&mac_tbl_lck); 
+		table_unlock(pl, &pl->mac_tbl_lck); 
 		return -1;
     }
-    kh_value(mac_table, k) = peer;
-	pthread_mutex_unlock(&mac_tbl_lck);
+    kh_value(pl->mac_table, k) = peer;
+	table_unlock(pl, &pl->mac_tbl_lck);
     return 0;
 }
 
 // Associate TinCan link with Mac address of sender hareward address of ARP
 int
-arp_sha_mac_add(const unsigned char * ipop_buf) {
-    return mac_add(ipop_buf, 62);
+arp_sha_mac_add_ctx(struct ipop_ctx *ctx, const unsigned char * ipop_buf) {
+    return mac_add_ctx(ctx, ipop_buf, 62);
 }
 
 // Associate TinCan link with Mac address of sender hareward address of 
 // Ethernet frame
 int
-source_mac_add(const unsigned char * ipop_buf) {
-    return mac_add(ipop_buf, 46);
+source_mac_add_ctx(struct ipop_ctx *ctx, const unsigned char * ipop_buf) {
+    return mac_add_ctx(ctx, ipop_buf, 46);
 }
 
 /**
@@ -440,79 +847,112 @@ source_mac_add(const unsigned char * ipop_buf) {
  * success, -1 on failure (if a client with the given id cannot be found).
  */
 int
-peerlist_get_by_id(const char *id, struct peer_state **peer)
+peerlist_get_by_id_ctx(struct ipop_ctx *ctx, const char *id,
+                       struct peer_state **peer)
 {
-    const int id_key_length = ID_SIZE * 2 + 1;
-    char key[id_key_length];
-    convert_to_hex_string(id, ID_SIZE, key, id_key_length);
-	pthread_mutex_lock(&id_tbl_lck);
-    khint_t k = kh_get(pmap, id_table, key);
-	if (k == kh_end(id_table)) {
-		pthread_mutex_unlock(&id_tbl_lck);
+    struct peerlist *pl = ctx->peers;
+    reader_online(pl);
+    id_key_t key;
+    memcpy(key.id, id, ID_SIZE);
+	table_lock(pl, &pl->id_tbl_lck);
+    khint_t k = kh_get(idmap, pl->id_table, key);
+	if (k == kh_end(pl->id_table)) {
+		table_unlock(pl, &pl->id_tbl_lck);
 		return -1;
 	}
-    *peer = kh_value(id_table, k);
-	pthread_mutex_unlock(&id_tbl_lck);
+    *peer = kh_value(pl->id_table, k);
+	table_unlock(pl, &pl->id_tbl_lck);
     return 0;
 }
 
-//argument id is give as string
+/**
+ * Finds the peer that was given `index` under `epoch`, as named by a compact
+ * link header. Returns 0 on success, -1 if there is no such peer, or if the
+ * index is from before a restart (another epoch).
+ */
 int
-peerlist_get_by_ids(const char *id, struct peer_state **peer)
+peerlist_get_by_index_ctx(struct ipop_ctx *ctx, int epoch, int index,
+                          struct peer_state **peer)
 {
-	pthread_mutex_lock(&id_tbl_lck);
-    khint_t k = kh_get(pmap, id_table, id);
-    if (k == kh_end(id_table)) {
-		pthread_mutex_unlock(&id_tbl_lck);
-		return -1;
-	}
-    *peer = kh_value(id_table, k);
-	pthread_mutex_unlock(&id_tbl_lck);
+    struct peerlist *pl = ctx->peers;
+    reader_online(pl);
+    if (epoch != pl->epoch || index < 0 || index >= PEERLIST_MAX_INDEX) {
+        return -1;
+    }
+    struct peer_state *p = __atomic_load_n(&pl->index_table[index],
+                                           __ATOMIC_ACQUIRE);
+    if (p == NULL) return -1;
+    *peer = p;
     return 0;
 }
 
+/**
+ * Records the `epoch` and `index` that `peer` gave us, as told by a HELLO
+ * header, so frames to it get a compact link header for the next
+ * PEERLIST_INDEX_TTL seconds.
+ */
+void
+peerlist_learn_index(struct peer_state *peer, int epoch, int index)
+{
+    uint32_t hdr;
+    set_compact_header((unsigned char *) &hdr, 0, epoch, index);
+    __atomic_store_n(&peer->compact_hdr, hdr, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->index_learned, (int) time(NULL), __ATOMIC_RELAXED);
+}
+
+//argument id is give as string, the id in hex
 int
-peerlist_get_by_local_ipv4_addr(struct in_addr *_local_ipv4_addr,
-                                struct peer_state **peer)
+peerlist_get_by_ids_ctx(struct ipop_ctx *ctx, const char *id,
+                        struct peer_state **peer)
 {
+    char bin[ID_SIZE];
+    unsigned int byte;
+    for (int i = 0; i < ID_SIZE; i++) {
+        if (sscanf(id + 2 * i, "%2x", &byte) != 1) return -1;
+        bin[i] = (char) byte;
+    }
+    return peerlist_get_by_id_ctx(ctx, bin, peer);
+}
+
+int
+peerlist_get_by_local_ipv4_addr_ctx(struct ipop_ctx *ctx,
+                                    struct in_addr *_local_ipv4_addr,
+                                    struct peer_state **peer)
+{
+    struct peerlist *pl = ctx->peers;
+    reader_online(pl);
     unsigned char start_byte =
         ((unsigned char *)(&_local_ipv4_addr->s_addr))[0];
     unsigned char end_byte =
         ((unsigned char *)(&_local_ipv4_addr->s_addr))[3];
-	pthread_mutex_lock(&ip4_tbl_lck);
+	table_lock(pl, &pl->ip4_tbl_lck);
     if ((start_byte >= 224 && start_byte <= 239) || end_byte == 0xFF) {
-        for (; ipv4_iterator < kh_end(ipv4_addr_table); ++ipv4_iterator) {
-            if (kh_exist(ipv4_addr_table, ipv4_iterator)) {
-                *peer = kh_value(ipv4_addr_table, ipv4_iterator++);
-				pthread_mutex_unlock(&ip4_tbl_lck); 
+        for (; ipv4_iterator < kh_end(pl->ipv4_addr_table); ++ipv4_iterator) {
+            if (kh_exist(pl->ipv4_addr_table, ipv4_iterator)) {
+                *peer = kh_value(pl->ipv4_addr_table, ipv4_iterator++);
+				table_unlock(pl, &pl->ip4_tbl_lck); 
 				return 1;
             }
         }
-		pthread_mutex_unlock(&ip4_tbl_lck);
+		table_unlock(pl, &pl->ip4_tbl_lck);
         return -1;
     }
     // Router mode support
-    _local_ipv4_addr->s_addr &= router_subnet_mask.s_addr;
-
-    char key[4*4];
-#if defined(LINUX) || defined(ANDROID)
-    inet_ntop(AF_INET, _local_ipv4_addr, key, sizeof(key)/sizeof(char));
-#elif defined(WIN32)
-    RtlIpv4AddressToString(_local_ipv4_addr, key);
-#endif
+    _local_ipv4_addr->s_addr &= pl->router_subnet_mask.s_addr;
 
-    khint_t k = kh_get(pmap, ipv4_addr_table, key);
-    if (k != kh_end(ipv4_addr_table) && kh_exist(ipv4_addr_table, k)) {
-        *peer = kh_value(ipv4_addr_table, k);
+    khint_t k = kh_get(ip4map, pl->ipv4_addr_table, _local_ipv4_addr->s_addr);
+    if (k != kh_end(pl->ipv4_addr_table) && kh_exist(pl->ipv4_addr_table, k)) {
+        *peer = kh_value(pl->ipv4_addr_table, k);
     }
-    else { *peer = &null_peer; }
-	pthread_mutex_unlock(&ip4_tbl_lck);
+    else { *peer = pl->null; }
+	table_unlock(pl, &pl->ip4_tbl_lck);
     return 0;
 }
 
 int
-peerlist_get_by_local_ipv4_addr_p(const char *_local_ipv4_addr,
-                                  struct peer_state **peer)
+peerlist_get_by_local_ipv4_addr_p_ctx(struct ipop_ctx *ctx,
+                                      const char *_local_ipv4_addr,
+                                      struct peer_state **peer)
 {
     struct in_addr _local_ipv4_addr_n;
 #if defined(LINUX) || defined(ANDROID)
@@ -525,48 +965,46 @@ peerlist_get_by_local_ipv4_addr_p(const char *_local_ipv4_addr,
         fprintf(stderr, "Bad IPv4 address format: %s\n", _local_ipv4_addr);
         return -1;
     }
-    return peerlist_get_by_local_ipv4_addr(&_local_ipv4_addr_n, peer);
+    return peerlist_get_by_local_ipv4_addr_ctx(ctx, &_local_ipv4_addr_n, peer);
 }
 
 int
-peerlist_get_by_local_ipv6_addr(struct in6_addr *_local_ipv6_addr,
-                                struct peer_state **peer)
+peerlist_get_by_local_ipv6_addr_ctx(struct ipop_ctx *ctx,
+                                    struct in6_addr *_local_ipv6_addr,
+                                    struct peer_state **peer)
 {
+    struct peerlist *pl = ctx->peers;
+    reader_online(pl);
     unsigned char* bytes =
         ((unsigned char *)(&_local_ipv6_addr->s6_addr));
     unsigned char type = bytes[1] & 0x0F;
-	pthread_mutex_lock(&ip6_tbl_lck);
+	table_lock(pl, &pl->ip6_tbl_lck);
     if (bytes[0] == 0xFF && (type == 0x05 || type == 0x08 || type == 0x0e)) {
         // if it is an IPv6 multicast address by the rules given by
         // https://en.wikipedia.org/wiki/Multicast_address#IPv6
-        for (; ipv6_iterator != kh_end(ipv6_addr_table); ++ipv6_iterator) {
-            if (kh_exist(ipv6_addr_table, ipv6_iterator)) {
-				*peer = kh_value(ipv6_addr_table, ipv6_iterator++);
-				pthread_mutex_unlock(&ip6_tbl_lck);
+        for (; ipv6_iterator != kh_end(pl->ipv6_addr_table); ++ipv6_iterator) {
+            if (kh_exist(pl->ipv6_addr_table, ipv6_iterator)) {
+				*peer = kh_value(pl->ipv6_addr_table, ipv6_iterator++);
+				table_unlock(pl, &pl->ip6_tbl_lck);
                 return 1;
             }
         }
-		pthread_mutex_unlock(&ip6_tbl_lck);
+		table_unlock(pl, &pl->ip6_tbl_lck);
         return -1;
     }
-    char key[5*8];
-#if defined(LINUX) || defined(ANDROID)
-    inet_ntop(AF_INET6, _local_ipv6_addr, key, sizeof(key)/sizeof(char));
-#elif defined(WIN32)
-    RtlIpv6AddressToString(_local_ipv6_addr, key);
-#endif
-    khint_t k = kh_get(pmap, ipv6_addr_table, key);
-    if (k != kh_end(ipv6_addr_table) && kh_exist(ipv6_addr_table, k)) {
-        *peer = kh_value(ipv6_addr_table, k);
+    khint_t k = kh_get(ip6map, pl->ipv6_addr_table, *_local_ipv6_addr);
+    if (k != kh_end(pl->ipv6_addr_table) && kh_exist(pl->ipv6_addr_table, k)) {
+        *peer = kh_value(pl->ipv6_addr_table, k);
     }
-    else { *peer = &null_peer; }
-	pthread_mutex_unlock(&ip6_tbl_lck);
+    else { *peer = pl->null; }
+	table_unlock(pl, &pl->ip6_tbl_lck);
     return 0;
 }
 
 int
-peerlist_get_by_local_ipv6_addr_p(const char *_local_ipv6_addr,
-                                  struct peer_state **peer)
+peerlist_get_by_local_ipv6_addr_p_ctx(struct ipop_ctx *ctx,
+                                      const char *_local_ipv6_addr,
+                                      struct peer_state **peer)
 {
     struct in6_addr _local_ipv6_addr_n;
 #if defined(LINUX) || defined(ANDROID)
@@ -581,30 +1019,35 @@ peerlist_get_by_local_ipv6_addr_p(const char *_local_ipv6_addr,
         fprintf(stderr, "Bad IPv6 address format: %s\n", _local_ipv6_addr);
         return -1;
     }
-    return peerlist_get_by_local_ipv6_addr(&_local_ipv6_addr_n, peer);
+    return peerlist_get_by_local_ipv6_addr_ctx(ctx, &_local_ipv6_addr_n, peer);
 }
 
 int
-peerlist_get_by_mac_addr(const unsigned char * buf, struct peer_state **peer)
+peerlist_get_by_mac_addr_ctx(struct ipop_ctx *ctx, const unsigned char * buf,
+                             struct peer_state **peer)
 {
+    struct peerlist *pl = ctx->peers;
+    reader_online(pl);
     long long key = 0;
     int i;
     for(i=0;i<6;i++) {
         key += (long long) *(buf+i) << 8*i;
     }
-	pthread_mutex_lock(&mac_tbl_lck);
-    khint_t k = kh_get(64, mac_table, key);
-    if (k != kh_end(mac_table) && kh_exist(mac_table, k)) {
-        *peer = kh_value(mac_table, k);
+	table_lock(pl, &pl->mac_tbl_lck);
+    khint_t k = kh_get(64, pl->mac_table, key);
+    if (k != kh_end(pl->mac_table) && kh_exist(pl->mac_table, k)) {
+        *peer = kh_value(pl->mac_table, k);
     }
-    else { *peer = &null_peer; }
-	pthread_mutex_unlock(&mac_tbl_lck);
+    else { *peer = pl->null; }
+	table_unlock(pl, &pl->mac_tbl_lck);
     return 0;
 }
 
 int
-override_base_ipv4_addr_p(const char *_local_ipv4_addr_p)
+override_base_ipv4_addr_p_ctx(struct ipop_ctx *ctx,
+                              const char *_local_ipv4_addr_p)
 {
+    struct peerlist *pl = ctx->peers;
     struct in_addr local_ipv4_addr_n;
 #if defined(LINUX) || defined(ANDROID)
     if (!inet_pton(AF_INET, _local_ipv4_addr_p, &local_ipv4_addr_n)) {
@@ -617,95 +1060,337 @@ override_base_ipv4_addr_p(const char *_local_ipv4_addr_p)
         fprintf(stderr, "Bad IPv4 address format: %s\n", _local_ipv4_addr_p);
         return -1;
     }
-    memcpy(&base_ipv4_addr, &local_ipv4_addr_n, sizeof(struct in_addr));
+    memcpy(&pl->base_ipv4_addr, &local_ipv4_addr_n, sizeof(struct in_addr));
     return 0;
 }
 
 int
-set_subnet_mask(unsigned int mask_len, unsigned int router_mask_len)
+set_subnet_mask_ctx(struct ipop_ctx *ctx, unsigned int mask_len,
+                    unsigned int router_mask_len)
 {
-    subnet_mask.s_addr = htonl(~(0u) << (32 - mask_len));
-    router_subnet_mask.s_addr = htonl(~(0u) << (32 - router_mask_len));
+    struct peerlist *pl = ctx->peers;
+    pl->subnet_mask.s_addr = htonl(~(0u) << (32 - mask_len));
+    pl->router_subnet_mask.s_addr = htonl(~(0u) << (32 - router_mask_len));
     return 0;
 }
 
 int
-check_network_range(struct in_addr ip_addr)
+check_network_range_ctx(struct ipop_ctx *ctx, struct in_addr ip_addr)
 {
-    struct in_addr tmp_addr = local_ipv4_addr;
+    struct peerlist *pl = ctx->peers;
+    struct in_addr tmp_addr = pl->local_ipv4_addr;
     if (ip_addr.s_addr == tmp_addr.s_addr) return -1;
 
-    tmp_addr.s_addr &= subnet_mask.s_addr;
-    ip_addr.s_addr &= subnet_mask.s_addr;
+    tmp_addr.s_addr &= pl->subnet_mask.s_addr;
+    ip_addr.s_addr &= pl->subnet_mask.s_addr;
 
     if (tmp_addr.s_addr == ip_addr.s_addr) return 1;
     return 0;
 }
 
 int
-reset_id_table()
+reset_id_table_ctx(struct ipop_ctx *ctx)
 {
-	pthread_mutex_lock(&id_tbl_lck);
-	id_iterator = kh_begin(id_table);
-	pthread_mutex_unlock(&id_tbl_lck);
+    struct peerlist *pl = ctx->peers;
+	table_lock(pl, &pl->id_tbl_lck);
+	id_iterator = kh_begin(pl->id_table);
+	table_unlock(pl, &pl->id_tbl_lck);
 	return 0;
 }
 
 int
-is_id_table_end()
+is_id_table_end_ctx(struct ipop_ctx *ctx)
 {
+    struct peerlist *pl = ctx->peers;
 	int rv = 0;
-	pthread_mutex_lock(&id_tbl_lck);
-	rv = (id_iterator == kh_end(id_table));
-	pthread_mutex_unlock(&id_tbl_lck);
+	table_lock(pl, &pl->id_tbl_lck);
+	rv = (id_iterator == kh_end(pl->id_table));
+	table_unlock(pl, &pl->id_tbl_lck);
 	return rv;
 }
 
 void
-increase_id_table_itr()
+increase_id_table_itr_ctx(struct ipop_ctx *ctx)
 {
-	pthread_mutex_lock(&id_tbl_lck);
+    struct peerlist *pl = ctx->peers;
+	table_lock(pl, &pl->id_tbl_lck);
 	++id_iterator;
-	pthread_mutex_unlock(&id_tbl_lck);
+	table_unlock(pl, &pl->id_tbl_lck);
 }
 
 
 int
-is_id_exist() {
+is_id_exist_ctx(struct ipop_ctx *ctx) {
+    struct peerlist *pl = ctx->peers;
 	int rv = 0;
-	pthread_mutex_lock(&id_tbl_lck);
-	rv = kh_exist(id_table, id_iterator);
-	pthread_mutex_unlock(&id_tbl_lck);
+	table_lock(pl, &pl->id_tbl_lck);
+	rv = kh_exist(pl->id_table, id_iterator);
+	table_unlock(pl, &pl->id_tbl_lck);
 	return rv;
 }
 
+/**
+ * Points `key` at the id of the peer under the iterator, ID_SIZE bytes that
+ * are not NUL terminated.
+ */
 void
-retrieve_id(const char ** key)
+retrieve_id_bin_ctx(struct ipop_ctx *ctx, const char ** key)
 {
-	pthread_mutex_lock(&id_tbl_lck);
-   *key = kh_key(id_table, id_iterator);
-	pthread_mutex_unlock(&id_tbl_lck);
+    struct peerlist *pl = ctx->peers;
+	table_lock(pl, &pl->id_tbl_lck);
+   *key = kh_key(pl->id_table, id_iterator).id;
+	table_unlock(pl, &pl->id_tbl_lck);
+}
+
+/**
+ * Points `key` at the id of the peer under the iterator as a NUL terminated
+ * hex string, which stays valid until the next call from the same thread.
+ */
+void
+retrieve_id_ctx(struct ipop_ctx *ctx, const char ** key)
+{
+    const char *id;
+    retrieve_id_bin_ctx(ctx, &id);
+    convert_to_hex_string(id, ID_SIZE, id_hex, sizeof(id_hex));
+   *key = id_hex;
 }
 
 struct peer_state *
-retrieve_peer()
+retrieve_peer_ctx(struct ipop_ctx *ctx)
 {
+    struct peerlist *pl = ctx->peers;
+    reader_online(pl);
     struct peer_state *peer;
-	pthread_mutex_lock(&id_tbl_lck);
-    peer = kh_value(id_table, id_iterator);
-	pthread_mutex_unlock(&id_tbl_lck);
+	table_lock(pl, &pl->id_tbl_lck);
+    peer = kh_value(pl->id_table, id_iterator);
+	table_unlock(pl, &pl->id_tbl_lck);
     return peer;
 }
 
 void
-iterate_id_table()
+iterate_id_table_ctx(struct ipop_ctx *ctx)
 {
+    struct peerlist *pl = ctx->peers;
     int i=0;
-	pthread_mutex_lock(&id_tbl_lck);
-    for(i=0; i<kh_end(id_table) ; i++) {
-      if (kh_exist(id_table, i)) {
-         printf("i:%d, key:%s\n", i, kh_key(id_table, i));
+    char key[ID_SIZE * 2 + 1];
+	table_lock(pl, &pl->id_tbl_lck);
+    for(i=0; i<kh_end(pl->id_table) ; i++) {
+      if (kh_exist(pl->id_table, i)) {
+         convert_to_hex_string(kh_key(pl->id_table, i).id, ID_SIZE, key,
+                               sizeof(key));
+         printf("i:%d, key:%s\n", i, key);
       }
     }
-	pthread_mutex_unlock(&id_tbl_lck);
+	table_unlock(pl, &pl->id_tbl_lck);
+}
+
+/*
+ * The functions below predate struct ipop_ctx, they work on the default
+ * context (see ipop_ctx_default).
+ */
+
+int
+peerlist_init()
+{
+    int r = peerlist_init_ctx(ipop_ctx_default());
+    peerlist_epoch = peerlist_default.epoch;
+    return r;
+}
+
+void
+peerlist_set_locking(int enabled)
+{
+    peerlist_set_locking_ctx(ipop_ctx_default(), enabled);
+}
+
+int
+peerlist_reader_add()
+{
+    return peerlist_reader_add_ctx(ipop_ctx_default());
+}
+
+int
+peerlist_reset_iterators()
+{
+    return peerlist_reset_iterators_ctx(ipop_ctx_default());
+}
+
+int
+peerlist_set_local(const char *_local_id,
+                   const struct in_addr *_local_ipv4_addr,
+                   const struct in6_addr *_local_ipv6_addr)
+{
+    return peerlist_set_local_ctx(ipop_ctx_default(), _local_id,
+                                  _local_ipv4_addr, _local_ipv6_addr);
+}
+
+int
+peerlist_set_local_p(const char *_local_id, const char *_local_ipv4_addr_p,
+                     const char *_local_ipv6_addr_p)
+{
+    return peerlist_set_local_p_ctx(ipop_ctx_default(), _local_id,
+                                    _local_ipv4_addr_p, _local_ipv6_addr_p);
+}
+
+int
+peerlist_add(const char *id, const struct in_addr *dest_ipv4,
+             const struct in6_addr *dest_ipv6, const uint16_t port)
+{
+    return peerlist_add_ctx(ipop_ctx_default(), id, dest_ipv4, dest_ipv6,
+                            port);
+}
+
+int
+peerlist_add_by_uid(const char *id)
+{
+    return peerlist_add_by_uid_ctx(ipop_ctx_default(), id);
+}
+
+int
+peerlist_add_p(const char *id, const char *dest_ipv4, const char *dest_ipv6,
+               const uint16_t port)
+{
+    return peerlist_add_p_ctx(ipop_ctx_default(), id, dest_ipv4, dest_ipv6,
+                              port);
+}
+
+int
+mac_add(const unsigned char * ipop_buf, int mac_offset)
+{
+    return mac_add_ctx(ipop_ctx_default(), ipop_buf, mac_offset);
+}
+
+int
+arp_sha_mac_add(const unsigned char * ipop_buf)
+{
+    return arp_sha_mac_add_ctx(ipop_ctx_default(), ipop_buf);
+}
+
+int
+source_mac_add(const unsigned char * ipop_buf)
+{
+    return source_mac_add_ctx(ipop_ctx_default(), ipop_buf);
+}
+
+int
+peerlist_get_by_id(const char *id, struct peer_state **peer)
+{
+    return peerlist_get_by_id_ctx(ipop_ctx_default(), id, peer);
+}
+
+int
+peerlist_get_by_index(int epoch, int index, struct peer_state **peer)
+{
+    return peerlist_get_by_index_ctx(ipop_ctx_default(), epoch, index, peer);
+}
+
+int
+peerlist_get_by_ids(const char *id, struct peer_state **peer)
+{
+    return peerlist_get_by_ids_ctx(ipop_ctx_default(), id, peer);
+}
+
+int
+peerlist_get_by_local_ipv4_addr(struct in_addr *_local_ipv4_addr,
+                                struct peer_state **peer)
+{
+    return peerlist_get_by_local_ipv4_addr_ctx(ipop_ctx_default(),
+                                               _local_ipv4_addr, peer);
+}
+
+int
+peerlist_get_by_local_ipv4_addr_p(const char *_local_ipv4_addr,
+                                  struct peer_state **peer)
+{
+    return peerlist_get_by_local_ipv4_addr_p_ctx(ipop_ctx_default(),
+                                                 _local_ipv4_addr, peer);
+}
+
+int
+peerlist_get_by_local_ipv6_addr(struct in6_addr *_local_ipv6_addr,
+                                struct peer_state **peer)
+{
+    return peerlist_get_by_local_ipv6_addr_ctx(ipop_ctx_default(),
+                                               _local_ipv6_addr, peer);
+}
+
+int
+peerlist_get_by_local_ipv6_addr_p(const char *_local_ipv6_addr,
+                                  struct peer_state **peer)
+{
+    return peerlist_get_by_local_ipv6_addr_p_ctx(ipop_ctx_default(),
+                                                 _local_ipv6_addr, peer);
+}
+
+int
+peerlist_get_by_mac_addr(const unsigned char * buf, struct peer_state **peer)
+{
+    return peerlist_get_by_mac_addr_ctx(ipop_ctx_default(), buf, peer);
+}
+
+int
+override_base_ipv4_addr_p(const char *_local_ipv4_addr_p)
+{
+    return override_base_ipv4_addr_p_ctx(ipop_ctx_default(),
+                                         _local_ipv4_addr_p);
+}
+
+int
+set_subnet_mask(unsigned int mask_len, unsigned int router_mask_len)
+{
+    return set_subnet_mask_ctx(ipop_ctx_default(), mask_len, router_mask_len);
+}
+
+int
+check_network_range(struct in_addr ip_addr)
+{
+    return check_network_range_ctx(ipop_ctx_default(), ip_addr);
+}
+
+int
+reset_id_table()
+{
+    return reset_id_table_ctx(ipop_ctx_default());
+}
+
+int
+is_id_table_end()
+{
+    return is_id_table_end_ctx(ipop_ctx_default());
+}
+
+void
+increase_id_table_itr()
+{
+    increase_id_table_itr_ctx(ipop_ctx_default());
+}
+
+int
+is_id_exist()
+{
+    return is_id_exist_ctx(ipop_ctx_default());
+}
+
+void
+retrieve_id(const char ** key)
+{
+    retrieve_id_ctx(ipop_ctx_default(), key);
+}
+
+void
+retrieve_id_bin(const char ** key)
+{
+    retrieve_id_bin_ctx(ipop_ctx_default(), key);
+}
+
+struct peer_state *
+retrieve_peer()
+{
+    return retrieve_peer_ctx(ipop_ctx_default());
+}
+
+void
+iterate_id_table()
+{
+    iterate_id_table_ctx(ipop_ctx_default());
 }
@@ -42,17 +42,36 @@
 
 #define WIN32_EXPORT __declspec(dllexport)
 
+#include "headers.h"
+
+// most peers that get an index for compact link headers, the largest index
+// that fits into the header marks a peer without one
+#define PEERLIST_MAX_INDEX COMPACT_FIELD_MASK
+// seconds a learned index is used before the peer is asked for it again, so
+// frames to a peer that restarted (and dropped its indexes) get through again
+#define PEERLIST_INDEX_TTL 10
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct peer_state {
     char id[ID_SIZE]; // 160bit unique identifier
+    char hdr[2 * ID_SIZE]; // prebuilt ipop header, local id then this id
     struct in_addr local_ipv4_addr; // the virtual IPv4 address that we see
     struct in6_addr local_ipv6_addr; // the virtual IPv6 address that we see
     struct in_addr dest_ipv4_addr;  // the actual address to send data to
     char mac[6]; // MAC address
     uint16_t port; // The open port on the client that we're connected to
+    // compact link headers (see headers.h)
+    int index; // our index for this peer, PEERLIST_MAX_INDEX if it has none
+    char hello_hdr[2][COMPACT_HELLO_LEN]; // HELLO, and HELLO asking back
+    uint32_t compact_hdr; // for frames to the peer, 0 until it told us its
+                          // index for us
+    int index_learned; // when the peer last told us its index
+    int hello_sent; // when we last answered a HELLO asking for our index
+    struct peer_state *retired_next; // next peer replaced before this one
+    unsigned long retired_at; // the grace count when it was replaced
 };
 
 extern struct peer_state peerlist_local; // used to publicly expose the local
@@ -60,12 +79,112 @@ extern struct peer_state peerlist_local; // used to publicly expose the local
 
 extern struct peer_state null_peer;
 
+extern int peerlist_epoch; // tells our indexes from those before a restart
+
+struct ipop_ctx;
+struct peerlist; // the peer tables of one ipop_ctx
+
+extern struct peerlist peerlist_default; // the peerlist of ipop_ctx_default
+
+struct peerlist * peerlist_new();
+void peerlist_free(struct peerlist *pl);
+
+#if defined(LINUX) || defined(ANDROID)
+int peerlist_init_ctx(struct ipop_ctx *ctx);
+#elif defined(WIN32)
+WIN32_EXPORT int peerlist_init_ctx(struct ipop_ctx *ctx);
+#endif
+struct peer_state * peerlist_local_ctx(struct ipop_ctx *ctx);
+struct peer_state * peerlist_null_ctx(struct ipop_ctx *ctx);
+int peerlist_reset_iterators_ctx(struct ipop_ctx *ctx);
+void peerlist_set_locking_ctx(struct ipop_ctx *ctx, int enabled);
+int peerlist_reader_add_ctx(struct ipop_ctx *ctx);
+void peerlist_reader_remove();
+void peerlist_quiescent();
+int peerlist_set_local_ctx(struct ipop_ctx *ctx, const char *_local_id,
+                           const struct in_addr *_local_ipv4_addr,
+                           const struct in6_addr *_local_ipv6_addr);
+#if defined(LINUX) || defined(ANDROID)
+int peerlist_set_local_p_ctx(struct ipop_ctx *ctx, const char *_local_id,
+                             const char *_local_ipv4_addr_p,
+                             const char *_local_ipv6_addr_p);
+#elif defined(WIN32)
+WIN32_EXPORT int peerlist_set_local_p_ctx(struct ipop_ctx *ctx,
+                                          const char *_local_id,
+                                          const char *_local_ipv4_addr_p,
+                                          const char *_local_ipv6_addr_p);
+#endif
+int peerlist_add_ctx(struct ipop_ctx *ctx, const char *id,
+                     const struct in_addr *dest_ipv4,
+                     const struct in6_addr *dest_ipv6, const uint16_t port);
+#if defined(LINUX) || defined(ANDROID)
+int peerlist_add_p_ctx(struct ipop_ctx *ctx, const char *id,
+                       const char *dest_ipv4, const char *dest_ipv6,
+                       const uint16_t port);
+int peerlist_add_by_uid_ctx(struct ipop_ctx *ctx, const char *id);
+#elif defined(WIN32)
+WIN32_EXPORT int peerlist_add_p_ctx(struct ipop_ctx *ctx, const char *id,
+                                    const char *dest_ipv4,
+                                    const char *dest_ipv6,
+                                    const uint16_t port);
+WIN32_EXPORT int peerlist_add_by_uid_ctx(struct ipop_ctx *ctx, const char *id);
+#endif
+int arp_sha_mac_add_ctx(struct ipop_ctx *ctx, const unsigned char * ipop_buf);
+int source_mac_add_ctx(struct ipop_ctx *ctx, const unsigned char * ipop_buf);
+int mac_add_ctx(struct ipop_ctx *ctx, const unsigned char * ipop_buf,
+                int mac_offset);
+int peerlist_get_by_id_ctx(struct ipop_ctx *ctx, const char *id,
+                           struct peer_state **peer);
+int peerlist_get_by_ids_ctx(struct ipop_ctx *ctx, const char *id,
+                            struct peer_state **peer);
+int peerlist_get_by_index_ctx(struct ipop_ctx *ctx, int epoch, int index,
+                              struct peer_state **peer);
+int peerlist_get_by_local_ipv4_addr_ctx(struct ipop_ctx *ctx,
+                                        struct in_addr *_local_ipv4_addr,
+                                        struct peer_state **peer);
+int peerlist_get_by_local_ipv4_addr_p_ctx(struct ipop_ctx *ctx,
+                                          const char *_local_ipv4_addr,
+                                          struct peer_state **peer);
+int peerlist_get_by_local_ipv6_addr_ctx(struct ipop_ctx *ctx,
+                                        struct in6_addr *_local_ipv6_addr,
+                                        struct peer_state **peer);
+int peerlist_get_by_local_ipv6_addr_p_ctx(struct ipop_ctx *ctx,
+                                          const char *_local_ipv6_addr,
+                                          struct peer_state **peer);
+int peerlist_get_by_mac_addr_ctx(struct ipop_ctx *ctx,
+                                 const unsigned char * buf,
+                                 struct peer_state **peer);
+int check_network_range_ctx(struct ipop_ctx *ctx, struct in_addr ip_addr);
+struct peer_state * retrieve_peer_ctx(struct ipop_ctx *ctx);
+int reset_id_table_ctx(struct ipop_ctx *ctx);
+int is_id_table_end_ctx(struct ipop_ctx *ctx);
+void increase_id_table_itr_ctx(struct ipop_ctx *ctx);
+int is_id_exist_ctx(struct ipop_ctx *ctx);
+void retrieve_id_ctx(struct ipop_ctx *ctx, const char ** key);
+void retrieve_id_bin_ctx(struct ipop_ctx *ctx, const char ** key);
+void iterate_id_table_ctx(struct ipop_ctx *ctx);
+#if defined(LINUX) || defined(ANDROID)
+int override_base_ipv4_addr_p_ctx(struct ipop_ctx *ctx, const char *ipv4);
+int set_subnet_mask_ctx(struct ipop_ctx *ctx, unsigned int mask_len,
+                        unsigned int router_mask_len);
+#elif defined(WIN32)
+WIN32_EXPORT int override_base_ipv4_addr_p_ctx(struct ipop_ctx *ctx,
+                                               const char *ipv4);
+WIN32_EXPORT int set_subnet_mask_ctx(struct ipop_ctx *ctx,
+                                     unsigned int mask_len,
+                                     unsigned int router_mask_len);
+#endif
+
+/* The functions below work on the default context, see ipop_ctx_default. */
+
 #if defined(LINUX) || defined(ANDROID)
 int peerlist_init();
 #elif defined(WIN32)
 WIN32_EXPORT int peerlist_init();
 #endif
 int peerlist_reset_iterators();
+void peerlist_set_locking(int enabled);
+int peerlist_reader_add();
 int peerlist_set_local(const char *_local_id,
                        const struct in_addr *_local_ipv4_addr,
                        const struct in6_addr *_local_ipv6_addr);
@@ -92,6 +211,8 @@ int arp_sha_mac_add(const unsigned char * ipop_buf);
 int source_mac_add(const unsigned char * ipop_buf);
 int peerlist_get_by_id(const char *id, struct peer_state **peer);
 int peerlist_get_by_ids(const char *id, struct peer_state **peer);
+int peerlist_get_by_index(int epoch, int index, struct peer_state **peer);
+void peerlist_learn_index(struct peer_state *peer, int epoch, int index);
 int peerlist_get_by_local_ipv4_addr(struct in_addr *_local_ipv4_addr,
                                     struct peer_state **peer);
 int peerlist_get_by_local_ipv4_addr_p(const char *_local_ipv4_addr,
@@ -108,6 +229,7 @@ int is_id_table_end();
 void increase_id_table_itr();
 int is_id_exist();
 void retrieve_id(const char ** key);
+void retrieve_id_bin(const char ** key);
 void iterate_id_table();
 int mac_add(const unsigned char * ipop_buf, int mac_offset);
 
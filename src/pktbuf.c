@@ -0,0 +1,145 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pktbuf.h"
+
+/**
+ * Sets up a pool of `count` buffers of `size` bytes each, of which the first
+ * `headroom` bytes are kept in front of the frame. Returns 0 on success, -1 on
+ * failure.
+ */
+int
+pktbuf_pool_init(struct pktbuf_pool *pool, int count, int size, int headroom)
+{
+    memset(pool, 0, sizeof(struct pktbuf_pool));
+    if (count < 1 || headroom < 0 || size <= headroom) {
+        fprintf(stderr, "Bad packet buffer pool: %d x %d bytes\n", count,
+                size);
+        return -1;
+    }
+    pool->count = count;
+    pool->size = size;
+    pool->stride = (size + PKTBUF_ALIGN - 1) & ~(PKTBUF_ALIGN - 1);
+    pool->headroom = headroom;
+
+    void *slab = NULL, *descs = NULL;
+    if (posix_memalign(&slab, PKTBUF_ALIGN,
+                       (size_t) count * pool->stride) != 0 ||
+        posix_memalign(&descs, PKTBUF_ALIGN,
+                       (size_t) count * sizeof(struct pktbuf)) != 0) {
+        fprintf(stderr, "Not enough memory to allocate packet buffers.\n");
+        free(slab);
+        return -1;
+    }
+    pool->slab = slab;
+    pool->descs = descs;
+    // touch every page now, so the memory comes from the NUMA node of the
+    // thread setting up the pool, which is the thread that uses it
+    memset(pool->slab, 0, (size_t) count * pool->stride);
+    pthread_mutex_init(&pool->lock, NULL);
+
+    for (int i = count - 1; i >= 0; i--) {
+        struct pktbuf *pkt = &pool->descs[i];
+        memset(pkt, 0, sizeof(struct pktbuf));
+        pkt->head = pool->slab + (size_t) i * pool->stride;
+        pkt->pool = pool;
+        pkt->next = pool->free_list;
+        pool->free_list = pkt;
+    }
+    pool->available = count;
+    return 0;
+}
+
+/**
+ * Frees the memory of the pool. No buffer of it may be in use any more.
+ */
+void
+pktbuf_pool_destroy(struct pktbuf_pool *pool)
+{
+    if (pool->slab == NULL) return;
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slab);
+    free(pool->descs);
+    memset(pool, 0, sizeof(struct pktbuf_pool));
+}
+
+/**
+ * Takes a buffer from the pool, holding one reference and with its metadata
+ * reset. Returns NULL if every buffer is in use.
+ */
+struct pktbuf *
+pktbuf_alloc(struct pktbuf_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    struct pktbuf *pkt = pool->free_list;
+    if (pkt != NULL) {
+        pool->free_list = pkt->next;
+        pool->available--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (pkt == NULL) return NULL;
+
+    pkt->data = pkt->head + pool->headroom;
+    pkt->len = 0;
+    pkt->l3 = -1;
+    pkt->l4 = -1;
+    pkt->peer = NULL;
+    pkt->next = NULL;
+    pkt->refcnt = 1;
+    return pkt;
+}
+
+/**
+ * Adds a reference to `pkt`.
+ */
+void
+pktbuf_get(struct pktbuf *pkt)
+{
+    __atomic_add_fetch(&pkt->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops a reference to `pkt`, the last one returns it to its pool.
+ */
+void
+pktbuf_put(struct pktbuf *pkt)
+{
+    if (__atomic_sub_fetch(&pkt->refcnt, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    struct pktbuf_pool *pool = pkt->pool;
+    pthread_mutex_lock(&pool->lock);
+    pkt->next = pool->free_list;
+    pool->free_list = pkt;
+    pool->available++;
+    pthread_mutex_unlock(&pool->lock);
+}
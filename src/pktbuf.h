@@ -0,0 +1,108 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifndef _PKTBUF_H_
+#define _PKTBUF_H_
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PKTBUF_ALIGN 64 // cache line, buffers and descriptors start on one
+
+struct peer_state;
+struct pktbuf_pool;
+
+// A packet buffer handed out by a pktbuf_pool. The frame starts `headroom`
+// bytes into the buffer, so headers can be put in front of it in place. The
+// buffer goes back to its pool when the last reference is dropped, which lets
+// several consumers (such as the peers a broadcast goes to, or the stages of a
+// pipeline) share it without copies.
+struct pktbuf {
+    unsigned char *head; // start of the buffer
+    unsigned char *data; // start of the frame
+    int len; // length of the frame
+    int l3; // offset of the IP header in the frame, -1 if not known
+    int l4; // offset of the transport header in the frame, -1 if not known
+    struct peer_state *peer; // peer the frame came from or goes to, if known
+    int refcnt;
+    struct pktbuf_pool *pool;
+    struct pktbuf *next; // free list
+} __attribute__((aligned(PKTBUF_ALIGN)));
+
+// A fixed number of equally sized buffers carved from one allocation.
+struct pktbuf_pool {
+    pthread_mutex_t lock;
+    struct pktbuf *free_list;
+    struct pktbuf *descs;
+    unsigned char *slab;
+    int count;
+    int size; // bytes per buffer, headroom included
+    int stride; // size rounded up to PKTBUF_ALIGN
+    int headroom;
+    int available;
+};
+
+int pktbuf_pool_init(struct pktbuf_pool *pool, int count, int size,
+                     int headroom);
+void pktbuf_pool_destroy(struct pktbuf_pool *pool);
+struct pktbuf *pktbuf_alloc(struct pktbuf_pool *pool);
+void pktbuf_get(struct pktbuf *pkt);
+void pktbuf_put(struct pktbuf *pkt);
+
+/**
+ * Bytes available for the frame, from pkt->data to the end of the buffer.
+ */
+static inline int
+pktbuf_room(const struct pktbuf *pkt)
+{
+    return pkt->pool->size - pkt->pool->headroom;
+}
+
+/**
+ * The buffer of `pool` that `ptr` points into, or NULL if it points elsewhere.
+ */
+static inline struct pktbuf *
+pktbuf_of(struct pktbuf_pool *pool, const void *ptr)
+{
+    const unsigned char *p = ptr;
+    if (pool->slab == NULL || p < pool->slab ||
+        p >= pool->slab + (size_t) pool->count * pool->stride) {
+        return NULL;
+    }
+    return &pool->descs[(p - pool->slab) / pool->stride];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+#define _GNU_SOURCE // for the pthread affinity calls
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(LINUX)
+#include <sched.h>
+#endif
+
+#include "placement.h"
+
+#if defined(LINUX)
+// CPUs the packet threads are pinned to in turn, none means they may run
+// anywhere
+static int plan_cpus[PLACEMENT_MAX_CPUS];
+static int plan_count = 0;
+static int plan_next = 0;
+static int plan_fifo_priority = 0;
+static cpu_set_t plan_fallback; // where threads that can not be pinned run
+#endif
+
+/**
+ * Parses a list of CPUs such as "0-3,8,10-11" into `cpus`, which has room for
+ * `max` entries. Returns the number of CPUs, or -1 if the list is malformed.
+ */
+int
+placement_parse_cpus(const char *list, int *cpus, int max)
+{
+    int count = 0;
+    const char *p = list;
+
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+        if (end == p || first < 0) goto bad;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) goto bad;
+        }
+        if (last >= PLACEMENT_MAX_CPUS) goto bad;
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count >= max) goto bad;
+            cpus[count++] = (int) cpu;
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') goto bad;
+        p = end;
+    }
+    return count;
+
+bad:
+    fprintf(stderr, "Bad CPU list: '%s'\n", list);
+    return -1;
+}
+
+/**
+ * Sets where the threads started with placement_create_thread run: pinned to
+ * the `count` CPUs in `cpus` one after the other (wrapping around), and with
+ * SCHED_FIFO at `fifo_priority` unless it is 0. Must be called before any of
+ * them is started. Returns 0 on success, -1 on failure.
+ */
+int
+placement_init(const int *cpus, int count, int fifo_priority)
+{
+#if defined(LINUX)
+    if (count < 0 || count > PLACEMENT_MAX_CPUS) return -1;
+    if (fifo_priority != 0 &&
+        (fifo_priority < sched_get_priority_min(SCHED_FIFO) ||
+         fifo_priority > sched_get_priority_max(SCHED_FIFO))) {
+        fprintf(stderr, "Bad SCHED_FIFO priority: %d\n", fifo_priority);
+        return -1;
+    }
+    if (sched_getaffinity(0, sizeof(plan_fallback), &plan_fallback) < 0) {
+        fprintf(stderr, "sched_getaffinity failed\n");
+        return -1;
+    }
+    memcpy(plan_cpus, cpus, count * sizeof(int));
+    plan_count = count;
+    plan_next = 0;
+    plan_fifo_priority = fifo_priority;
+    return 0;
+#else
+    if (count > 0 || fifo_priority != 0) {
+        fprintf(stderr, "Thread placement is not supported\n");
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/**
+ * Starts a packet thread like pthread_create, pinned to the next CPU of the
+ * plan and with its scheduling class. Memory the thread allocates and touches
+ * first comes from the NUMA node of that CPU. A thread that can not get
+ * SCHED_FIFO (which takes CAP_SYS_NICE) or its CPU (which may be offline or
+ * outside the cpuset) is started without. Returns 0 on success, an error
+ * number otherwise.
+ */
+int
+placement_create_thread(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+#if defined(LINUX)
+    pthread_attr_t attr;
+    int cpu = -1, r;
+
+    if (plan_count == 0 && plan_fifo_priority == 0) {
+        return pthread_create(thread, NULL, start, arg);
+    }
+    pthread_attr_init(&attr);
+    if (plan_count > 0) {
+        cpu_set_t set;
+        int i = __atomic_fetch_add(&plan_next, 1, __ATOMIC_RELAXED);
+        cpu = plan_cpus[i % plan_count];
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    if (plan_fifo_priority != 0) {
+        struct sched_param param = { .sched_priority = plan_fifo_priority };
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    r = pthread_create(thread, &attr, start, arg);
+    if (r == EPERM && plan_fifo_priority != 0) {
+        fprintf(stderr, "not allowed to use SCHED_FIFO, using the default "
+                        "scheduler\n");
+        plan_fifo_priority = 0;
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        r = pthread_create(thread, &attr, start, arg);
+    }
+    if (r == EINVAL && cpu >= 0) {
+        fprintf(stderr, "can not run on CPU %d, thread not pinned\n", cpu);
+        pthread_attr_setaffinity_np(&attr, sizeof(plan_fallback),
+                                    &plan_fallback);
+        r = pthread_create(thread, &attr, start, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return r;
+#else
+    return pthread_create(thread, NULL, start, arg);
+#endif
+}
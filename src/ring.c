@@ -0,0 +1,194 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+// how often a consumer looks at an empty ring before it goes to sleep
+#define RING_SPINS 256
+
+/**
+ * Prepares an empty ring of at least `count` elements of `elem_size` bytes,
+ * rounded up to a power of two. Returns 0 on success, -1 on failure.
+ */
+int
+spsc_ring_init(struct spsc_ring *ring, unsigned int count, size_t elem_size)
+{
+    unsigned int size = 1;
+    void *slots = NULL;
+
+    memset(ring, 0, sizeof(struct spsc_ring));
+    ring->efd = -1;
+    if (count < 1 || count > (1U << 24) || elem_size < 1) {
+        fprintf(stderr, "Bad ring size: %u\n", count);
+        return -1;
+    }
+    while (size < count) size <<= 1;
+    if (posix_memalign(&slots, RING_ALIGN, (size_t) size * elem_size) != 0) {
+        fprintf(stderr, "Not enough memory to allocate ring.\n");
+        return -1;
+    }
+    if ((ring->efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "eventfd failed\n");
+        free(slots);
+        return -1;
+    }
+    ring->slots = slots;
+    ring->mask = size - 1;
+    ring->elem_size = elem_size;
+    return 0;
+}
+
+/**
+ * Frees the memory of the ring. Neither end may use it any more. Does nothing
+ * for a ring that was never set up.
+ */
+void
+spsc_ring_free(struct spsc_ring *ring)
+{
+    if (ring->slots == NULL) return;
+    close(ring->efd);
+    free(ring->slots);
+    memset(ring, 0, sizeof(struct spsc_ring));
+    ring->efd = -1;
+}
+
+/**
+ * Wakes the consumer up if it went to sleep on an empty ring.
+ */
+static void
+wake_consumer(struct spsc_ring *ring)
+{
+    uint64_t one = 1;
+
+    // pairs with the fence in spsc_ring_wait: either the consumer sees the
+    // new head, or this sees that it is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // a plain load keeps the cache line shared while the consumer is awake
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED)) {
+        if (write(ring->efd, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "ring wakeup failed\n");
+        }
+    }
+}
+
+/**
+ * Copies `elem` to the end of the ring. Producer only. Returns 0 on success,
+ * -1 if the ring is full.
+ */
+int
+spsc_ring_push(struct spsc_ring *ring, const void *elem)
+{
+    unsigned int head = ring->head;
+
+    if (head - ring->tail_cache > ring->mask) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache > ring->mask) return -1;
+    }
+    memcpy(ring->slots + (size_t) (head & ring->mask) * ring->elem_size,
+           elem, ring->elem_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    wake_consumer(ring);
+    return 0;
+}
+
+/**
+ * Copies the element at the front of the ring to `elem` and removes it.
+ * Consumer only. Returns 0 on success, -1 if the ring is empty.
+ */
+int
+spsc_ring_pop(struct spsc_ring *ring, void *elem)
+{
+    unsigned int tail = ring->tail;
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == ring->head_cache) return -1;
+    }
+    memcpy(elem, ring->slots + (size_t) (tail & ring->mask) * ring->elem_size,
+           ring->elem_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Blocks the consumer until the ring is not empty. It spins for a while
+ * first, since under load the next element is usually close. Returns 0 once
+ * there is something to pop, -1 if the ring is empty and closed.
+ */
+int
+spsc_ring_wait(struct spsc_ring *ring)
+{
+    uint64_t count;
+
+    for (int i = 0; i < RING_SPINS; i++) {
+        if (spsc_ring_count(ring) > 0) return 0;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    while (1) {
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (spsc_ring_count(ring) > 0) {
+            __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) return -1;
+        if (read(ring->efd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            fprintf(stderr, "ring wait failed\n");
+            return -1;
+        }
+    }
+}
+
+/**
+ * Tells the consumer that nothing more will be pushed. It still gets what is
+ * in the ring, then spsc_ring_wait fails. Producer only.
+ */
+void
+spsc_ring_close(struct spsc_ring *ring)
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    if (write(ring->efd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "ring wakeup failed\n");
+    }
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RING_ALIGN 64 // cache line, keeps the two ends from sharing one
+
+// A bounded single-producer, single-consumer queue of fixed size elements.
+// Exactly one thread may push and one other thread may pop, neither takes a
+// lock. A consumer that finds the ring empty can block in spsc_ring_wait, the
+// producer wakes it up through an eventfd only when it is asleep.
+struct spsc_ring {
+    // written by the producer
+    unsigned int head __attribute__((aligned(RING_ALIGN)));
+    unsigned int tail_cache; // last tail the producer saw
+    // written by the consumer
+    unsigned int tail __attribute__((aligned(RING_ALIGN)));
+    unsigned int head_cache; // last head the consumer saw
+    int waiting; // the consumer is about to sleep or asleep
+    // set up once
+    unsigned int mask __attribute__((aligned(RING_ALIGN)));
+    size_t elem_size;
+    unsigned char *slots;
+    int efd;
+    int closed;
+};
+
+int spsc_ring_init(struct spsc_ring *ring, unsigned int count,
+                   size_t elem_size);
+void spsc_ring_free(struct spsc_ring *ring);
+int spsc_ring_push(struct spsc_ring *ring, const void *elem);
+int spsc_ring_pop(struct spsc_ring *ring, void *elem);
+int spsc_ring_wait(struct spsc_ring *ring);
+void spsc_ring_close(struct spsc_ring *ring);
+
+/**
+ * Number of elements waiting in the ring. Exact for the producer and the
+ * consumer, a snapshot for any other thread.
+ */
+static inline unsigned int
+spsc_ring_count(const struct spsc_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Number of elements the ring can hold.
+ */
+static inline unsigned int
+spsc_ring_capacity(const struct spsc_ring *ring)
+{
+    return ring->mask + 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+#define _GNU_SOURCE // for memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "shm.h"
+#include "ipop_log.h"
+
+// how often a consumer looks at an empty ring before it goes to sleep
+#define SHM_SPINS 256
+
+static size_t
+align_up(size_t size)
+{
+    return (size + RING_ALIGN - 1) & ~((size_t) RING_ALIGN - 1);
+}
+
+/**
+ * Bytes taken by one ring of `count` slots of `slot_size` bytes, its slot
+ * lengths included.
+ */
+static size_t
+ring_bytes(uint32_t count, uint32_t slot_size)
+{
+    return align_up(count * sizeof(uint32_t)) + (size_t) count * slot_size;
+}
+
+static size_t
+total_bytes(uint32_t count, uint32_t slot_size)
+{
+    return align_up(sizeof(struct ipop_shm_layout)) +
+           IPOP_SHM_RINGS * ring_bytes(count, slot_size);
+}
+
+/**
+ * Points the rings of `shm` into the mapped memory. The eventfds are taken
+ * over by `shm`.
+ */
+static void
+map_rings(struct ipop_shm *shm, const int *efds)
+{
+    struct ipop_shm_layout *layout = shm->base;
+    unsigned char *next = (unsigned char *) shm->base +
+                          align_up(sizeof(struct ipop_shm_layout));
+
+    for (int i = 0; i < IPOP_SHM_RINGS; i++) {
+        struct ipop_shm_ring *ring = &shm->rings[i];
+        memset(ring, 0, sizeof(struct ipop_shm_ring));
+        ring->ctrl = &layout->ctrl[i];
+        ring->lens = (uint32_t *) next;
+        ring->slots = next + align_up(layout->count * sizeof(uint32_t));
+        ring->mask = layout->count - 1;
+        ring->slot_size = layout->slot_size;
+        ring->tail_cache = __atomic_load_n(&ring->ctrl->tail, __ATOMIC_ACQUIRE);
+        ring->head_cache = __atomic_load_n(&ring->ctrl->head, __ATOMIC_ACQUIRE);
+        ring->efd = efds[i];
+        pthread_spin_init(&ring->lock, PTHREAD_PROCESS_PRIVATE);
+        next += ring_bytes(layout->count, layout->slot_size);
+    }
+}
+
+/**
+ * Sets up a new shared-memory transport with two empty rings of at least
+ * `count` slots, rounded up to a power of two, that take datagrams of up to
+ * `slot_size` bytes. Returns 0 on success, -1 on failure.
+ */
+int
+ipop_shm_create(struct ipop_shm *shm, unsigned int count,
+                unsigned int slot_size)
+{
+    uint32_t size = 1;
+    int efds[IPOP_SHM_RINGS] = { -1, -1 };
+
+    memset(shm, 0, sizeof(struct ipop_shm));
+    shm->fd = -1;
+    if (count < 1 || count > (1U << 16) || slot_size < 1 ||
+        slot_size > (1U << 20)) {
+        fprintf(stderr, "Bad shared ring size: %u slots of %u bytes\n",
+                count, slot_size);
+        return -1;
+    }
+    while (size < count) size <<= 1;
+    slot_size = align_up(slot_size);
+    shm->size = total_bytes(size, slot_size);
+
+    if ((shm->fd = memfd_create("ipop-shm", MFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "memfd_create failed\n");
+        return -1;
+    }
+    if (ftruncate(shm->fd, shm->size) < 0) {
+        fprintf(stderr, "Not enough memory to allocate shared rings.\n");
+        goto fail;
+    }
+    shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     shm->fd, 0);
+    if (shm->base == MAP_FAILED) {
+        shm->base = NULL;
+        fprintf(stderr, "mmap failed\n");
+        goto fail;
+    }
+    for (int i = 0; i < IPOP_SHM_RINGS; i++) {
+        if ((efds[i] = eventfd(0, EFD_CLOEXEC)) < 0) {
+            fprintf(stderr, "eventfd failed\n");
+            goto fail;
+        }
+    }
+
+    // the memory of a fresh memfd reads as zero, which is two empty rings
+    struct ipop_shm_layout *layout = shm->base;
+    layout->count = size;
+    layout->slot_size = slot_size;
+    layout->version = IPOP_SHM_VERSION;
+    __atomic_store_n(&layout->magic, IPOP_SHM_MAGIC, __ATOMIC_RELEASE);
+    map_rings(shm, efds);
+    return 0;
+
+fail:
+    for (int i = 0; i < IPOP_SHM_RINGS; i++) {
+        if (efds[i] >= 0) close(efds[i]);
+    }
+    if (shm->base != NULL) munmap(shm->base, shm->size);
+    close(shm->fd);
+    memset(shm, 0, sizeof(struct ipop_shm));
+    shm->fd = -1;
+    return -1;
+}
+
+/**
+ * Maps a shared-memory transport another process set up with
+ * ipop_shm_create, given its memfd and the eventfds of its rings. `shm` takes
+ * the descriptors over. Returns 0 on success, -1 on failure.
+ */
+int
+ipop_shm_attach(struct ipop_shm *shm, int fd, int up_efd, int down_efd)
+{
+    struct stat st;
+    int efds[IPOP_SHM_RINGS] = { up_efd, down_efd };
+
+    memset(shm, 0, sizeof(struct ipop_shm));
+    shm->fd = -1;
+    if (fstat(fd, &st) < 0 ||
+        (size_t) st.st_size < sizeof(struct ipop_shm_layout)) {
+        fprintf(stderr, "Bad shared ring memory\n");
+        return -1;
+    }
+    shm->size = st.st_size;
+    shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (shm->base == MAP_FAILED) {
+        fprintf(stderr, "mmap failed\n");
+        shm->base = NULL;
+        return -1;
+    }
+
+    struct ipop_shm_layout *layout = shm->base;
+    uint32_t count = layout->count;
+    if (__atomic_load_n(&layout->magic, __ATOMIC_ACQUIRE) != IPOP_SHM_MAGIC ||
+        layout->version != IPOP_SHM_VERSION || count == 0 ||
+        (count & (count - 1)) != 0 || layout->slot_size % RING_ALIGN != 0 ||
+        total_bytes(count, layout->slot_size) > shm->size) {
+        fprintf(stderr, "Bad shared ring memory\n");
+        munmap(shm->base, shm->size);
+        shm->base = NULL;
+        return -1;
+    }
+    shm->fd = fd;
+    map_rings(shm, efds);
+    return 0;
+}
+
+/**
+ * Unmaps the shared memory and closes the descriptors of `shm`. The rings
+ * should be closed first, so the other end stops using them.
+ */
+void
+ipop_shm_destroy(struct ipop_shm *shm)
+{
+    if (shm->base == NULL) return;
+    for (int i = 0; i < IPOP_SHM_RINGS; i++) {
+        close(shm->rings[i].efd);
+        pthread_spin_destroy(&shm->rings[i].lock);
+    }
+    munmap(shm->base, shm->size);
+    close(shm->fd);
+    memset(shm, 0, sizeof(struct ipop_shm));
+    shm->fd = -1;
+}
+
+/**
+ * Returns the next free slot of the ring, which has room for `slot_size`
+ * bytes, or NULL if the ring is full. Nothing is taken until
+ * ipop_shm_commit. Producer only.
+ */
+unsigned char *
+ipop_shm_reserve(struct ipop_shm_ring *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->ctrl->head, __ATOMIC_RELAXED);
+
+    if (head - ring->tail_cache > ring->mask) {
+        ring->tail_cache = __atomic_load_n(&ring->ctrl->tail,
+                                           __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache > ring->mask) return NULL;
+    }
+    return ring->slots + (size_t) (head & ring->mask) * ring->slot_size;
+}
+
+/**
+ * Hands the slot ipop_shm_reserve returned, now holding a datagram of `len`
+ * bytes, to the consumer, and wakes the consumer up if it went to sleep.
+ * Producer only.
+ */
+void
+ipop_shm_commit(struct ipop_shm_ring *ring, size_t len)
+{
+    uint32_t head = __atomic_load_n(&ring->ctrl->head, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+
+    ring->lens[head & ring->mask] = len;
+    __atomic_store_n(&ring->ctrl->head, head + 1, __ATOMIC_RELEASE);
+
+    // pairs with the fence in ipop_shm_wait: either the consumer sees the
+    // new head, or this sees that it is waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // a plain load keeps the cache line shared while the consumer is awake
+    if (__atomic_load_n(&ring->ctrl->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->ctrl->waiting, 0, __ATOMIC_RELAXED)) {
+        if (write(ring->efd, &one, sizeof(one)) < 0) {
+            IPOP_LOG("ring wakeup failed\n");
+        }
+    }
+}
+
+/**
+ * Gathers the `iovcnt` pieces of a datagram into the next slot of the ring
+ * and hands it to the consumer. The datagram starts `headroom` bytes into the
+ * slot, and those bytes count towards its length, so the consumer can put its
+ * own headers there. `tailroom` more bytes are left free behind it. Unlike
+ * the calls above this may be used by several threads of the producing
+ * process at once. Returns 0 on success, -1 if the datagram was dropped
+ * because the ring was full or it does not fit a slot.
+ */
+int
+ipop_shm_send(struct ipop_shm_ring *ring, const struct iovec *iov,
+              int iovcnt, size_t headroom, size_t tailroom)
+{
+    size_t len = headroom;
+    unsigned char *slot;
+
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+
+    pthread_spin_lock(&ring->lock);
+    if (len + tailroom > ring->slot_size ||
+        (slot = ipop_shm_reserve(ring)) == NULL) {
+        ring->drops++;
+        pthread_spin_unlock(&ring->lock);
+        return -1;
+    }
+    for (int i = 0, off = headroom; i < iovcnt; off += iov[i++].iov_len) {
+        memcpy(slot + off, iov[i].iov_base, iov[i].iov_len);
+    }
+    ipop_shm_commit(ring, len);
+    pthread_spin_unlock(&ring->lock);
+    return 0;
+}
+
+/**
+ * Returns the datagram at the front of the ring and writes its length to
+ * `len`, or returns NULL if the ring is empty. The datagram stays in place
+ * and may be modified until ipop_shm_release. Consumer only.
+ */
+unsigned char *
+ipop_shm_peek(struct ipop_shm_ring *ring, size_t *len)
+{
+    uint32_t tail = __atomic_load_n(&ring->ctrl->tail, __ATOMIC_RELAXED);
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = __atomic_load_n(&ring->ctrl->head,
+                                           __ATOMIC_ACQUIRE);
+        if (tail == ring->head_cache) return NULL;
+    }
+    *len = ring->lens[tail & ring->mask];
+    if (*len > ring->slot_size) *len = ring->slot_size;
+    return ring->slots + (size_t) (tail & ring->mask) * ring->slot_size;
+}
+
+/**
+ * Gives the slot of the datagram ipop_shm_peek returned back to the producer.
+ * Consumer only.
+ */
+void
+ipop_shm_release(struct ipop_shm_ring *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->ctrl->tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->ctrl->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Blocks the consumer until the ring is not empty, spinning for a while
+ * first. Returns 0 once there is something to peek at, -1 if the ring is
+ * empty and closed.
+ */
+int
+ipop_shm_wait(struct ipop_shm_ring *ring)
+{
+    struct ipop_shm_ctrl *ctrl = ring->ctrl;
+    uint64_t count;
+
+    for (int i = 0; i < SHM_SPINS; i++) {
+        if (__atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE) != ctrl->tail) {
+            return 0;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    while (1) {
+        __atomic_store_n(&ctrl->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE) != ctrl->tail) {
+            __atomic_store_n(&ctrl->waiting, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (__atomic_load_n(&ctrl->closed, __ATOMIC_ACQUIRE)) return -1;
+        if (read(ring->efd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            fprintf(stderr, "ring wait failed\n");
+            return -1;
+        }
+    }
+}
+
+/**
+ * Tells the consumer that nothing more will be sent. It still gets what is
+ * in the ring, then ipop_shm_wait fails. Producer only.
+ */
+void
+ipop_shm_close(struct ipop_shm_ring *ring)
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&ring->ctrl->closed, 1, __ATOMIC_RELEASE);
+    if (write(ring->efd, &one, sizeof(one)) < 0) {
+        IPOP_LOG("ring wakeup failed\n");
+    }
+}
+
+#endif
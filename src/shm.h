@@ -0,0 +1,126 @@
+/*
+ * ipop-tap
+ * Copyright 2013, University of Florida
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#if defined(LINUX)
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IPOP_SHM_MAGIC 0x69706f70 // "ipop"
+#define IPOP_SHM_VERSION 1
+
+// The two rings of a shared-memory transport, by the direction they carry
+// datagrams in. Each datagram is the 40-byte ipop header followed by the
+// ethernet frame, as with send_func and recv_func.
+enum {
+    IPOP_SHM_UP, // to the upper layer, ipop-tap produces
+    IPOP_SHM_DOWN, // from the upper layer, ipop-tap consumes
+    IPOP_SHM_RINGS
+};
+
+// The indexes of one ring, in the shared memory. The two ends only ever
+// write their own index, so they can live in different processes.
+struct ipop_shm_ctrl {
+    // written by the producer
+    uint32_t head __attribute__((aligned(RING_ALIGN)));
+    uint32_t closed;
+    // written by the consumer
+    uint32_t tail __attribute__((aligned(RING_ALIGN)));
+    uint32_t waiting; // the consumer is about to sleep or asleep
+};
+
+// The start of the shared memory. The lengths of the slots of each ring and
+// then the slots themselves follow, see ipop_shm_attach.
+struct ipop_shm_layout {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count; // slots per ring, a power of two
+    uint32_t slot_size; // bytes per slot, a multiple of RING_ALIGN
+    struct ipop_shm_ctrl ctrl[IPOP_SHM_RINGS];
+};
+
+// One ring as this process sees it. Like spsc_ring there is a single
+// consumer, and the consumer that finds the ring empty sleeps on an eventfd
+// the producer writes to only when it is asleep. Producers on this side of
+// the ring are serialized by `lock` in ipop_shm_send, so the send and the
+// receive threads (and the lanes of the pipeline) can share it.
+struct ipop_shm_ring {
+    struct ipop_shm_ctrl *ctrl;
+    uint32_t *lens;
+    unsigned char *slots;
+    uint32_t mask;
+    uint32_t slot_size;
+    uint32_t tail_cache; // last tail the producer saw
+    uint32_t head_cache; // last head the consumer saw
+    int efd; // doorbell of the consumer
+    pthread_spinlock_t lock;
+    unsigned long long drops; // datagrams ipop_shm_send found no room for
+};
+
+// A shared-memory transport between ipop-tap and the upper layer. The
+// memory is a memfd, so `fd` and the eventfds of the rings can be inherited
+// by or passed to (SCM_RIGHTS) another process, which maps them with
+// ipop_shm_attach.
+struct ipop_shm {
+    int fd;
+    void *base;
+    size_t size;
+    struct ipop_shm_ring rings[IPOP_SHM_RINGS];
+};
+
+int ipop_shm_create(struct ipop_shm *shm, unsigned int count,
+                    unsigned int slot_size);
+int ipop_shm_attach(struct ipop_shm *shm, int fd, int up_efd, int down_efd);
+void ipop_shm_destroy(struct ipop_shm *shm);
+unsigned char *ipop_shm_reserve(struct ipop_shm_ring *ring);
+void ipop_shm_commit(struct ipop_shm_ring *ring, size_t len);
+int ipop_shm_send(struct ipop_shm_ring *ring, const struct iovec *iov,
+                  int iovcnt, size_t headroom, size_t tailroom);
+unsigned char *ipop_shm_peek(struct ipop_shm_ring *ring, size_t *len);
+void ipop_shm_release(struct ipop_shm_ring *ring);
+int ipop_shm_wait(struct ipop_shm_ring *ring);
+void ipop_shm_close(struct ipop_shm_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
@@ -41,12 +41,37 @@
 
 #include "socket_utils.h"
 
+static int create_ipv4_udp_socket(const char* ip, uint16_t port,
+                                  int reuseport);
+
 /**
  * A convenience function for making an IPv4 UDP (DGRAM) socket. The socket
  * (>=0) is returned on success, -1 otherwise.
  */
 int
 socket_utils_create_ipv4_udp_socket(const char* ip, uint16_t port)
+{
+    return create_ipv4_udp_socket(ip, port, 0);
+}
+
+/**
+ * Same as socket_utils_create_ipv4_udp_socket, but sets SO_REUSEPORT so that
+ * several sockets can be bound to the same address and port. The kernel then
+ * hashes incoming flows across them, which lets every packet worker own a
+ * socket instead of waking up all of them for each datagram.
+ */
+int
+socket_utils_create_ipv4_udp_socket_shared(const char* ip, uint16_t port)
+{
+#if defined(SO_REUSEPORT)
+    return create_ipv4_udp_socket(ip, port, 1);
+#else
+    return create_ipv4_udp_socket(ip, port, 0);
+#endif
+}
+
+static int
+create_ipv4_udp_socket(const char* ip, uint16_t port, int reuseport)
 {
     int sock;
     char optval[4] = { 0 };
@@ -60,6 +85,14 @@ socket_utils_create_ipv4_udp_socket(const char* ip, uint16_t port)
 
     optval[3] = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, optval, sizeof(optval));
+#if defined(SO_REUSEPORT)
+    if (reuseport) {
+        int on = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt SO_REUSEPORT failed\n");
+        }
+    }
+#endif
 
     memset(&addr, 0, addr_len);
     addr.sin_family = AF_INET;
@@ -86,6 +119,26 @@ socket_utils_create_ipv4_udp_socket(const char* ip, uint16_t port)
     return sock;
 }
 
+/**
+ * Lets the kernel busy poll the device queue for up to `usec` microseconds when
+ * a receive on `sock` finds nothing (SO_BUSY_POLL). Raising the value above
+ * net.core.busy_read needs CAP_NET_ADMIN. Returns 0 on success, -1 on failure.
+ */
+int
+socket_utils_set_busy_poll(int sock, int usec)
+{
+#if defined(LINUX) && defined(SO_BUSY_POLL)
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+        fprintf(stderr, "setsockopt SO_BUSY_POLL failed\n");
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "SO_BUSY_POLL is not supported\n");
+    return -1;
+#endif
+}
+
 /**
  * A convenience function for making an IPv6 UDP (DGRAM) socket. The socket
  * (>=0) is returned on success, -1 otherwise. `scope_id` is the id of the
@@ -33,7 +33,9 @@ extern "C" {
 #endif
 
 int socket_utils_create_ipv4_udp_socket(const char* ip, uint16_t port);
+int socket_utils_create_ipv4_udp_socket_shared(const char* ip, uint16_t port);
 int socket_utils_create_ipv6_udp_socket(uint16_t port, uint32_t scope_id);
+int socket_utils_set_busy_poll(int sock, int usec);
 
 #ifdef __cplusplus
 }
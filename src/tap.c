@@ -42,10 +42,13 @@
 #include <sys/socket.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <net/route.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
+#include "ipop_ctx.h"
 #include "tap.h"
 
 #if defined(LINUX)
@@ -56,19 +59,34 @@ struct in6_ifreq {
 };
 #endif
 
-static struct ifreq ifr;
+// The tap device of one context (see struct ipop_ctx).
+struct tap_state {
+    // the ifreq structure stores arguments for ioctl calls, we'll just make
+    // one in open_tap and use it multiple times throughout (see also: 'man
+    // netdevice')
+    struct ifreq ifr;
+    // We must "waste" a couple sockets in order to set all the options we
+    // want:
+    int ipv4_configuration_socket;
+    int ipv6_configuration_socket;
+    int fd; // The file descriptor used by the current TAP device
+    // In multi-queue mode every queue of the device has its own file
+    // descriptor. fd always refers to the first one.
+    int queue_fds[TAP_MAX_QUEUES];
+    int queue_count;
+};
+
+struct tap_state tap_default = {
+    .ipv4_configuration_socket = -1,
+    .ipv6_configuration_socket = -1,
+    .fd = -1,
+};
 
-static int tap_set_flags(short enable, short disable);
-static int tap_set_proc_option(const sa_family_t family, const char *option,
-                               const char *value);
+static int tap_set_flags(struct ipop_ctx *ctx, short enable, short disable);
+static int tap_set_proc_option(struct ipop_ctx *ctx, const sa_family_t family,
+                               const char *option, const char *value);
 static void tap_plen_to_ipv4_mask(unsigned int prefix_len,
                                   struct sockaddr* writeback);
-// We must "waste" a couple sockets in order to set all the options we want:
-static int ipv4_configuration_socket = -1;
-static int ipv6_configuration_socket = -1;
-// the ifreq structure stores arguments for ioctl calls, we'll just make one in
-// open_tap and use it multiple times throughout (see also: 'man netdevice')
-static int fd = -1; // The file descriptor used by the current TAP device
 
 // define the path of the tun device (platform specific)
 #if defined(ANDROID)
@@ -85,49 +103,101 @@ static int fd = -1; // The file descriptor used by the current TAP device
  * Returns the file descriptor (>=0) on success, and -1 on failure.
  */
 int
-tap_open(const char *device, char *mac)
+tap_open_ctx(struct ipop_ctx *ctx, const char *device, char *mac)
+{
+    int tap_fd;
+    if (tap_open_mq_ctx(ctx, device, mac, &tap_fd, 1, 0) < 0) return -1;
+    return tap_fd;
+}
+
+/**
+ * Like tap_open, but attaches `queues` file descriptors to the device and
+ * writes them back to `fds`. When `queues` is greater than one the device is
+ * created with IFF_MULTI_QUEUE and the kernel spreads the flows leaving the
+ * host across the queues, so each queue can be served by its own threads.
+ * With TAP_VNET_HDR in `flags`, frames read from and written to the device are
+ * preceded by a struct virtio_net_hdr (see tap_set_offload). With TAP_TUN the
+ * device is a tun device instead, which has no MAC address, so `mac` is
+ * zeroed.
+ *
+ * Returns the file descriptor of the first queue (>=0) on success, and -1 on
+ * failure.
+ */
+int
+tap_open_mq_ctx(struct ipop_ctx *ctx, const char *device, char *mac, int *fds,
+                int queues, int flags)
 {
-    if ((fd = open(TUN_PATH, O_RDWR)) < 0) {
-        fprintf(stderr, "Opening %s failed. (Are we not root?)\n", TUN_PATH);
-        tap_close(); return -1;
+    struct tap_state *t = ctx->tap;
+    if (queues < 1 || queues > TAP_MAX_QUEUES) {
+        fprintf(stderr, "Bad number of tap queues: %d (1 to %d are "
+                        "supported)\n", queues, TAP_MAX_QUEUES);
+        return -1;
     }
 
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI; // TAP device, No packet information
+    // TAP (or TUN) device, No packet information
+    t->ifr.ifr_flags = ((flags & TAP_TUN) ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
+    if (flags & TAP_VNET_HDR) t->ifr.ifr_flags |= IFF_VNET_HDR;
+    if (queues > 1) {
+#if defined(IFF_MULTI_QUEUE)
+        t->ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#else
+        fprintf(stderr, "Multi-queue tap devices are not supported.\n");
+        return -1;
+#endif
+    }
 
     if (strlen(device) >= IFNAMSIZ) {
         fprintf(stderr,
                 "Device name '%s' is longer than IFNAMSIZ-1 (%d bytes).\n",
                 device, IFNAMSIZ-1);
-        tap_close(); return -1;
+        return -1;
     }
-    strcpy(ifr.ifr_name, device);
-
-    // Tell the system that device is the name of the tunnel interface (creating
-    // it in the process)
-    if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
-        fprintf(stderr, "Could not set tunnel interface as %s. (Are we not "
-                        "root?)\n", device);
-        tap_close(); return -1;
+    strcpy(t->ifr.ifr_name, device);
+
+    for (int i = 0; i < queues; i++) {
+        if ((t->queue_fds[i] = open(TUN_PATH, O_RDWR)) < 0) {
+            fprintf(stderr, "Opening %s failed. (Are we not root?)\n",
+                    TUN_PATH);
+            tap_close_ctx(ctx); return -1;
+        }
+        t->queue_count = i + 1;
+
+        // Tell the system that device is the name of the tunnel interface
+        // (creating it in the process). In multi-queue mode, each following
+        // call with the same name attaches one more queue to the device.
+        if (ioctl(t->queue_fds[i], TUNSETIFF, (void *) &t->ifr) < 0) {
+            fprintf(stderr, "Could not set tunnel interface as %s. (Are we "
+                            "not root?)\n", device);
+            tap_close_ctx(ctx); return -1;
+        }
+        fds[i] = t->queue_fds[i];
     }
+    t->fd = t->queue_fds[0];
 
     // Create the "throw-away" socket that we'll use to configure the device
-    if ((ipv4_configuration_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    if ((t->ipv4_configuration_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         fprintf(stderr, "UDP IPv4 socket construction failed.\n");
-        tap_close(); return -1;
+        tap_close_ctx(ctx); return -1;
     }
-    if ((ipv6_configuration_socket = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+    if ((t->ipv6_configuration_socket = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
         fprintf(stderr, "UDP IPv6 socket construction failed.\n");
-        tap_close(); return -1;
+        tap_close_ctx(ctx); return -1;
     }
 
-    // get the hardware/MAC address (gets written back to ifr.ifr_hwaddr)
-    if (ioctl(ipv6_configuration_socket, SIOCGIFHWADDR, &ifr) < 0) {
+    if (flags & TAP_TUN) {
+        memset(mac, 0, 6);
+        return t->fd;
+    }
+
+    // get the hardware/MAC address (gets written back to t->ifr.ifr_hwaddr)
+    if (ioctl(t->ipv6_configuration_socket, SIOCGIFHWADDR, &t->ifr) < 0) {
         fprintf(stderr, "Could not read device MAC address.\n");
-        tap_close(); return -1;
+        tap_close_ctx(ctx); return -1;
     }
 
-    memcpy(mac, ifr.ifr_hwaddr.sa_data, 6); // ifr_hwaddr is a sockaddr struct
-    return fd;
+    // ifr_hwaddr is a sockaddr struct
+    memcpy(mac, t->ifr.ifr_hwaddr.sa_data, 6);
+    return t->fd;
 }
 
 /**
@@ -139,21 +209,22 @@ tap_open(const char *device, char *mac)
  * you don't want to enable or disable any flags.
  */
 static int
-tap_set_flags(short enable, short disable)
+tap_set_flags(struct ipop_ctx *ctx, short enable, short disable)
 {
+    struct tap_state *t = ctx->tap;
     // read the current flag states
-    if (ioctl(ipv6_configuration_socket, SIOCGIFFLAGS, &ifr) < 0) {
+    if (ioctl(t->ipv6_configuration_socket, SIOCGIFFLAGS, &t->ifr) < 0) {
         fprintf(stderr, "Could not read device flags for TAP device. (Device "
                         "not open?)\n");
-        tap_close(); return -1;
+        tap_close_ctx(ctx); return -1;
     }
     // set or unset the right flags
-    ifr.ifr_flags |= enable; ifr.ifr_flags &= ~disable;
+    t->ifr.ifr_flags |= enable; t->ifr.ifr_flags &= ~disable;
     // write back the modified flag states
-    if (ioctl(ipv6_configuration_socket, SIOCSIFFLAGS, &ifr) < 0) {
+    if (ioctl(t->ipv6_configuration_socket, SIOCSIFFLAGS, &t->ifr) < 0) {
         fprintf(stderr, "Could not write back device flags for TAP device. "
                         "(Are we not root?)\n");
-        tap_close(); return -1;
+        tap_close_ctx(ctx); return -1;
     }
     return 0;
 }
@@ -166,34 +237,34 @@ tap_set_flags(short enable, short disable)
  * response, which we aren't really willing to provide).
  */
 int
-tap_set_base_flags()
+tap_set_base_flags_ctx(struct ipop_ctx *ctx)
 {
-    //return tap_set_flags(IFF_NOARP, IFF_MULTICAST | IFF_BROADCAST);
-    return tap_set_flags(IFF_NOARP, (short)0);
+    //return tap_set_flags(ctx, IFF_NOARP, IFF_MULTICAST | IFF_BROADCAST);
+    return tap_set_flags(ctx, IFF_NOARP, (short)0);
 }
 
 int
-tap_unset_noarp_flags()
+tap_unset_noarp_flags_ctx(struct ipop_ctx *ctx)
 {
-    return tap_set_flags((short)0, (short) IFF_NOARP);
+    return tap_set_flags(ctx, (short)0, (short) IFF_NOARP);
 }
 
 /**
  * Configures the tap network device to be marked as "UP".
  */
 int
-tap_set_up()
+tap_set_up_ctx(struct ipop_ctx *ctx)
 {
-    return tap_set_flags(IFF_UP | IFF_RUNNING, (short)0);
+    return tap_set_flags(ctx, IFF_UP | IFF_RUNNING, (short)0);
 }
 
 /**
  * Configures the tap network device to be marked as "DOWN".
  */
 int
-tap_down_down()
+tap_set_down_ctx(struct ipop_ctx *ctx)
 {
-    return tap_set_flags((short)0, IFF_UP | IFF_RUNNING);
+    return tap_set_flags(ctx, (short)0, IFF_UP | IFF_RUNNING);
 }
 
 /**
@@ -205,12 +276,87 @@ tap_down_down()
  * required, degrading performance.
  */
 int
-tap_set_mtu(int mtu)
+tap_set_mtu_ctx(struct ipop_ctx *ctx, int mtu)
 {
-    ifr.ifr_mtu = mtu;
-    if (ioctl(ipv6_configuration_socket, SIOCSIFMTU, &ifr) < 0) {
+    struct tap_state *t = ctx->tap;
+    t->ifr.ifr_mtu = mtu;
+    if (ioctl(t->ipv6_configuration_socket, SIOCSIFMTU, &t->ifr) < 0) {
         fprintf(stderr, "Set MTU failed\n");
-        tap_close(); return -1;
+        tap_close_ctx(ctx); return -1;
+    }
+    return 0;
+}
+
+/**
+ * Tells the kernel which offloads we can handle on a device opened with
+ * TAP_VNET_HDR, as a mask of TUN_F_* flags. With TUN_F_CSUM the kernel may hand
+ * us frames without a TCP/UDP checksum, and with TUN_F_TSO4/TUN_F_TSO6 it may
+ * hand us TCP super-frames of up to 64KB instead of MTU sized ones. Frames
+ * we write back may use the same offloads.
+ */
+int
+tap_set_offload_ctx(struct ipop_ctx *ctx, unsigned int offload)
+{
+    struct tap_state *t = ctx->tap;
+    if (ioctl(t->fd, TUNSETOFFLOAD, offload) < 0) {
+        fprintf(stderr, "Could not set tap offload flags 0x%x\n", offload);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Limits how large the super-frames are that the kernel builds for the device,
+ * so that a frame still fits into a single UDP datagram after encapsulation.
+ * There is no ioctl for this, so it is set over rtnetlink, as `ip link set
+ * dev DEVICE gso_max_size SIZE` would. Returns 0 on success, -1 on failure.
+ */
+int
+tap_set_gso_max_size_ctx(struct ipop_ctx *ctx, unsigned int size)
+{
+    struct tap_state *t = ctx->tap;
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        char attrs[RTA_SPACE(sizeof(uint32_t))];
+    } req;
+    char reply[256];
+    int sock, r;
+    uint32_t value = size;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = if_nametoindex(t->ifr.ifr_name);
+
+    struct rtattr *rta = (struct rtattr *)
+        ((char *) &req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    rta->rta_type = IFLA_GSO_MAX_SIZE;
+    rta->rta_len = RTA_LENGTH(sizeof(uint32_t));
+    memcpy(RTA_DATA(rta), &value, sizeof(uint32_t));
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + rta->rta_len;
+
+    if ((sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+        fprintf(stderr, "Netlink socket construction failed.\n");
+        return -1;
+    }
+    if (send(sock, &req, req.nh.nlmsg_len, 0) < 0 ||
+        (r = recv(sock, reply, sizeof(reply), 0)) < 0) {
+        fprintf(stderr, "Could not set gso_max_size. (Are we not root?)\n");
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    struct nlmsghdr *nh = (struct nlmsghdr *) reply;
+    if (NLMSG_OK(nh, r) && nh->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(nh);
+        if (err->error != 0) {
+            fprintf(stderr, "Could not set gso_max_size to %u.\n", size);
+            return -1;
+        }
     }
     return 0;
 }
@@ -244,8 +390,10 @@ tap_plen_to_ipv4_mask(unsigned int prefix_len, struct sockaddr *writeback)
  * subnet, aka the routing prefix or the mask length.
  */
 int
-tap_set_ipv4_addr(const char *presentation, unsigned int prefix_len, char * my_ip4)
+tap_set_ipv4_addr_ctx(struct ipop_ctx *ctx, const char *presentation,
+                      unsigned int prefix_len, char * my_ip4)
 {
+    struct tap_state *t = ctx->tap;
     struct sockaddr_in socket_address = {
         .sin_family = AF_INET,
         .sin_port = 0
@@ -255,26 +403,26 @@ tap_set_ipv4_addr(const char *presentation, unsigned int prefix_len, char * my_i
     // thus filling in socket_address.sin_addr
     if (inet_pton(AF_INET, presentation, &socket_address.sin_addr) != 1) {
         fprintf(stderr, "inet_pton failed (Bad IPv4 address format?)\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
     // we have to wrap our sockaddr_in struct into a sockaddr struct
-    memcpy(&ifr.ifr_addr, &socket_address, sizeof(struct sockaddr));
+    memcpy(&t->ifr.ifr_addr, &socket_address, sizeof(struct sockaddr));
 
     // Copies IPv4 address to my_ip4. IPv4 address starts at sa_data[2] and
     // terminates at sa_data[5]
-    memcpy(my_ip4, ifr.ifr_addr.sa_data+2,4); 
+    memcpy(my_ip4, t->ifr.ifr_addr.sa_data+2,4); 
 
-    if (ioctl(ipv4_configuration_socket, SIOCSIFADDR, &ifr) < 0) {
+    if (ioctl(t->ipv4_configuration_socket, SIOCSIFADDR, &t->ifr) < 0) {
         fprintf(stderr, "Failed to set IPv4 tap device address\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
 
-    tap_plen_to_ipv4_mask(prefix_len, &ifr.ifr_netmask);
-    if (ioctl(ipv4_configuration_socket, SIOCSIFNETMASK, &ifr) < 0) {
+    tap_plen_to_ipv4_mask(prefix_len, &t->ifr.ifr_netmask);
+    if (ioctl(t->ipv4_configuration_socket, SIOCSIFNETMASK, &t->ifr) < 0) {
         fprintf(stderr, "Failed to set IPv4 tap device netmask\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
     return 0;
@@ -287,8 +435,10 @@ tap_set_ipv4_addr(const char *presentation, unsigned int prefix_len, char * my_i
  * IPv4).
  */
 int
-tap_set_ipv6_addr(const char *presentation, unsigned int prefix_len)
+tap_set_ipv6_addr_ctx(struct ipop_ctx *ctx, const char *presentation,
+                      unsigned int prefix_len)
 {
+    struct tap_state *t = ctx->tap;
     struct sockaddr_in6 socket_address = {
         .sin6_family = AF_INET6,
         .sin6_scope_id = 0,
@@ -301,7 +451,7 @@ tap_set_ipv6_addr(const char *presentation, unsigned int prefix_len)
     if (inet_pton(AF_INET6, presentation,
                   socket_address.sin6_addr.s6_addr) != 1) {
         fprintf(stderr, "inet_pton failed (Bad IPv6 address format?)\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
 
@@ -310,12 +460,12 @@ tap_set_ipv6_addr(const char *presentation, unsigned int prefix_len)
     struct in6_ifreq ifr6;
     memset(&ifr6, 0, sizeof(struct in6_ifreq));
     ifr6.ifr6_addr = socket_address.sin6_addr;
-    ifr6.ifr6_ifindex = if_nametoindex(ifr.ifr_name);
+    ifr6.ifr6_ifindex = if_nametoindex(t->ifr.ifr_name);
     ifr6.ifr6_prefixlen = prefix_len;
 
-    if (ioctl(ipv6_configuration_socket, SIOCSIFADDR, &ifr6) < 0) {
+    if (ioctl(t->ipv6_configuration_socket, SIOCSIFADDR, &ifr6) < 0) {
         fprintf(stderr, "Failed to set IPv6 tap device address\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
     return 0;
@@ -328,28 +478,29 @@ tap_set_ipv6_addr(const char *presentation, unsigned int prefix_len)
  * for subnets and 1024 for gateways.
  */
 int
-tap_set_ipv4_route(const char *presentation, unsigned short prefix_len,
-                   unsigned int metric)
+tap_set_ipv4_route_ctx(struct ipop_ctx *ctx, const char *presentation,
+                       unsigned short prefix_len, unsigned int metric)
 {
+    struct tap_state *t = ctx->tap;
     struct rtentry rte = {
         .rt_flags = RTF_UP,
-        .rt_dev = ifr.ifr_name,
+        .rt_dev = t->ifr.ifr_name,
         .rt_metric = metric
     };
     tap_plen_to_ipv4_mask(prefix_len, &rte.rt_genmask);
 
     if (inet_pton(AF_INET, presentation, &rte.rt_dst) != 1) {
         fprintf(stderr, "inet_pton failed (Bad IPv4 address format?)\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
 
     // when the mask is the whole address
     if (prefix_len == 32) rte.rt_flags |= RTF_HOST;
 
-    if (ioctl(ipv4_configuration_socket, SIOCADDRT, &rte) < 0) {
+    if (ioctl(t->ipv4_configuration_socket, SIOCADDRT, &rte) < 0) {
         fprintf(stderr, "Could not write back route.\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
     return 0;
@@ -362,29 +513,30 @@ tap_set_ipv4_route(const char *presentation, unsigned short prefix_len,
  * for subnets and 1024 for gateways.
  */
 int
-tap_set_ipv6_route(const char *presentation, unsigned short prefix_len,
-                   unsigned int metric)
+tap_set_ipv6_route_ctx(struct ipop_ctx *ctx, const char *presentation,
+                       unsigned short prefix_len, unsigned int metric)
 {
 #if !defined(ANDROID)
+    struct tap_state *t = ctx->tap;
     struct in6_rtmsg rtm6 = {
         .rtmsg_flags = RTF_UP,
-        .rtmsg_ifindex = if_nametoindex(ifr.ifr_name),
+        .rtmsg_ifindex = if_nametoindex(t->ifr.ifr_name),
         .rtmsg_dst_len = prefix_len,
         .rtmsg_metric = metric
     };
 
     if (inet_pton(AF_INET6, presentation, &rtm6.rtmsg_dst) != 1) {
         fprintf(stderr, "inet_pton failed (Bad IPv6 address format?)\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
 
     // when the mask is the whole address
     if (prefix_len == 128) rtm6.rtmsg_flags |= RTF_HOST;
 
-    if (ioctl(ipv6_configuration_socket, SIOCADDRT, &rtm6) < 0) {
+    if (ioctl(t->ipv6_configuration_socket, SIOCADDRT, &rtm6) < 0) {
         fprintf(stderr, "Could not write back route.\n");
-        tap_close();
+        tap_close_ctx(ctx);
         return -1;
     }
 #endif
@@ -398,18 +550,18 @@ tap_set_ipv6_route(const char *presentation, unsigned short prefix_len,
  * to this, so you don't need to worry about this on IPv4.
  */
 int
-tap_disable_ipv6_autoconfig()
+tap_disable_ipv6_autoconfig_ctx(struct ipop_ctx *ctx)
 {
     // Disable router solicitation, as it isn't needed
-    if (tap_set_ipv6_proc_option("accept_redirects", "0") < 0) {
-        tap_close(); return -1;
+    if (tap_set_ipv6_proc_option_ctx(ctx, "accept_redirects", "0") < 0) {
+        tap_close_ctx(ctx); return -1;
     }
-    if (tap_set_ipv6_proc_option("accept_ra", "0") < 0) {
-        tap_close(); return -1;
+    if (tap_set_ipv6_proc_option_ctx(ctx, "accept_ra", "0") < 0) {
+        tap_close_ctx(ctx); return -1;
     }
     // Disable autoconfiguration in general
-    if (tap_set_ipv6_proc_option("autoconf", "0") < 0) {
-        tap_close(); return -1;
+    if (tap_set_ipv6_proc_option_ctx(ctx, "autoconf", "0") < 0) {
+        tap_close_ctx(ctx); return -1;
     }
     return 0;
 }
@@ -422,9 +574,10 @@ tap_disable_ipv6_autoconfig()
  * http://tldp.org/HOWTO/Linux+IPv6-HOWTO/proc-sys-net-ipv6..html
  */
 int
-tap_set_ipv6_proc_option(const char *option, const char *value)
+tap_set_ipv6_proc_option_ctx(struct ipop_ctx *ctx, const char *option,
+                             const char *value)
 {
-    return tap_set_proc_option(AF_INET6, option, value);
+    return tap_set_proc_option(ctx, AF_INET6, option, value);
 }
 
 /**
@@ -432,19 +585,21 @@ tap_set_ipv6_proc_option(const char *option, const char *value)
  * /proc/sys/net/ipv4/conf/DEVICE_NAME/OPTION, appended with a newline.
  */
 int
-tap_set_ipv4_proc_option(const char *option, const char *value)
+tap_set_ipv4_proc_option_ctx(struct ipop_ctx *ctx, const char *option,
+                             const char *value)
 {
-    return tap_set_proc_option(AF_INET, option, value);
+    return tap_set_proc_option(ctx, AF_INET, option, value);
 }
 
 static int
-tap_set_proc_option(const sa_family_t family, const char *option,
-                    const char *value)
+tap_set_proc_option(struct ipop_ctx *ctx, const sa_family_t family,
+                    const char *option, const char *value)
 {
-    char path[26 + strlen(ifr.ifr_name) + strlen(option)];
+    struct tap_state *t = ctx->tap;
+    char path[26 + strlen(t->ifr.ifr_name) + strlen(option)];
     // path is a C99 variable-length array
     sprintf(path, "/proc/sys/net/ipv%s/conf/%s/%s",
-            family==AF_INET?"4":"6", ifr.ifr_name, option);
+            family==AF_INET?"4":"6", t->ifr.ifr_name, option);
     FILE *proc_fd;
     if ((proc_fd = fopen(path, "w")) == NULL) {
         fprintf(stderr, "Could not open %s. (Not root or bad path?)\n", path);
@@ -459,17 +614,190 @@ tap_set_proc_option(const sa_family_t family, const char *option,
 }
 
 /**
- * Closes all the sockets associated with the TAP device, cleaning things up.
+ * Closes all the sockets and queues associated with the TAP device, cleaning
+ * things up.
+ */
+void
+tap_close_ctx(struct ipop_ctx *ctx)
+{
+    struct tap_state *t = ctx->tap;
+    for (int i = 0; i < t->queue_count; i++) {
+        if (t->queue_fds[i] >= 0)
+            close(t->queue_fds[i]);
+    }
+    t->queue_count = 0;
+    t->fd = -1;
+    if (t->ipv4_configuration_socket >= 0)
+        close(t->ipv4_configuration_socket);
+    if (t->ipv6_configuration_socket >= 0)
+        close(t->ipv6_configuration_socket);
+    t->ipv4_configuration_socket = -1;
+    t->ipv6_configuration_socket = -1;
+}
+
+/**
+ * Closes the queue `fd` of the TAP device, so that tap_close_ctx leaves it
+ * alone. Used by the thread that owns the queue when it is done with it.
+ */
+void
+tap_close_queue_ctx(struct ipop_ctx *ctx, int fd)
+{
+    struct tap_state *t = ctx->tap;
+    for (int i = 0; i < t->queue_count; i++) {
+        if (t->queue_fds[i] == fd) {
+            close(fd);
+            t->queue_fds[i] = -1;
+            return;
+        }
+    }
+}
+
+/**
+ * Allocates the tap state of a context made by ipop_ctx_new, with no device
+ * open yet. Returns NULL on failure.
+ */
+struct tap_state *
+tap_state_new()
+{
+    struct tap_state *t = calloc(1, sizeof(struct tap_state));
+    if (t == NULL) {
+        fprintf(stderr, "Not enough memory to allocate tap state.\n");
+        return NULL;
+    }
+    t->ipv4_configuration_socket = -1;
+    t->ipv6_configuration_socket = -1;
+    t->fd = -1;
+    return t;
+}
+
+/**
+ * Frees a tap state made by tap_state_new. The device has to be closed with
+ * tap_close_ctx before.
+ */
+void
+tap_state_free(struct tap_state *t)
+{
+    free(t);
+}
+
+/*
+ * The functions below predate struct ipop_ctx, they work on the default
+ * context (see ipop_ctx_default).
  */
+
+int
+tap_open(const char *device, char *mac)
+{
+    return tap_open_ctx(ipop_ctx_default(), device, mac);
+}
+
+int
+tap_open_mq(const char *device, char *mac, int *fds, int queues, int flags)
+{
+    return tap_open_mq_ctx(ipop_ctx_default(), device, mac, fds, queues,
+                           flags);
+}
+
+int
+tap_set_offload(unsigned int offload)
+{
+    return tap_set_offload_ctx(ipop_ctx_default(), offload);
+}
+
+int
+tap_set_gso_max_size(unsigned int size)
+{
+    return tap_set_gso_max_size_ctx(ipop_ctx_default(), size);
+}
+
+int
+tap_set_base_flags()
+{
+    return tap_set_base_flags_ctx(ipop_ctx_default());
+}
+
+int
+tap_unset_noarp_flags()
+{
+    return tap_unset_noarp_flags_ctx(ipop_ctx_default());
+}
+
+int
+tap_set_up()
+{
+    return tap_set_up_ctx(ipop_ctx_default());
+}
+
+int
+tap_set_down()
+{
+    return tap_set_down_ctx(ipop_ctx_default());
+}
+
+int
+tap_set_mtu(int mtu)
+{
+    return tap_set_mtu_ctx(ipop_ctx_default(), mtu);
+}
+
+int
+tap_set_ipv4_addr(const char *presentation, unsigned int prefix_len,
+                  char *my_ip4)
+{
+    return tap_set_ipv4_addr_ctx(ipop_ctx_default(), presentation, prefix_len,
+                                 my_ip4);
+}
+
+int
+tap_set_ipv6_addr(const char *presentation, unsigned int prefix_len)
+{
+    return tap_set_ipv6_addr_ctx(ipop_ctx_default(), presentation, prefix_len);
+}
+
+int
+tap_set_ipv4_route(const char *presentation, unsigned short prefix_len,
+                   unsigned int metric)
+{
+    return tap_set_ipv4_route_ctx(ipop_ctx_default(), presentation, prefix_len,
+                                  metric);
+}
+
+int
+tap_set_ipv6_route(const char *presentation, unsigned short prefix_len,
+                   unsigned int metric)
+{
+    return tap_set_ipv6_route_ctx(ipop_ctx_default(), presentation, prefix_len,
+                                  metric);
+}
+
+int
+tap_disable_ipv6_autoconfig()
+{
+    return tap_disable_ipv6_autoconfig_ctx(ipop_ctx_default());
+}
+
+int
+tap_set_ipv4_proc_option(const char *option, const char *value)
+{
+    return tap_set_ipv4_proc_option_ctx(ipop_ctx_default(), option, value);
+}
+
+int
+tap_set_ipv6_proc_option(const char *option, const char *value)
+{
+    return tap_set_ipv6_proc_option_ctx(ipop_ctx_default(), option, value);
+}
+
 void
 tap_close()
 {
-    if (fd >= 0)
-        close(fd);
-    if (ipv4_configuration_socket >= 0)
-        close(ipv4_configuration_socket);
-    if (ipv6_configuration_socket >= 0)
-        close(ipv6_configuration_socket);
+    tap_close_ctx(ipop_ctx_default());
+}
+
+void
+tap_close_queue(int fd)
+{
+    tap_close_queue_ctx(ipop_ctx_default(), fd);
 }
 #undef TUN_PATH
 #endif
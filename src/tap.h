@@ -34,7 +34,53 @@
 extern "C" {
 #endif
 
+// upper bound on the number of queues we will attach to a multi-queue device
+#define TAP_MAX_QUEUES 16
+
+// flags for tap_open_mq
+#define TAP_VNET_HDR 0x01 // every frame is preceded by a virtio-net header
+#define TAP_TUN 0x02 // layer 3 device (IFF_TUN), it carries bare IP packets
+
+struct ipop_ctx;
+struct tap_state; // the tap device of one ipop_ctx
+
+extern struct tap_state tap_default; // the tap device of ipop_ctx_default
+
+struct tap_state * tap_state_new();
+void tap_state_free(struct tap_state *t);
+
+int tap_open_ctx(struct ipop_ctx *ctx, const char *device, char *mac);
+int tap_open_mq_ctx(struct ipop_ctx *ctx, const char *device, char *mac,
+                    int *fds, int queues, int flags);
+int tap_set_offload_ctx(struct ipop_ctx *ctx, unsigned int offload);
+int tap_set_gso_max_size_ctx(struct ipop_ctx *ctx, unsigned int size);
+int tap_set_base_flags_ctx(struct ipop_ctx *ctx);
+int tap_unset_noarp_flags_ctx(struct ipop_ctx *ctx);
+int tap_set_up_ctx(struct ipop_ctx *ctx);
+int tap_set_down_ctx(struct ipop_ctx *ctx);
+int tap_set_mtu_ctx(struct ipop_ctx *ctx, int mtu);
+int tap_set_ipv4_addr_ctx(struct ipop_ctx *ctx, const char *presentation,
+                          unsigned int prefix_len, char *my_ip4);
+int tap_set_ipv6_addr_ctx(struct ipop_ctx *ctx, const char *presentation,
+                          unsigned int prefix_len);
+int tap_set_ipv4_route_ctx(struct ipop_ctx *ctx, const char *presentation,
+                           unsigned short prefix_len, unsigned int metric);
+int tap_set_ipv6_route_ctx(struct ipop_ctx *ctx, const char *presentation,
+                           unsigned short prefix_len, unsigned int metric);
+int tap_disable_ipv6_autoconfig_ctx(struct ipop_ctx *ctx);
+int tap_set_ipv4_proc_option_ctx(struct ipop_ctx *ctx, const char *option,
+                                 const char *value);
+int tap_set_ipv6_proc_option_ctx(struct ipop_ctx *ctx, const char *option,
+                                 const char *value);
+void tap_close_ctx(struct ipop_ctx *ctx);
+void tap_close_queue_ctx(struct ipop_ctx *ctx, int fd);
+
+/* The functions below work on the default context, see ipop_ctx_default. */
 int tap_open(const char *device, char *mac);
+int tap_open_mq(const char *device, char *mac, int *fds, int queues,
+                int flags);
+int tap_set_offload(unsigned int offload);
+int tap_set_gso_max_size(unsigned int size);
 int tap_set_base_flags();
 int tap_unset_noarp_flags();
 int tap_set_up();
@@ -50,6 +96,7 @@ int tap_disable_ipv6_autoconfig();
 int tap_set_ipv4_proc_option(const char *option, const char *value);
 int tap_set_ipv6_proc_option(const char *option, const char *value);
 void tap_close();
+void tap_close_queue(int fd);
 
 #ifdef __cplusplus
 }
@@ -36,11 +36,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "ipop_ctx.h"
 #include "peerlist.h"
+#include "translator.h"
 
 // TODO - This limited table size breaks upnp translator when full
 #define TABLE_SIZE 100
 
+// The upnp servers seen in one context (see struct ipop_ctx).
 struct upnp_state {
     uint16_t c_port;
     int s_count;
@@ -48,7 +51,7 @@ struct upnp_state {
     char server_ips[TABLE_SIZE][4];
 };
 
-static struct upnp_state ustate = { 0, 0, { 0 }};
+struct upnp_state upnp_default = { 0, 0, { 0 }};
 
 static int
 update_checksum(unsigned char *buf, const int start, const int idx, ssize_t len)
@@ -89,12 +92,13 @@ update_checksum(unsigned char *buf, const int start, const int idx, ssize_t len)
 }
 
 static int
-is_upnp_endpoint(const char *source, uint16_t s_port)
+is_upnp_endpoint(const struct upnp_state *us, const char *source,
+                 uint16_t s_port)
 {
     int i;
-    for (i = 0; i < ustate.s_count; i++) {
-        if (ustate.s_ports[i] == s_port &&
-            memcmp(source, ustate.server_ips[i], 4) == 0) {
+    for (i = 0; i < us->s_count; i++) {
+        if (us->s_ports[i] == s_port &&
+            memcmp(source, us->server_ips[i], 4) == 0) {
             return 1;
         }
     }
@@ -102,7 +106,8 @@ is_upnp_endpoint(const char *source, uint16_t s_port)
 }
 
 static int
-update_upnp(char *buf, const char *source, const char *dest, ssize_t len)
+update_upnp(struct upnp_state *us, char *buf, const char *source,
+            const char *dest, ssize_t len)
 {
     char tmp[100] = {'\0'};
     int i, idx = 0;
@@ -110,21 +115,21 @@ update_upnp(char *buf, const char *source, const char *dest, ssize_t len)
     uint16_t s_port = (buf[34] << 8 & 0xFF00) + (buf[35] & 0xFF);
 
     if (source == NULL && buf[23] == 0x11 && d_port == 1900) {
-        ustate.c_port = s_port;
+        us->c_port = s_port;
     }
-    else if (source != NULL && buf[23] == 0x11 && ustate.c_port == d_port) {
+    else if (source != NULL && buf[23] == 0x11 && us->c_port == d_port) {
         i = 42;
         while (i < len && idx < TABLE_SIZE) {
             if (strncmp("http://172.", buf + i, 11) == 0) {
-                idx = ustate.s_count++;
+                idx = us->s_count++;
                 memcpy(tmp, buf + i + 7, 12);
 #if defined(LINUX) || defined(ANDROID)
-                inet_aton(tmp, (struct in_addr *)ustate.server_ips[idx]);
+                inet_aton(tmp, (struct in_addr *)us->server_ips[idx]);
 #elif defined(WIN32)
                 RtlIpv4AddressToString((IN_ADDR *)tmp,
-                                       (LPSTR)ustate.server_ips[idx]);
+                                       (LPSTR)us->server_ips[idx]);
 #endif
-                ustate.s_ports[idx] = atoi(buf + i + 20);
+                us->s_ports[idx] = atoi(buf + i + 20);
                 sprintf(buf + i + 16, "%d", source[3]);
                 buf[i + 19] = ':';
                 break;
@@ -133,7 +138,7 @@ update_upnp(char *buf, const char *source, const char *dest, ssize_t len)
         }
     }
     else if (source != NULL && buf[23] == 0x06 &&
-        is_upnp_endpoint(buf + 26, s_port)) {
+        is_upnp_endpoint(us, buf + 26, s_port)) {
         i = 66;
         while (i < len) {
             if (strncmp("http://172.", buf + i, 11) == 0) {
@@ -215,11 +220,56 @@ translate_headers(unsigned char *buf, const char *source, const char *dest,
     return 0;
 }
 
+/**
+ * Like translate_headers, but for packets whose TCP or UDP checksum is still
+ * to be completed by the kernel (VIRTIO_NET_HDR_F_NEEDS_CSUM). The checksum
+ * field of such a packet only holds the folded sum of the pseudo header, so it
+ * is adjusted for the rewritten addresses (RFC 1624) instead of being computed
+ * over the payload.
+ */
 int
-translate_packet(unsigned char *buf, const char *source, const char *dest,
-                 ssize_t len)
+translate_headers_partial(unsigned char *buf, const char *source,
+                          const char *dest, ssize_t len)
+{
+    unsigned char old_addrs[8];
+    uint32_t csum;
+    int i, idx;
+    int l4 = 14 + (buf[14] & 0x0F) * 4;
+
+    memcpy(old_addrs, buf + 26, 8);
+    memcpy(buf + 26, source, 4);
+    if ((buf[30] < 224 || buf[30] > 239) && buf[33] != 255) {
+        memcpy(buf + 30, dest, 4);
+    }
+    update_checksum(buf, 14, 24, 20);
+
+    if (buf[23] == 0x06) {
+        idx = l4 + 16;
+    } else if (buf[23] == 0x11) {
+        idx = l4 + 6;
+    } else {
+        return 0;
+    }
+    if (idx + 2 > len) return -1;
+
+    csum = (buf[idx] << 8) | buf[idx + 1];
+    for (i = 0; i < 8; i += 2) {
+        csum += ~((old_addrs[i] << 8) | old_addrs[i + 1]) & 0xFFFF;
+        csum += (buf[26 + i] << 8) | buf[27 + i];
+    }
+    while (csum >> 16) {
+        csum = (csum & 0xFFFF) + (csum >> 16);
+    }
+    buf[idx] = (csum >> 8) & 0xFF;
+    buf[idx + 1] = csum & 0xFF;
+    return 0;
+}
+
+int
+translate_packet_ctx(struct ipop_ctx *ctx, unsigned char *buf,
+                     const char *source, const char *dest, ssize_t len)
 {
-    update_upnp((char *)buf, source, dest, len);
+    update_upnp(ctx->upnp, (char *)buf, source, dest, len);
     update_sip((char*)buf, source, dest, len);
     return 0;
 }
@@ -232,7 +282,7 @@ update_mac(unsigned char* buf, const char* mac)
 }
 
 int
-create_arp_response(unsigned char *buf)
+create_arp_response_ctx(struct ipop_ctx *ctx, unsigned char *buf)
 {
     struct in_addr dest_ip;
     memcpy(&dest_ip, buf + 38, sizeof(dest_ip));
@@ -242,7 +292,7 @@ create_arp_response(unsigned char *buf)
     // with the broadcast address FF:FF:FF:FF:FF:FF
     // TODO - In future we will need to maintain an ARP table to support
     // node migration with the network
-    if (check_network_range(dest_ip)) {
+    if (check_network_range_ctx(ctx, dest_ip)) {
         char dest_ip[4];
         memcpy(dest_ip, buf + 38, 4);
         memcpy(buf, buf + 6, 6);
@@ -257,6 +307,41 @@ create_arp_response(unsigned char *buf)
     return -1;
 }
 
+/**
+ * Allocates the upnp state of a context made by ipop_ctx_new. Returns NULL on
+ * failure.
+ */
+struct upnp_state *
+upnp_state_new()
+{
+    struct upnp_state *us = calloc(1, sizeof(struct upnp_state));
+    if (us == NULL) {
+        fprintf(stderr, "Not enough memory to allocate upnp state.\n");
+    }
+    return us;
+}
+
+void
+upnp_state_free(struct upnp_state *us)
+{
+    free(us);
+}
+
+// translate_packet and create_arp_response work on the default context (see
+// ipop_ctx_default)
+int
+translate_packet(unsigned char *buf, const char *source, const char *dest,
+                 ssize_t len)
+{
+    return translate_packet_ctx(ipop_ctx_default(), buf, source, dest, len);
+}
+
+int
+create_arp_response(unsigned char *buf)
+{
+    return create_arp_response_ctx(ipop_ctx_default(), buf);
+}
+
 int
 create_arp_response_sw(unsigned char *buf, unsigned char *mac, unsigned char *my_ip4)
 {
@@ -310,3 +395,78 @@ is_icc(const unsigned char *buf)
   return buf[40] == 0x00 && buf[41] == 0x69 && buf[42] == 0x70 &&
          buf[43] == 0x6f && buf[44] == 0x70;
 }
+
+/**
+ * Mixes `len` bytes at `data` into the FNV-1a hash `hash`.
+ */
+static uint32_t
+hash_bytes(uint32_t hash, const unsigned char *data, int len)
+{
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Mixes the bits of `hash` so that the low bits, which pick the worker, depend
+ * on all of them. FNV alone leaves them poorly mixed.
+ */
+static uint32_t
+hash_finish(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+/**
+ * Hashes the flow a bare IP packet of `len` bytes belongs to: the addresses,
+ * protocol and ports of TCP and UDP packets, and the addresses and protocol of
+ * other IP packets (and of fragments). All packets of a flow get the same
+ * hash.
+ */
+uint32_t
+flow_hash_ip(const unsigned char *ip, int len)
+{
+    uint32_t hash = 2166136261u;
+    int l4 = -1, proto = 0;
+
+    if (len >= 20 && (ip[0] >> 4) == 0x04) {
+        proto = ip[9];
+        hash = hash_bytes(hash, ip + 9, 1);
+        hash = hash_bytes(hash, ip + 12, 8);
+        // only the first fragment has the ports, so fragments go without
+        if ((ip[6] & 0x3f) == 0 && ip[7] == 0) {
+            l4 = (ip[0] & 0x0f) * 4;
+        }
+    } else if (len >= 40 && (ip[0] >> 4) == 0x06) {
+        proto = ip[6];
+        hash = hash_bytes(hash, ip + 6, 1);
+        hash = hash_bytes(hash, ip + 8, 32);
+        l4 = 40;
+    } else {
+        hash = hash_bytes(hash, ip, len < 20 ? len : 20);
+    }
+    if (l4 > 0 && (proto == 6 || proto == 17) && len >= l4 + 4) {
+        hash = hash_bytes(hash, ip + l4, 4);
+    }
+    return hash_finish(hash);
+}
+
+/**
+ * Hashes the flow an ethernet frame of `len` bytes belongs to, like
+ * flow_hash_ip for IP packets, and by the MAC addresses for anything else or
+ * for every frame when `by_mac` is set.
+ */
+uint32_t
+flow_hash(const unsigned char *buf, int len, int by_mac)
+{
+    if (!by_mac && len >= 14 &&
+        ((buf[12] == 0x08 && buf[13] == 0x00) ||
+         (buf[12] == 0x86 && buf[13] == 0xdd))) {
+        return flow_hash_ip(buf + 14, len - 14);
+    }
+    return hash_finish(hash_bytes(2166136261u, buf, len < 12 ? len : 12));
+}
@@ -28,20 +28,38 @@
 #ifndef _TRANSLATOR_H_
 #define _TRANSLATOR_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct ipop_ctx;
+struct upnp_state; // the upnp servers seen in one ipop_ctx
+
+extern struct upnp_state upnp_default; // the upnp state of ipop_ctx_default
+
+struct upnp_state * upnp_state_new();
+void upnp_state_free(struct upnp_state *us);
+
 int translate_headers(unsigned char *buf, const char *source, const char *dest,
                       ssize_t len);
 
+int translate_headers_partial(unsigned char *buf, const char *source,
+                              const char *dest, ssize_t len);
+
 int translate_packet(unsigned char *buf, const char *source, const char *dest,
                      ssize_t len);
 
+int translate_packet_ctx(struct ipop_ctx *ctx, unsigned char *buf,
+                         const char *source, const char *dest, ssize_t len);
+
 int update_mac(unsigned char *buf, const char* mac);
 
 int create_arp_response(unsigned char *buf);
 
+int create_arp_response_ctx(struct ipop_ctx *ctx, unsigned char *buf);
+
 int create_arp_response_sw(unsigned char *buf, unsigned char *mac, unsigned char *my_ip4);
 
 int is_nonunicast(const unsigned char *buf);
@@ -56,6 +74,10 @@ int is_my_ip4(const unsigned char *buf, const unsigned char *my_ip4);
 
 int is_icc(const unsigned char * buf);
 
+uint32_t flow_hash(const unsigned char *buf, int len, int by_mac);
+
+uint32_t flow_hash_ip(const unsigned char *ip, int len);
+
 #ifdef __cplusplus
 }
 #endif
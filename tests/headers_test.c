@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <headers.h>
+
+#include <minunit.h>
+
+static char *test_int(int first, int second)
+{
+    printf("%d = %d\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+// appends a frame of `len` bytes filled with `fill` to the container at `buf`
+// of `*used` bytes
+static void put_frame(unsigned char *buf, int *used, int len, int fill)
+{
+    buf[*used] = len >> 8;
+    buf[*used + 1] = len & 0xFF;
+    memset(buf + *used + AGG_PREFIX_LEN, fill, len);
+    *used += AGG_PREFIX_LEN + len;
+}
+
+// walks the container and returns the number of frames in it, checking that
+// each holds the fill of its position
+static int count_frames(const unsigned char *buf, int len, const int *lens)
+{
+    const unsigned char *frame;
+    int offset = 0, frame_len, count = 0;
+    while ((frame = get_aggregate_frame(buf, len, &offset, &frame_len))
+           != NULL) {
+        if (frame_len != lens[count] || frame[0] != count + 1 ||
+            frame[frame_len - 1] != count + 1) {
+            return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned char buf[4096];
+    const int lens[] = { 60, 1, 1400 };
+    int used = AGG_MAGIC_LEN;
+    int flags, epoch, index;
+
+    // containers
+    memcpy(buf, aggregate_magic, AGG_MAGIC_LEN);
+    for (int i = 0; i < 3; i++) put_frame(buf, &used, lens[i], i + 1);
+    printf("%s\n", test_int(is_aggregate(buf, used), 1));
+    printf("%s\n", test_int(is_aggregate(buf, AGG_MAGIC_LEN - 1), 0));
+    printf("%s\n", test_int(count_frames(buf, used, lens), 3));
+    printf("%s\n", test_int(count_frames(buf, AGG_MAGIC_LEN, lens), 0));
+
+    // a prefix cut in half, and a frame that runs past the end
+    printf("%s\n", test_int(count_frames(buf, used - 1400 - 1, lens), 2));
+    printf("%s\n", test_int(count_frames(buf, used - 1, lens), 2));
+
+    // a zero length prefix ends the walk
+    int zero = used;
+    put_frame(buf, &zero, 0, 0);
+    put_frame(buf, &zero, 10, 4);
+    printf("%s\n", test_int(count_frames(buf, zero, lens), 3));
+
+    // a frame (here IPv4) is not a container
+    buf[0] = 0x45;
+    printf("%s\n", test_int(is_aggregate(buf, used), 0));
+
+    // compact headers
+    set_compact_header(buf, COMPACT_F_HELLO | COMPACT_F_ASK, 0xABC, 0x123);
+    printf("%s\n", test_int(get_compact_header(buf, &flags, &epoch, &index),
+                            0));
+    printf("%s\n", test_int(flags, COMPACT_F_HELLO | COMPACT_F_ASK));
+    printf("%s\n", test_int(epoch, 0xABC));
+    printf("%s\n", test_int(index, 0x123));
+
+    set_compact_header(buf, 0x10, 0x1FFF, 0x1FFFF);
+    printf("%s\n", test_int(get_compact_header(buf, &flags, &epoch, &index),
+                            0));
+    printf("%s\n", test_int(flags, 0));
+    printf("%s\n", test_int(epoch, 0xFFF));
+    printf("%s\n", test_int(index, 0xFFF));
+
+    // another version, or the start of an ipop header
+    buf[0] = ((COMPACT_VERSION + 1) << 4);
+    printf("%s\n", test_int(get_compact_header(buf, &flags, &epoch, &index),
+                            -1));
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <string.h>
+#include <ipop_ctx.h>
+#include <peerlist.h>
+
+#include <minunit.h>
+
+static char *test_int(int first, int second)
+{
+    printf("%d = %d\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+    struct ipop_ctx *a = ipop_ctx_new();
+    struct ipop_ctx *b = ipop_ctx_new();
+    struct peer_state *peer = NULL;
+    char local_id[ID_SIZE] = "localid";
+    char id[ID_SIZE] = "aliceid";
+
+    printf("%s\n", test_int(a != NULL && b != NULL, 1));
+    ret = peerlist_set_local_p_ctx(a, local_id, "172.31.0.100",
+                                   "fd50:dbc:41f2:4a3c:8b41:299c:8481:f88c");
+    printf("%s\n", test_int(ret, 0));
+    ret = peerlist_set_local_p_ctx(b, local_id, "172.16.0.100",
+                                   "fd50:dbc:41f2:4a3c:8b41:299c:8481:f88d");
+    printf("%s\n", test_int(ret, 0));
+
+    // the same peer only exists in the context it was added to
+    ret = peerlist_add_p_ctx(a, id, "192.168.5.2",
+                             "fd50:dbc:41f2:4a3c:aa8e:11f8:7841:dd68", 5800);
+    printf("%s\n", test_int(ret, 0));
+    printf("%s\n", test_int(peerlist_get_by_id_ctx(a, id, &peer), 0));
+    printf("%s\n", test_int(peer->port, 5800));
+    printf("%s\n", test_int(peerlist_get_by_id_ctx(b, id, &peer), -1));
+    peerlist_init();
+    printf("%s\n", test_int(peerlist_get_by_id(id, &peer), -1));
+
+    printf("%s\n", test_int(peerlist_local_ctx(b)->local_ipv4_addr.s_addr ==
+                            peerlist_local_ctx(a)->local_ipv4_addr.s_addr, 0));
+
+    ipop_ctx_free(a);
+    ipop_ctx_free(b);
+    return 0;
+}
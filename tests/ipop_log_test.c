@@ -0,0 +1,70 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ipop_log.h>
+
+#include <minunit.h>
+
+#define THREADS 4
+#define COUNT 100000
+
+static char *test_int(int first, int second)
+{
+    printf("%d = %d\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+static void *storm(void *data)
+{
+    for (int i = 0; i < COUNT; i++) {
+        IPOP_LOG("unknown IP packet type: 0x%x\n", i & 0xF);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t threads[THREADS];
+    char line[256];
+    int lines = 0, total = 0;
+    unsigned long long count = 0, dropped = 0;
+
+    // stderr goes to a file that is read back below
+    FILE *log = tmpfile();
+    int saved = dup(fileno(stderr));
+    dup2(fileno(log), fileno(stderr));
+
+    printf("%s\n", test_int(ipop_log_start(), 0));
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, storm, NULL);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    ipop_log_stop();
+
+    fflush(stderr);
+    dup2(saved, fileno(stderr));
+    rewind(log);
+    while (fgets(line, sizeof(line), log) != NULL) {
+        unsigned long long more;
+        fputs(line, stderr);
+        lines++;
+        if (sscanf(line, "(%llu more)", &more) == 1) {
+            total += more;
+        } else if (strstr(line, "occurrences") != NULL) {
+            sscanf(strrchr(line, ':'), ": %llu occurrences, %llu dropped",
+                   &count, &dropped);
+        } else {
+            total++;
+        }
+    }
+    // a storm is collapsed into a few lines, none of it goes missing
+    printf("%s\n", test_int(lines < 20, 1));
+    printf("%s\n", test_int(total, THREADS * COUNT));
+    printf("%s\n", test_int(count, THREADS * COUNT));
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <offload.h>
+
+#include <minunit.h>
+
+#define MSS 1000
+#define PAYLOAD (3 * MSS + 333)
+
+static char *test_int(int first, int second)
+{
+    printf("%d = %d\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+static uint32_t sum16(const unsigned char *data, int len)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2) {
+        sum += data[i] << 8;
+        if (i + 1 < len) sum += data[i + 1];
+    }
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum)
+{
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+// a TCP super-frame over IPv4 or IPv6 as a tap with TSO hands it over, with
+// the sum of its pseudo header in the checksum field, returns its length
+static int build(unsigned char *frame, int ipv4)
+{
+    int l3 = 14, l4 = ipv4 ? 34 : 54;
+    int len = l4 + 20 + PAYLOAD;
+    uint32_t sum;
+
+    memset(frame, 0, len);
+    if (ipv4) {
+        frame[12] = 0x08;
+        frame[l3] = 0x45;
+        frame[l3 + 4] = 0x12;
+        frame[l3 + 8] = 64;
+        frame[l3 + 9] = 0x06;
+        memcpy(frame + l3 + 12, "\xac\x1f\x00\x05\xac\x1f\x00\x64", 8);
+        sum = sum16(frame + l3 + 12, 8);
+    } else {
+        frame[12] = 0x86;
+        frame[13] = 0xdd;
+        frame[l3] = 0x60;
+        frame[l3 + 6] = 0x06;
+        frame[l3 + 7] = 64;
+        frame[l3 + 8] = 0xfd;
+        frame[l3 + 23] = 0x05;
+        frame[l3 + 24] = 0xfd;
+        frame[l3 + 39] = 0x64;
+        sum = sum16(frame + l3 + 8, 32);
+    }
+    frame[l4 + 1] = 0x50;
+    frame[l4 + 4] = 0xff; // the sequence number wraps along the way
+    frame[l4 + 5] = 0xff;
+    frame[l4 + 6] = 0xf0;
+    frame[l4 + 12] = 0x50;
+    frame[l4 + 13] = 0x19; // FIN, PSH and ACK
+    for (int i = l4 + 20; i < len; i++) frame[i] = i * 13;
+    sum = fold(sum + 0x06 + 20 + PAYLOAD);
+    frame[l4 + 16] = sum >> 8;
+    frame[l4 + 17] = sum & 0xFF;
+    return len;
+}
+
+static char *test_gso(int ipv4)
+{
+    static unsigned char frame[OFFLOAD_FRAME_MAX], seg[2048];
+    struct virtio_net_hdr vnet;
+    struct gso_state gso;
+    int l3 = 14, l4 = ipv4 ? 34 : 54;
+    int len = build(frame, ipv4), seg_len, count = 0, payload = 0;
+    int checksums_ok = 1, seq_ok = 1, flags_ok = 1;
+    uint32_t seq0, seq;
+
+    memset(&vnet, 0, sizeof(vnet));
+    vnet.gso_type = ipv4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+    vnet.gso_size = MSS;
+    printf("%s\n", test_int(gso_init(&gso, &vnet, frame, len), 0));
+
+    memcpy(&seq0, frame + l4 + 4, 4);
+    while ((seg_len = gso_next(&gso, seg)) > 0) {
+        int tcp_len = seg_len - l4;
+        uint32_t sum;
+        if (ipv4) {
+            if (fold(sum16(seg + l3, 20)) != 0xFFFF) checksums_ok = 0;
+            if (((seg[l3 + 2] << 8) | seg[l3 + 3]) != seg_len - l3) {
+                checksums_ok = 0;
+            }
+            sum = sum16(seg + l3 + 12, 8);
+        } else {
+            if (((seg[l3 + 4] << 8) | seg[l3 + 5]) != tcp_len) {
+                checksums_ok = 0;
+            }
+            sum = sum16(seg + l3 + 8, 32);
+        }
+        sum += 0x06 + tcp_len + sum16(seg + l4, tcp_len);
+        if (fold(sum) != 0xFFFF) checksums_ok = 0;
+
+        memcpy(&seq, seg + l4 + 4, 4);
+        if (ntohl(seq) != ntohl(seq0) + payload) seq_ok = 0;
+        if (memcmp(seg + l4 + 20, frame + l4 + 20 + payload,
+                   tcp_len - 20) != 0) {
+            seq_ok = 0;
+        }
+        // FIN and PSH only on the last segment
+        if ((seg[l4 + 13] & 0x09) != (payload + tcp_len - 20 == PAYLOAD ?
+                                      0x09 : 0)) {
+            flags_ok = 0;
+        }
+        payload += tcp_len - 20;
+        count++;
+    }
+    printf("%s\n", test_int(count, 4));
+    printf("%s\n", test_int(payload, PAYLOAD));
+    printf("%s\n", test_int(checksums_ok, 1));
+    printf("%s\n", test_int(seq_ok, 1));
+    printf("%s\n", test_int(flags_ok, 1));
+    return "MATCH";
+}
+
+int main()
+{
+    printf("ipv4: %s\n", test_gso(1));
+    printf("ipv6: %s\n", test_gso(0));
+    return 0;
+}
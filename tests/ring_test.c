@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <ring.h>
+
+#include <minunit.h>
+
+#define COUNT 1000000
+
+static struct spsc_ring ring;
+
+static char *test_int(int first, int second)
+{
+    printf("%d = %d\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+static void *producer(void *data)
+{
+    for (int i = 0; i < COUNT; i++) {
+        while (spsc_ring_push(&ring, &i) < 0);
+    }
+    spsc_ring_close(&ring);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int ret, value, expected = 0, in_order = 1;
+    pthread_t thread;
+
+    ret = spsc_ring_init(&ring, 100, sizeof(int));
+    printf("%s\n", test_int(ret, 0));
+    printf("%s\n", test_int(spsc_ring_capacity(&ring), 128));
+    printf("%s\n", test_int(spsc_ring_pop(&ring, &value), -1));
+
+    pthread_create(&thread, NULL, producer, NULL);
+    while (spsc_ring_wait(&ring) == 0) {
+        while (spsc_ring_pop(&ring, &value) == 0) {
+            if (value != expected++) in_order = 0;
+        }
+    }
+    pthread_join(thread, NULL);
+    printf("%s\n", test_int(expected, COUNT));
+    printf("%s\n", test_int(in_order, 1));
+
+    spsc_ring_free(&ring);
+    return 0;
+}
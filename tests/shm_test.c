@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <shm.h>
+
+#include <minunit.h>
+
+#define COUNT 1000000
+
+static char *test_int(int first, int second)
+{
+    printf("%d = %d\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+// the upper layer, in a process of its own
+static int producer(struct ipop_shm *created)
+{
+    struct ipop_shm shm;
+    struct ipop_shm_ring *ring;
+
+    if (ipop_shm_attach(&shm, dup(created->fd),
+                        dup(created->rings[IPOP_SHM_UP].efd),
+                        dup(created->rings[IPOP_SHM_DOWN].efd)) < 0) {
+        return 1;
+    }
+    ring = &shm.rings[IPOP_SHM_DOWN];
+    for (int i = 0; i < COUNT; i++) {
+        struct iovec iov = { .iov_base = &i, .iov_len = sizeof(i) };
+        while (ipop_shm_send(ring, &iov, 1, 0, 0) < 0);
+    }
+    ipop_shm_close(ring);
+    ipop_shm_destroy(&shm);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct ipop_shm shm;
+    struct ipop_shm_ring *ring;
+    int ret, value, status, expected = 0, in_order = 1;
+    unsigned char *slot;
+    size_t len;
+    pid_t pid;
+
+    ret = ipop_shm_create(&shm, 100, 60);
+    printf("%s\n", test_int(ret, 0));
+    ring = &shm.rings[IPOP_SHM_DOWN];
+    printf("%s\n", test_int(ring->mask + 1, 128));
+    printf("%s\n", test_int(ring->slot_size, 64));
+    printf("%s\n", test_int(ipop_shm_peek(ring, &len) == NULL, 1));
+
+    if ((pid = fork()) == 0) _exit(producer(&shm));
+    while (ipop_shm_wait(ring) == 0) {
+        while ((slot = ipop_shm_peek(ring, &len)) != NULL) {
+            memcpy(&value, slot, sizeof(value));
+            if (len != sizeof(value) || value != expected++) in_order = 0;
+            ipop_shm_release(ring);
+        }
+    }
+    waitpid(pid, &status, 0);
+    printf("%s\n", test_int(status, 0));
+    printf("%s\n", test_int(expected, COUNT));
+    printf("%s\n", test_int(in_order, 1));
+
+    ipop_shm_destroy(&shm);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include <translator.h>
+#include <minunit.h>
+
+#define PAYLOAD 333 // odd, so the last byte of the sum is padded
+
+static char *test_int(int first, int second)
+{
+    printf("%x = %x\n", first, second);
+    mu_assert("MISMATCH", first == second);
+    return "MATCH";
+}
+
+static uint32_t sum16(const unsigned char *data, int len)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2) {
+        sum += data[i] << 8;
+        if (i + 1 < len) sum += data[i + 1];
+    }
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum)
+{
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+// ethernet and IPv4 headers in front of a TCP or UDP segment from 10.0.0.1 to
+// 10.0.0.2, returns the length of the frame
+static int build(unsigned char *buf, int proto)
+{
+    int l4_len = (proto == 0x06 ? 20 : 8) + PAYLOAD;
+    memset(buf, 0, 14 + 20 + l4_len);
+    buf[12] = 0x08;
+    buf[14] = 0x45;
+    buf[16] = (20 + l4_len) >> 8;
+    buf[17] = (20 + l4_len) & 0xFF;
+    buf[22] = 64;
+    buf[23] = proto;
+    memcpy(buf + 26, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+    buf[34] = 0x30;
+    buf[35] = 0x39;
+    buf[37] = 0x50;
+    if (proto == 0x06) {
+        buf[46] = 0x50;
+        buf[47] = 0x18;
+    } else {
+        buf[38] = l4_len >> 8;
+        buf[39] = l4_len & 0xFF;
+    }
+    for (int i = 14 + 20 + l4_len - PAYLOAD; i < 14 + 20 + l4_len; i++) {
+        buf[i] = i * 7;
+    }
+    return 14 + 20 + l4_len;
+}
+
+// sum of the pseudo header of the IPv4 packet in `buf`
+static uint32_t pseudo(const unsigned char *buf, int len)
+{
+    return sum16(buf + 26, 8) + buf[23] + (len - 34);
+}
+
+static char *test_partial(int proto)
+{
+    unsigned char partial[2048], full[2048];
+    const char source[4] = { 172, 31, 0, 5 };
+    const char dest[4] = { 172, 31, 0, 100 };
+    int idx = (proto == 0x06) ? 34 + 16 : 34 + 6;
+    int len = build(partial, proto);
+    uint16_t csum;
+
+    // what the kernel leaves in a VIRTIO_NET_HDR_F_NEEDS_CSUM packet
+    csum = fold(pseudo(partial, len));
+    partial[idx] = csum >> 8;
+    partial[idx + 1] = csum & 0xFF;
+    mu_assert("TRANSLATE FAILED",
+              translate_headers_partial(partial, source, dest, len) == 0);
+    // and what it does with it on transmit
+    csum = ~fold(sum16(partial + 34, len - 34));
+    partial[idx] = csum >> 8;
+    partial[idx + 1] = csum & 0xFF;
+
+    build(full, proto);
+    memcpy(full + 26, source, 4);
+    memcpy(full + 30, dest, 4);
+    csum = ~fold(pseudo(full, len) + sum16(full + 34, len - 34));
+    full[idx] = csum >> 8;
+    full[idx + 1] = csum & 0xFF;
+
+    printf("%s\n", test_int(fold(sum16(partial + 14, 20)), 0xFFFF));
+    printf("%s\n", test_int((partial[idx] << 8) | partial[idx + 1],
+                            (full[idx] << 8) | full[idx + 1]));
+    mu_assert("MISMATCH", memcmp(partial + 26, full + 26, len - 26) == 0);
+    return "MATCH";
+}
+
+int main()
+{
+    unsigned char buf[64] = { 0 };
+
+    printf("tcp: %s\n", test_partial(0x06));
+    printf("udp: %s\n", test_partial(0x11));
+
+    // a packet cut before its checksum field
+    buf[14] = 0x45;
+    buf[23] = 0x06;
+    printf("%s\n", test_int(translate_headers_partial(buf, "abcd", "efgh",
+                                                      40), -1));
+    return 0;
+}